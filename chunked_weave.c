@@ -0,0 +1,433 @@
+/* Chunked weaves: a weave represented as a list of fixed-size chunks, each of
+   which is a little vector weave. Applying a patch still takes one pass over
+   the weave to find where its chains go, but inserting a chain only moves the
+   atoms after it in its own chunk, splitting the chunk if it overflows. The
+   rest of the weave stays where it is.
+
+   Positions in a chunked weave are (chunk, index) pairs. The pass over the
+   weave records one of these for each insertion, along with its index in the
+   weave as a whole, and the insertions are done back to front. Inserting at a
+   position never moves anything before it, so the positions recorded for the
+   earlier insertions stay valid. */
+
+#include "sburb.h"
+
+/* Allocate an empty chunk. Returns NULL on malloc() failure. */
+static inline chunk_t *new_chunk(void) {
+  chunk_t *chunk = malloc(sizeof(chunk_t));
+  if (chunk == NULL) return NULL;
+  chunk->next = NULL; chunk->length = 0;
+  return chunk;
+}
+
+/* Allocate and return a new chunked weave, blank but for the start and end
+   atoms. If memory allocation fails, the weave will have a NULL head. */
+chunked_weave_t new_chunked_weave(void) {
+  chunked_weave_t weave;
+  weave.head        = new_chunk();
+  weave.length      = 2;
+  weave.chunk_count = 1;
+  weave.weft        = (weft_t)NULL;
+  weave.memodict    = (memodict_t)NULL;
+  weave.wset        = (waitset_t)NULL;
+  if (weave.head == NULL) return weave;
+
+  uint64_t *ids = weave.head->ids, *preds = weave.head->preds;
+  uint32_t *chars = weave.head->chars;
+  WRITE_ATOM(PACK_ID(0, 1), PACK_ID(0, 1), ATOM_CHAR_START, ids, preds, chars);
+  WRITE_ATOM(PACK_ID(0, 2), PACK_ID(0, 1), ATOM_CHAR_END,   ids, preds, chars);
+  weave.head->length = 2;
+  return weave;
+}
+
+/* Delete a chunked weave, and free its memory. */
+void delete_chunked_weave(chunked_weave_t weave) {
+  chunk_t *chunk = weave.head;
+  while (chunk != NULL) {
+    chunk_t *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  delete_weft(weave.weft);
+  delete_memodict(weave.memodict);
+  delete_waitset(weave.wset);
+}
+
+/* Print a chunked weave, for debugging. Same format as weave_print(), with a
+   line between chunks. */
+void chunked_weave_print(chunked_weave_t weave) {
+  uint64_t id, pred; uint32_t c;
+
+  for (chunk_t *chunk = weave.head; chunk != NULL; chunk = chunk->next) {
+    uint64_t *ids = chunk->ids, *preds = chunk->preds; uint32_t *chars = chunk->chars;
+    for (uint32_t i = 0; i < chunk->length; i++) {
+      READ_ATOM(id, pred, c, ids, preds, chars);
+      printf("<id: %u,%u\tpred: %u,%u\t",
+             YARN(id), OFFSET(id), YARN(pred), OFFSET(pred));
+      if (c < 128) printf("%c>\n", (char)c);
+      else printf("0x%X>\n", c);
+    }
+    if (chunk->next != NULL) printf("--\n");
+  }
+  printf("\n");
+}
+
+
+/********************************** Cursors ***********************************/
+
+/* A cursor is a traversal state, minus the atom count: it points at the next
+   atom to be read. Cursors are kept normalized, so that the index is only ever
+   equal to the chunk length in the last chunk. That way, every position in the
+   weave has exactly one cursor. */
+
+/* Normalize a cursor. */
+static inline void cursor_normalize(chunked_traversal_state_t *cur) {
+  if (cur->i == cur->chunk->length && cur->chunk->next != NULL) {
+    cur->chunk = cur->chunk->next; cur->i = 0;
+  }
+}
+
+/* Look at the atom under a cursor without moving it. Returns FALSE at the end
+   of the weave. */
+static inline int cursor_peek(chunked_traversal_state_t *cur, uint64_t *id,
+                              uint64_t *pred, uint32_t *c) {
+  if (cur->i == cur->chunk->length) return FALSE;
+  READ_ATOM_IDX(*id, *pred, *c, cur->chunk->ids, cur->chunk->preds,
+                cur->chunk->chars, cur->i);
+  return TRUE;
+}
+
+/* Move a cursor to the next atom. */
+static inline void cursor_advance(chunked_traversal_state_t *cur) {
+  cur->i++;
+  cursor_normalize(cur);
+}
+
+/* Read the atom under a cursor and move past it. Returns FALSE at the end of
+   the weave. */
+static inline int cursor_read(chunked_traversal_state_t *cur, uint64_t *id,
+                              uint64_t *pred, uint32_t *c) {
+  if (!cursor_peek(cur, id, pred, c)) return FALSE;
+  cursor_advance(cur);
+  return TRUE;
+}
+
+
+/********************************* Insertion **********************************/
+
+/* Copy len atoms from a sequential chain into a chunk at index i, which must
+   have room for them. Returns a pointer to the rest of the chain. */
+static inline uint32_t *chunk_write_chain(chunk_t *chunk, uint32_t i,
+                                          uint32_t *chain, uint32_t len) {
+  uint64_t id, pred; uint32_t c;
+  for (uint32_t j = i; j < i + len; j++) {
+    READ_ATOM_SEQ(id, pred, c, chain);
+    WRITE_ATOM_IDX(id, pred, c, chunk->ids, chunk->preds, chunk->chars, j);
+  }
+  return chain;
+}
+
+/* Move count atoms within a chunk, or between chunks, from index src to index
+   dest. The ranges may overlap. */
+static inline void chunk_move(chunk_t *to, uint32_t dest, chunk_t *from,
+                              uint32_t src, uint32_t count) {
+  memmove(to->ids + dest, from->ids + src, count * sizeof(uint64_t));
+  memmove(to->preds + dest, from->preds + src, count * sizeof(uint64_t));
+  memmove(to->chars + dest, from->chars + src, count * sizeof(uint32_t));
+}
+
+/* Insert a chain of len atoms into a chunked weave, before the atom at index i
+   of the given chunk. Only this chunk is changed; if the chain won't fit, the
+   chunk is split, and new chunks are put after it. Does not modify the weft.
+   Returns 0 on success, -1 on malloc() failure, in which case the weave is
+   unchanged. */
+static int chunk_insert(chunked_weave_t *weave, chunk_t *chunk, uint32_t i,
+                        uint32_t *chain, uint32_t len) {
+  uint32_t tail_len = chunk->length - i;
+
+  /* Common case: it fits. */
+  if (chunk->length + len <= CHUNK_ATOMS) {
+    chunk_move(chunk, i + len, chunk, i, tail_len);
+    chunk_write_chain(chunk, i, chain, len);
+    chunk->length += len;
+    weave->length += len;
+    return 0;
+  }
+
+  /* The chain fills this chunk from i on, and then as many new chunks as it
+     takes; the atoms after the insertion point go at the end of the last of
+     those, or in a new chunk of their own if they don't fit. Get every new
+     chunk before changing anything, so that running out of memory leaves the
+     weave as it was. */
+  uint32_t over = i + len > CHUNK_ATOMS ? i + len - CHUNK_ATOMS : 0;
+  uint32_t fresh_count = (over + CHUNK_ATOMS - 1) / CHUNK_ATOMS;
+  uint32_t last_len = fresh_count == 0 ? i + len :
+    over - (fresh_count - 1) * CHUNK_ATOMS;
+  int tail_chunk = tail_len > 0 && last_len + tail_len > CHUNK_ATOMS;
+  chunk_t *first = NULL, **link = &first;
+  for (uint32_t k = 0; k < fresh_count + tail_chunk; k++) {
+    if ((*link = new_chunk()) == NULL) {
+      while (first != NULL) {
+        chunk_t *next = first->next;
+        free(first); first = next;
+      }
+      return -1;
+    }
+    link = &(*link)->next;
+  }
+
+  /* Move the atoms after the insertion point to where they end up, which is
+     always in a new chunk, and then write the chain in. */
+  chunk_t *last = chunk;
+  for (uint32_t k = 0; k < fresh_count; k++) last = k == 0 ? first : last->next;
+  if (tail_chunk) {
+    chunk_t *tail = fresh_count == 0 ? first : last->next;
+    chunk_move(tail, 0, chunk, i, tail_len);
+    tail->length = tail_len;
+  } else {
+    chunk_move(last, last_len, chunk, i, tail_len);
+  }
+  *link = chunk->next; chunk->next = first;
+  weave->chunk_count += fresh_count + tail_chunk;
+  weave->length += len;
+
+  chunk_t *cur = chunk;
+  uint32_t n = MIN(len, CHUNK_ATOMS - i);
+  chain = chunk_write_chain(cur, i, chain, n);
+  cur->length = i + n; len -= n;
+  while (len > 0) {
+    cur = cur->next;
+    n = MIN(len, CHUNK_ATOMS);
+    chain = chunk_write_chain(cur, 0, chain, n);
+    cur->length = n; len -= n;
+  }
+  if (!tail_chunk) last->length += tail_len;
+  return 0;
+}
+
+/* Record an insertion in an insertion vector. The vector holds five words per
+   insertion: the index in the weave as a whole, the chunk and the index in the
+   chunk, the chain length, and the chain. */
+static inline vector_t insvec_add(vector_t insvec, uint32_t index,
+                                  chunked_traversal_state_t *pos,
+                                  uint32_t len, void *chain) {
+  insvec = vector_append(insvec, (Word_t)index);
+  insvec = vector_append(insvec, (Word_t)pos->chunk);
+  insvec = vector_append(insvec, (Word_t)pos->i);
+  insvec = vector_append(insvec, (Word_t)len);
+  insvec = vector_append(insvec, (Word_t)chain);
+  return insvec;
+}
+
+/* Does insertion record a go after insertion record b? Records are ordered by
+   index in the weave, except that deletors go right after the atoms they
+   delete, so they come before any chains at the same index. */
+static inline int insrec_after(Word_t *a, Word_t *b) {
+  if (a[0] != b[0]) return a[0] > b[0];
+  return ((uint32_t *)b[4])[4] == ATOM_CHAR_DEL &&
+         ((uint32_t *)a[4])[4] != ATOM_CHAR_DEL;
+}
+
+/* Sort an insertion vector. The sort is stable, so that insertions at the same
+   index stay in the order they were found. It's an insertion sort, because
+   the vector is nearly always already sorted. */
+static void insvec_sort(vector_t insvec) {
+  Word_t *recs = insvec + 2; Word_t n = VECTOR_LEN(insvec) / 5;
+  for (Word_t k = 1; k < n; k++) {
+    Word_t rec[5], j = k;
+    if (!insrec_after(recs + 5*(k-1), recs + 5*k)) continue;
+    memcpy(rec, recs + 5*k, sizeof(rec));
+    while (j > 0 && insrec_after(recs + 5*(j-1), rec)) {
+      memcpy(recs + 5*j, recs + 5*(j-1), sizeof(rec)); j--;
+    }
+    memcpy(recs + 5*j, rec, sizeof(rec));
+  }
+}
+
+/* Apply a sorted insertion vector to a chunked weave, back to front. Returns 0
+   on success, -1 on malloc() failure. */
+static int apply_chunked_insvec(chunked_weave_t *weave, vector_t insvec) {
+  Word_t *rec = insvec + 2 + VECTOR_LEN(insvec);
+  while (rec > insvec + 2) {
+    rec -= 5;
+    LIFTERR(chunk_insert(weave, (chunk_t *)rec[1], (uint32_t)rec[2],
+                         (uint32_t *)rec[4], (uint32_t)rec[3]));
+  }
+  return 0;
+}
+
+
+/****************************** Applying patches ******************************/
+
+/* Find where an insertion chain goes, given a cursor pointing just past its
+   anchor and the index there. Works just like apply_patch(): skip the anchor's
+   deletors, then step over the causal blocks of any siblings that the chain's
+   head doesn't know about and that sort after it. On success, sets *pos and
+   *index to the insertion point and returns 0. */
+static int find_insertion_point(chunked_weave_t *weave, uint64_t id_head,
+                                uint64_t pred_head,
+                                chunked_traversal_state_t *pos, uint32_t *index) {
+  uint64_t id_neighbor, p; uint32_t c;
+
+  /* Skip past any deletor atoms. */
+  while (cursor_peek(pos, &id_neighbor, &p, &c) && c == ATOM_CHAR_DEL) {
+    cursor_advance(pos); (*index)++;
+  }
+
+  weft_t head_weft = pull(weave->memodict, id_head, pred_head);
+  if (head_weft == ERRWEFT) return -1;
+
+  while (cursor_peek(pos, &id_neighbor, &p, &c)) {
+    /* If we're aware of the right neighbor, insert the chain here. */
+    if (weft_covers(head_weft, id_neighbor)) {
+      weft_release(head_weft); return 0;
+    }
+
+    /* Otherwise, insert here if our weft is greater than the neighbor's. */
+    uint64_t rid = id_neighbor;
+    weft_t r_weft = pull(weave->memodict, rid, 0);
+    if (weft_gt(head_weft, r_weft)) {
+      weft_release(head_weft); weft_release(r_weft); return 0;
+    }
+
+    /* Step past the causal block of r: stop at the first atom whose
+       predecessor isn't r, and which r is aware of. */
+    cursor_advance(pos); (*index)++;
+    while (cursor_peek(pos, &id_neighbor, &p, &c) &&
+           !(p != rid && weft_covers(r_weft, p))) {
+      cursor_advance(pos); (*index)++;
+    }
+    weft_release(r_weft);
+  }
+
+  weft_release(head_weft);
+  return -1;                    /* Ran off the end; shouldn't happen */
+}
+
+/* Apply a patch that's ready to a chunked weave. */
+static int chunked_apply_ready(chunked_weave_t *weave, patch_t patch) {
+  /* Build insdict and deldict */
+  insdict_t insdict = NULL; deldict_t deldict = NULL;
+  LIFTERR(make_indeldict(patch, &insdict, &deldict, &weave->memodict));
+
+  /* Find the insertion point for everything in the insdict and deldict, in
+     one pass over the weave. */
+  vector_t insvec = new_vector();
+  chunked_traversal_state_t cur = chunked_starting_traversal_state(*weave);
+  uint32_t index = 0;           /* Index of the atom under cur */
+  uint64_t id, pred; uint32_t c;
+  int rc = 0;
+
+  while (cursor_read(&cur, &id, &pred, &c)) {
+    index++;
+
+    /* Deletors go right after the atom they delete. */
+    void *delatom = indeldict_get(deldict, id);
+    if (delatom != NULL)
+      insvec = insvec_add(insvec, index, &cur, 1, delatom);
+
+    insrec_t *insrec = indeldict_get(insdict, id);
+    if (insrec == NULL) continue;
+
+    /* Save-awareness chains go right after the end atom. Anything else has to
+       find its place among its siblings. */
+    uint32_t *irptr = insrec->chain;
+    uint64_t id_head, pred_head; uint32_t c_head;
+    READ_ATOM_SEQ(id_head, pred_head, c_head, irptr);
+    chunked_traversal_state_t pos = cur; uint32_t pos_index = index;
+    if (c_head != ATOM_CHAR_SAVE &&
+        find_insertion_point(weave, id_head, pred_head, &pos, &pos_index) != 0) {
+      rc = -1; break;
+    }
+    insvec = insvec_add(insvec, pos_index, &pos, insrec->len_atoms, insrec->chain);
+  }
+  delete_insdict(insdict); delete_deldict(deldict);
+
+  /* Insert everything, and update the weft. */
+  if (rc == 0) {
+    insvec_sort(insvec);
+    rc = apply_chunked_insvec(weave, insvec);
+  }
+  free(insvec);
+  if (rc != 0) return -1;
+
+  uint64_t high_id = patch_highest_id(patch);
+  LIFTERR(weft_extend(&weave->weft, YARN(high_id), OFFSET(high_id)));
+  return 0;
+}
+
+/* Apply a patch to a chunked weave if it's ready, or put it in the waiting set
+   if it isn't, or ignore it if it's already in the weave. */
+static int chunked_apply_or_wait(chunked_weave_t *weave, patch_t patch) {
+  uint64_t blocking_id = patch_blocking_id(patch, weave->weft);
+  if (blocking_id == 1) return 0;
+  if (blocking_id != 0)
+    return add_to_waitset(&weave->wset, blocking_id, patch);
+  return chunked_apply_ready(weave, patch);
+}
+
+/* Apply a patch to a chunked weave, modifying the weave. Takes a pointer to the
+   weave, so it can modify it. Returns 0 on success. Does not check patch
+   validity. As with apply_patch(), a patch that isn't ready yet is put in the
+   waiting set, and anything it unblocks is applied along with it, in order of
+   yarn and offset. */
+int chunked_apply_patch(chunked_weave_t *weave, patch_t patch) {
+  vector_t woken;
+  int rc = chunked_apply_or_wait(weave, patch);
+
+  while (rc == 0 &&
+         (woken = waitset_take_covered(&weave->wset, weave->weft)) != NULL) {
+    for (Word_t i = 0; i < VECTOR_LEN(woken); i++) {
+      patch_t woken_patch = (patch_t)VECTOR_GET(woken, i);
+      uint64_t blocking_id = rc == 0 ?
+        patch_blocking_id(woken_patch, weave->weft) : 1;
+
+      /* Still-blocked patches go back in the waiting set, which owns them. */
+      if (blocking_id > 1) {
+        rc = waitset_park(&weave->wset, blocking_id, woken_patch);
+        if (rc != 0) free(woken_patch);
+        continue;
+      }
+      if (blocking_id == 0) rc = chunked_apply_ready(weave, woken_patch);
+      free(woken_patch);
+    }
+    free(woken);
+  }
+  return rc;
+}
+
+
+/********************************** Scouring **********************************/
+
+/* Create an initial traversal state for a chunked weave. */
+chunked_traversal_state_t chunked_starting_traversal_state(chunked_weave_t weave) {
+  chunked_traversal_state_t cts;
+  cts.chunk = weave.head; cts.i = 0;
+  cts.remaining_atoms = weave.length;
+  return cts;
+}
+
+/* Scour a chunked weave, partially. Just like scour(), but for chunked
+   weaves. Returns the number of characters written to buf. */
+int chunked_scour(wchar_t *buf, int buflen, chunked_traversal_state_t *cts) {
+  chunked_traversal_state_t cur = *cts;
+  int i, length = cts->remaining_atoms, chars_written = 0;
+
+  for (i = 0; i < length && chars_written < buflen;) {
+    uint64_t id, pred; uint32_t c;
+    if (!cursor_read(&cur, &id, &pred, &c)) break;
+    i++;
+    if (ATOM_CHAR_IS_VISIBLE(c)) {
+      uint64_t vid = id; uint32_t vc = c;
+      if (i < length && cursor_peek(&cur, &id, &pred, &c) &&
+          c == ATOM_CHAR_DEL && pred == vid) {
+        cursor_advance(&cur); i++;
+      } else {
+        buf[chars_written++] = (wchar_t)vc;
+      }
+    }
+  }
+
+  cts->chunk = cur.chunk; cts->i = cur.i; cts->remaining_atoms -= i;
+  return chars_written;
+}
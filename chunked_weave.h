@@ -0,0 +1,44 @@
+#ifndef __CHUNKED_WEAVE_H
+#define __CHUNKED_WEAVE_H
+
+/* How many atoms fit in a chunk. */
+#ifndef CHUNK_ATOMS
+#define CHUNK_ATOMS 1024
+#endif
+
+/* A chunk is a fixed-size piece of a chunked weave, holding up to CHUNK_ATOMS
+   atoms in the same parallel-array layout as a vector weave. */
+typedef struct chunk {
+  struct chunk *next;           /* Next chunk in the weave, or NULL */
+  uint32_t length;              /* How many atoms are in this chunk */
+  uint64_t ids[CHUNK_ATOMS];    /* Array of ids */
+  uint64_t preds[CHUNK_ATOMS];  /* Array of predecessor ids */
+  uint32_t chars[CHUNK_ATOMS];  /* Array of chars */
+} chunk_t;
+
+/* A chunked weave is a list of chunks, which are never empty. */
+typedef struct {
+  uint32_t length;         /* How many atoms are in the weave */
+  uint32_t chunk_count;    /* How many chunks hold them */
+  chunk_t *head;           /* First chunk */
+  weft_t weft;             /* Weft covering all atoms in weave */
+  memodict_t memodict;     /* Id-to-weft memoization dict */
+  waitset_t wset;          /* Waiting set: patches by blocking id */
+} chunked_weave_t;
+
+/* The state of a chunked weave traversal: the next atom to be read is at index
+   i in chunk. */
+typedef struct {
+  chunk_t *chunk;
+  uint32_t i;
+  uint32_t remaining_atoms;
+} chunked_traversal_state_t;
+
+chunked_weave_t new_chunked_weave(void);
+void delete_chunked_weave(chunked_weave_t weave);
+void chunked_weave_print(chunked_weave_t weave);
+int chunked_apply_patch(chunked_weave_t *weave, patch_t patch);
+chunked_traversal_state_t chunked_starting_traversal_state(chunked_weave_t weave);
+int chunked_scour(wchar_t *buf, int buflen, chunked_traversal_state_t *cts);
+
+#endif
@@ -0,0 +1,413 @@
+/* Document managers: many vector weaves, keyed by document id, with patches
+   applied to them in parallel by a pool of worker threads.
+
+   Each document has a queue of patches, which are applied in the order they
+   were submitted, by one worker at a time; different documents are applied
+   at the same time on different workers. A document with patches queued and
+   no worker on it is ready, and sits in one worker's deque. Workers take
+   ready documents from the back of their own deques, and when those are
+   empty, steal from the front of other workers' deques, so that a burst of
+   patches for documents that all landed on one worker gets spread around.
+
+   A worker that takes a document applies everything in its queue at once,
+   with apply_and_drain(), and then publishes the weave (see version.c), so
+   readers on other threads can get at any document's latest version with
+   docmgr_acquire() without waiting for it. If more patches came in while it
+   was working, the document goes back in the worker's deque, at the front,
+   behind the other documents that were waiting.
+
+   The deques are intrusive lists through the documents, since a document is
+   in at most one deque at a time; scheduling one never allocates. */
+
+#include "sburb.h"
+
+typedef struct doc {
+  uint64_t id;
+  weave_t weave;
+  versions_t versions;
+  pthread_mutex_t lock;         /* Guards everything below */
+  vector_t queue;               /* Patches to apply, or NULL if none yet */
+  vector_t times;               /* When each was submitted, in nanoseconds */
+  int scheduled;                /* In a deque, or being applied */
+  docstats_t stats;
+  struct doc *prev, *next;      /* Neighbors in a deque */
+} doc_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  doc_t *front, *back;
+} deque_t;
+
+struct docmgr {
+  int thread_count;
+  pthread_t *threads;
+  deque_t *deques;              /* One per worker */
+  uint32_t next_deque;          /* Where the next outside submission goes */
+  uint64_t ready;               /* Documents in deques */
+  pthread_mutex_t lock;         /* Guards everything below */
+  pthread_cond_t work;          /* Signalled when a document becomes ready */
+  pthread_cond_t idle;          /* Signalled when nothing is pending */
+  Pvoid_t docs;                 /* JudyL: document id -> doc_t * */
+  uint64_t pending;             /* Patches submitted but not applied */
+  int stopping;
+};
+
+/* A worker thread's manager, and which worker it is. */
+typedef struct {
+  docmgr_t mgr;
+  int index;
+} worker_t;
+
+/* The time now, in nanoseconds, from some fixed point. */
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+/*********************************** Deques ***********************************/
+
+static void deque_push_front(deque_t *deque, doc_t *doc) {
+  pthread_mutex_lock(&deque->lock);
+  doc->prev = NULL; doc->next = deque->front;
+  if (deque->front != NULL) deque->front->prev = doc;
+  else deque->back = doc;
+  deque->front = doc;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+static void deque_push_back(deque_t *deque, doc_t *doc) {
+  pthread_mutex_lock(&deque->lock);
+  doc->next = NULL; doc->prev = deque->back;
+  if (deque->back != NULL) deque->back->next = doc;
+  else deque->front = doc;
+  deque->back = doc;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+/* Take a document from the front of a deque if steal is true, or from the
+   back if not. Returns NULL if the deque is empty. */
+static doc_t *deque_pop(deque_t *deque, int steal) {
+  doc_t *doc;
+  pthread_mutex_lock(&deque->lock);
+  doc = steal ? deque->front : deque->back;
+  if (doc != NULL) {
+    if (doc->prev != NULL) doc->prev->next = doc->next;
+    else deque->front = doc->next;
+    if (doc->next != NULL) doc->next->prev = doc->prev;
+    else deque->back = doc->prev;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return doc;
+}
+
+/* Put a ready document in a worker's deque, and wake up a worker for it. */
+static void make_ready(docmgr_t mgr, doc_t *doc, int index, int front) {
+  __atomic_add_fetch(&mgr->ready, 1, __ATOMIC_SEQ_CST);
+  if (front) deque_push_front(&mgr->deques[index], doc);
+  else deque_push_back(&mgr->deques[index], doc);
+  pthread_mutex_lock(&mgr->lock);
+  pthread_cond_signal(&mgr->work);
+  pthread_mutex_unlock(&mgr->lock);
+}
+
+
+
+/********************************** Workers ***********************************/
+
+/* Apply everything in a document's queue, and publish the result. */
+static void run_doc(docmgr_t mgr, int index, doc_t *doc) {
+  vector_t queue, times;
+  uint64_t start, end;
+  Word_t applied = 0;
+  int requeue;
+
+  pthread_mutex_lock(&doc->lock);
+  queue = doc->queue; times = doc->times;
+  doc->queue = NULL; doc->times = NULL;
+  pthread_mutex_unlock(&doc->lock);
+
+  Word_t n = VECTOR_LEN(queue);
+  patch_t *patches = (patch_t *)&VECTOR_GET(queue, 0);
+  start = now_ns();
+  /* If the batch fails, the patches before the one that failed are in and
+     the rest aren't, so go through it again a patch at a time, so that one
+     bad patch doesn't take the rest with it. The ones already in are dropped
+     as duplicates. Whatever got applied is published either way; if that
+     fails, the next batch publishes it. */
+  if (apply_and_drain(&doc->weave, patches, n) == 0) {
+    applied = n;
+  } else {
+    for (Word_t i = 0; i < n; i++)
+      if (apply_and_drain(&doc->weave, &patches[i], 1) == 0) applied++;
+  }
+  weave_publish(doc->versions, &doc->weave);
+  end = now_ns();
+  for (Word_t i = 0; i < n; i++) free(patches[i]);
+
+  pthread_mutex_lock(&doc->lock);
+  docstats_t *stats = &doc->stats;
+  stats->applied += applied;
+  stats->failed += n - applied;
+  stats->batches++;
+  stats->apply_ns += end - start;
+  stats->max_apply_ns = MAX(stats->max_apply_ns, end - start);
+  for (Word_t i = 0; i < n; i++) {
+    uint64_t latency = end - VECTOR_GET(times, i);
+    stats->latency_ns += latency;
+    stats->max_latency_ns = MAX(stats->max_latency_ns, latency);
+  }
+  requeue = doc->queue != NULL;
+  if (!requeue) doc->scheduled = FALSE;
+  pthread_mutex_unlock(&doc->lock);
+  free(queue); free(times);
+
+  if (requeue) make_ready(mgr, doc, index, TRUE);
+  pthread_mutex_lock(&mgr->lock);
+  mgr->pending -= n;
+  if (mgr->pending == 0) pthread_cond_broadcast(&mgr->idle);
+  pthread_mutex_unlock(&mgr->lock);
+}
+
+/* Find a ready document: from the back of this worker's own deque, or else
+   from the front of someone else's. Returns NULL if there are none. */
+static doc_t *find_work(docmgr_t mgr, int index) {
+  doc_t *doc = deque_pop(&mgr->deques[index], FALSE);
+  for (int i = 1; doc == NULL && i < mgr->thread_count; i++)
+    doc = deque_pop(&mgr->deques[(index + i) % mgr->thread_count], TRUE);
+  if (doc != NULL) __atomic_sub_fetch(&mgr->ready, 1, __ATOMIC_SEQ_CST);
+  return doc;
+}
+
+static void *worker_main(void *arg) {
+  worker_t *worker = arg;
+  docmgr_t mgr = worker->mgr;
+  doc_t *doc;
+
+  for (;;) {
+    if ((doc = find_work(mgr, worker->index)) != NULL) {
+      run_doc(mgr, worker->index, doc);
+      continue;
+    }
+    pthread_mutex_lock(&mgr->lock);
+    while (__atomic_load_n(&mgr->ready, __ATOMIC_SEQ_CST) == 0 &&
+           !mgr->stopping)
+      pthread_cond_wait(&mgr->work, &mgr->lock);
+    int stop = mgr->stopping && __atomic_load_n(&mgr->ready, __ATOMIC_SEQ_CST) == 0;
+    pthread_mutex_unlock(&mgr->lock);
+    if (stop) break;
+  }
+  free(worker);
+  return NULL;
+}
+
+
+
+/********************************** Managers **********************************/
+
+/* Stop the first started workers of a manager, and wait for them to exit. */
+static void stop_workers(docmgr_t mgr, int started) {
+  pthread_mutex_lock(&mgr->lock);
+  mgr->stopping = TRUE;
+  pthread_cond_broadcast(&mgr->work);
+  pthread_mutex_unlock(&mgr->lock);
+  for (int i = 0; i < started; i++) pthread_join(mgr->threads[i], NULL);
+}
+
+/* Make a new document manager, with a pool of thread_count worker threads, or
+   one per online CPU if thread_count is 0. Returns NULL on failure. */
+docmgr_t new_docmgr(int thread_count) {
+  docmgr_t mgr;
+  int started = 0;
+
+  if (thread_count <= 0) thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (thread_count <= 0) thread_count = 1;
+  if ((mgr = calloc(1, sizeof(struct docmgr))) == NULL) return NULL;
+  mgr->thread_count = thread_count;
+  mgr->threads = malloc(thread_count * sizeof(pthread_t));
+  mgr->deques = calloc(thread_count, sizeof(deque_t));
+  if (mgr->threads == NULL || mgr->deques == NULL) goto fail;
+  pthread_mutex_init(&mgr->lock, NULL);
+  pthread_cond_init(&mgr->work, NULL);
+  pthread_cond_init(&mgr->idle, NULL);
+  for (int i = 0; i < thread_count; i++)
+    pthread_mutex_init(&mgr->deques[i].lock, NULL);
+
+  for (; started < thread_count; started++) {
+    worker_t *worker = malloc(sizeof(worker_t));
+    if (worker == NULL) goto fail_stop;
+    worker->mgr = mgr; worker->index = started;
+    if (pthread_create(&mgr->threads[started], NULL, worker_main, worker) != 0) {
+      free(worker);
+      goto fail_stop;
+    }
+  }
+  return mgr;
+
+ fail_stop:
+  stop_workers(mgr, started);
+ fail:
+  free(mgr->threads); free(mgr->deques); free(mgr);
+  return NULL;
+}
+
+/* Wait until every patch submitted so far has been applied. */
+void docmgr_wait(docmgr_t mgr) {
+  pthread_mutex_lock(&mgr->lock);
+  while (mgr->pending > 0) pthread_cond_wait(&mgr->idle, &mgr->lock);
+  pthread_mutex_unlock(&mgr->lock);
+}
+
+/* Delete a document manager: wait for the patches already submitted to be
+   applied, stop the workers, and delete every document's weave and versions.
+   No other thread may be using it, or any version acquired from it. */
+void delete_docmgr(docmgr_t mgr) {
+  Word_t index = 0, *pvalue, rc_word;
+
+  if (mgr == NULL) return;
+  docmgr_wait(mgr);
+  stop_workers(mgr, mgr->thread_count);
+  JLF(pvalue, mgr->docs, index);
+  while (pvalue != NULL) {
+    doc_t *doc = (doc_t *)*pvalue;
+    delete_weave(doc->weave);
+    delete_versions(doc->versions);
+    pthread_mutex_destroy(&doc->lock);
+    free(doc);
+    JLN(pvalue, mgr->docs, index);
+  }
+  JLFA(rc_word, mgr->docs);
+  free(mgr->threads); free(mgr->deques); free(mgr);
+}
+
+/* Make a document around a weave, and publish it. Returns NULL on malloc()
+   failure, in which case the weave still belongs to the caller. */
+static doc_t *new_doc(uint64_t id, weave_t *weave) {
+  doc_t *doc = calloc(1, sizeof(doc_t));
+  if (doc == NULL) return NULL;
+  if ((doc->versions = new_versions()) == NULL ||
+      weave_publish(doc->versions, weave) != 0) {
+    delete_versions(doc->versions); free(doc);
+    return NULL;
+  }
+  doc->id = id;
+  doc->weave = *weave;
+  pthread_mutex_init(&doc->lock, NULL);
+  return doc;
+}
+
+/* Look up a document. Returns NULL if there isn't one. Call with the
+   manager's lock held. */
+static doc_t *find_doc(docmgr_t mgr, uint64_t id) {
+  Word_t *pvalue;
+  JLG(pvalue, mgr->docs, (Word_t)id);
+  return pvalue == NULL ? NULL : (doc_t *)*pvalue;
+}
+
+/* Add a document to a manager, with a weave to start from; one loaded from a
+   snapshot, say. On success, the manager takes ownership of the weave.
+   Returns 0 on success, or -1 if there already is a document with that id, or
+   on malloc() failure, in which case the weave still belongs to the
+   caller. */
+int docmgr_add(docmgr_t mgr, uint64_t id, weave_t *weave) {
+  Word_t *pvalue; int rc_int;
+  doc_t *doc = NULL;
+
+  pthread_mutex_lock(&mgr->lock);
+  if (find_doc(mgr, id) == NULL) {
+    JLI(pvalue, mgr->docs, (Word_t)id);
+    if (pvalue != PJERR && (doc = new_doc(id, weave)) == NULL)
+      JLD(rc_int, mgr->docs, (Word_t)id);
+    if (doc != NULL) *pvalue = (Word_t)doc;
+  }
+  pthread_mutex_unlock(&mgr->lock);
+  return doc == NULL ? -1 : 0;
+}
+
+/* Submit a patch to a document, making a blank one if there's no document
+   with that id yet. The manager takes ownership of the patch, and applies it
+   after every patch submitted to the document before it. Returns 0 on
+   success, or -1 if a new document can't be made, in which case the patch
+   still belongs to the caller. Safe to call from any thread. */
+int docmgr_submit(docmgr_t mgr, uint64_t id, patch_t patch) {
+  Word_t *pvalue;
+  doc_t *doc;
+  int schedule;
+
+  pthread_mutex_lock(&mgr->lock);
+  if ((doc = find_doc(mgr, id)) == NULL) {
+    weave_t weave = new_weave(0);
+    JLI(pvalue, mgr->docs, (Word_t)id);
+    if (pvalue == PJERR || (doc = new_doc(id, &weave)) == NULL) {
+      int rc_int;
+      if (pvalue != PJERR) JLD(rc_int, mgr->docs, (Word_t)id);
+      pthread_mutex_unlock(&mgr->lock);
+      delete_weave(weave);
+      return -1;
+    }
+    *pvalue = (Word_t)doc;
+  }
+  mgr->pending++;
+  pthread_mutex_unlock(&mgr->lock);
+
+  pthread_mutex_lock(&doc->lock);
+  if (doc->queue == NULL) { doc->queue = new_vector(); doc->times = new_vector(); }
+  doc->queue = vector_append(doc->queue, (Word_t)patch);
+  doc->times = vector_append(doc->times, (Word_t)now_ns());
+  schedule = !doc->scheduled;
+  doc->scheduled = TRUE;
+  pthread_mutex_unlock(&doc->lock);
+
+  if (schedule) {
+    uint32_t index = __atomic_fetch_add(&mgr->next_deque, 1, __ATOMIC_RELAXED);
+    make_ready(mgr, doc, index % mgr->thread_count, FALSE);
+  }
+  return 0;
+}
+
+/* Take a reference to the latest published version of a document, as with
+   version_acquire(). It doesn't have the patches still in the queue. Returns
+   NULL if there's no such document. Safe to call from any thread. */
+version_t docmgr_acquire(docmgr_t mgr, uint64_t id) {
+  pthread_mutex_lock(&mgr->lock);
+  doc_t *doc = find_doc(mgr, id);
+  pthread_mutex_unlock(&mgr->lock);
+  return doc == NULL ? NULL : version_acquire(doc->versions);
+}
+
+/* Get the statistics of a document, including how many patches are waiting
+   in its queue. Returns 0 on success, or -1 if there's no such document. */
+int docmgr_stats(docmgr_t mgr, uint64_t id, docstats_t *stats) {
+  pthread_mutex_lock(&mgr->lock);
+  doc_t *doc = find_doc(mgr, id);
+  pthread_mutex_unlock(&mgr->lock);
+  if (doc == NULL) return -1;
+
+  pthread_mutex_lock(&doc->lock);
+  *stats = doc->stats;
+  stats->queued = doc->queue == NULL ? 0 : VECTOR_LEN(doc->queue);
+  pthread_mutex_unlock(&doc->lock);
+  return 0;
+}
+
+
+/********************************** Testing ***********************************/
+
+// int main(void) {
+//   docmgr_t mgr = new_docmgr(0);
+//   docstats_t stats;
+//
+//   for (uint64_t doc = 0; doc < 1000; doc++)
+//     LIFTERR(docmgr_submit(mgr, doc, make_patch1()));
+//   docmgr_wait(mgr);
+//   LIFTERR(docmgr_stats(mgr, 42, &stats));
+//   printf("applied %llu, max latency %llu ns\n",
+//          (long long)stats.applied, (long long)stats.max_latency_ns);
+//   version_t version = docmgr_acquire(mgr, 42);
+//   weave_scour_print(*version_weave(version));
+//   version_release(version);
+//   delete_docmgr(mgr);
+//   return 0;
+// }
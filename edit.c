@@ -0,0 +1,253 @@
+/* Local edits: turning a list of insertions and deletions at visible positions
+   in a vector weave into a patch.
+
+   The edits are applied one after another, each at a position in the text as
+   it is after the ones before it, the way an editor would record a burst of
+   typing. Rather than make a chain per edit, build_patch() first works out
+   what the edits add up to, relative to the weave's current text: which of
+   the current chars are gone, and what new text goes in each gap between the
+   ones that are left. Then the patch has one insertion chain per gap with new
+   text in it, anchored on the char before the gap, and one deletion chain for
+   everything deleted. Text that's inserted and then deleted again never makes
+   it into the patch at all.
+
+   The new text has to go right where the edits put it, in front of anything
+   else after the char it's anchored on. That's only where the weave puts it if
+   the yarn is aware of everything in the weave, so if it isn't, the patch
+   starts with a save-awareness chain, with one atom for each yarn it's behind
+   on.
+
+   To work this out, the text is kept as a list of pieces, each either a range
+   of the weave's current chars or a range of an edit's inserted text. Each edit
+   adds at most two pieces, so the list lives on the stack, and the only thing
+   allocated is the patch itself. */
+
+#include "sburb.h"
+
+/* A piece of the text as edited: either the current chars from base_start up
+   to base_end, or chars of inserted text, taking the given number of bytes of
+   UTF-8 starting at text. */
+typedef struct {
+  const uint8_t *text;          /* Inserted text, or NULL for current chars */
+  uint32_t base_start, base_end;
+  uint32_t bytes, chars;
+} piece_t;
+
+#define PIECE_LEN(piece) \
+  ((piece).text == NULL ? (piece).base_end - (piece).base_start : (piece).chars)
+
+/* Decode one char of UTF-8, advancing the pointer past it. Returns the char,
+   or (uint32_t)-1 if it's malformed, overlong, a surrogate, or runs past
+   end. */
+static uint32_t utf8_decode(const uint8_t **ptr, const uint8_t *end) {
+  const uint8_t *p = *ptr;
+  uint32_t c = *p++, min;
+  int extra;
+
+  if (c < 0x80)                { *ptr = p; return c; }
+  else if ((c & 0xE0) == 0xC0) { c &= 0x1F; extra = 1; min = 0x80; }
+  else if ((c & 0xF0) == 0xE0) { c &= 0x0F; extra = 2; min = 0x800; }
+  else if ((c & 0xF8) == 0xF0) { c &= 0x07; extra = 3; min = 0x10000; }
+  else return (uint32_t)-1;
+
+  if (end - p < extra) return (uint32_t)-1;
+  for (; extra > 0; extra--) {
+    if ((*p & 0xC0) != 0x80) return (uint32_t)-1;
+    c = (c << 6) | (*p++ & 0x3F);
+  }
+  if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+    return (uint32_t)-1;
+  *ptr = p;
+  return c;
+}
+
+/* Count the chars in some UTF-8 text. Returns -1 if it's malformed, or has any
+   of the special atom chars in it. */
+static int64_t utf8_count(const uint8_t *text, uint32_t bytes) {
+  const uint8_t *end = text + bytes;
+  int64_t chars = 0;
+  while (text < end) {
+    uint32_t c = utf8_decode(&text, end);
+    if (c == (uint32_t)-1 || !ATOM_CHAR_IS_VISIBLE(c)) return -1;
+    chars++;
+  }
+  return chars;
+}
+
+/* Split the piece list so that a piece starts at text position pos, and return
+   the index of that piece (which is the piece count, if pos is the end of the
+   text). There must be room for one more piece. */
+static int split_pieces(piece_t *pieces, int *count, uint32_t pos) {
+  int i;
+  for (i = 0; i < *count; i++) {
+    uint32_t len = PIECE_LEN(pieces[i]);
+    if (pos == 0) return i;
+    if (pos < len) break;
+    pos -= len;
+  }
+  if (i == *count) return i;
+
+  /* Split piece i at pos. */
+  memmove(pieces + i + 1, pieces + i, (*count - i) * sizeof(piece_t));
+  (*count)++;
+  piece_t *left = &pieces[i], *right = &pieces[i + 1];
+  if (left->text == NULL) {
+    left->base_end = right->base_start = left->base_start + pos;
+  } else {
+    const uint8_t *p = left->text, *end = left->text + left->bytes;
+    for (uint32_t k = 0; k < pos; k++) utf8_decode(&p, end);
+    left->bytes = p - left->text; left->chars = pos;
+    right->text = p; right->bytes -= left->bytes; right->chars -= pos;
+  }
+  return i + 1;
+}
+
+/* Make a patch for a list of edits to a vector weave, as made by yarn. The
+   patch's atoms start right after the yarn's top offset in the weave's weft, so
+   it's ready to apply. Returns the patch, which the caller must free(), or NULL
+   if the edits aren't valid: out of range positions, bad UTF-8, special chars,
+   more than BUILD_PATCH_MAX_EDITS edits, more than 255 chains, or over 65535
+   chars of new text in one place. Also returns NULL if the edits don't change
+   anything, or on malloc() failure. A weave loaded from a snapshot is thawed
+   first, since this needs its memodict.
+
+   Positions are looked up with weave_visible_id(), so this takes
+   O(n^2 + k log m) time, for n edits touching k chars of a weave with m atoms,
+   and the patch is written in one go into a buffer of exactly the right
+   size. */
+patch_t build_patch(weave_t *weave, uint32_t yarn, const edit_t *edits,
+                    int edit_count) {
+  if (yarn == 0 || edit_count < 0 || edit_count > BUILD_PATCH_MAX_EDITS)
+    return NULL;
+  if (weave_thaw(weave) != 0) return NULL;
+  piece_t pieces[2 * edit_count + 1];
+  uint32_t base_len = weave_visible_length(weave), length = base_len;
+  int count = 0;
+
+  if (base_len > 0) {
+    pieces[0].text = NULL;
+    pieces[0].base_start = 0; pieces[0].base_end = base_len;
+    count = 1;
+  }
+
+  /* Apply the edits to the piece list. */
+  for (int e = 0; e < edit_count; e++) {
+    const edit_t *edit = &edits[e];
+    if (edit->pos > length) return NULL;
+    if (edit->type == EDIT_INSERT) {
+      int64_t chars = utf8_count((const uint8_t *)edit->text, edit->len);
+      if (chars < 0) return NULL;
+      if (chars == 0) continue;
+      int i = split_pieces(pieces, &count, edit->pos);
+      memmove(pieces + i + 1, pieces + i, (count - i) * sizeof(piece_t));
+      pieces[i].text = (const uint8_t *)edit->text;
+      pieces[i].bytes = edit->len; pieces[i].chars = chars;
+      count++; length += chars;
+    } else if (edit->type == EDIT_DELETE) {
+      if (edit->len > length - edit->pos) return NULL;
+      if (edit->len == 0) continue;
+      int i = split_pieces(pieces, &count, edit->pos);
+      int j = split_pieces(pieces, &count, edit->pos + edit->len);
+      memmove(pieces + i, pieces + j, (count - j) * sizeof(piece_t));
+      count -= j - i; length -= edit->len;
+    } else {
+      return NULL;
+    }
+  }
+
+  /* Find out which yarns this yarn isn't up to date with. */
+  uint32_t top = weft_get(weave->weft, yarn), saves = 0, y, o;
+  weft_t aware = top > 0 ? memodict_get(weave->memodict, PACK_ID(yarn, top))
+                         : new_weft();
+  if (aware == ERRWEFT) return NULL;
+  for (y = 1; weft_next(weave->weft, &y, &o); y++)
+    if (y != yarn && weft_get(aware, y) < o) saves++;
+
+  /* Count the chains and atoms. New text is only ever next to the current
+     chars that were before and after it, so a run of inserted pieces is one
+     chain. Current chars that aren't in any piece were deleted. */
+  uint32_t chain_count = 0, atom_count = 0, deleted = 0, run = 0, base_next = 0;
+  for (int i = 0; i < count; i++) {
+    if (pieces[i].text == NULL) {
+      deleted += pieces[i].base_start - base_next;
+      base_next = pieces[i].base_end;
+      run = 0;
+    } else {
+      if (run == 0) chain_count++;
+      run += pieces[i].chars;
+      if (run > 0xFFFF) { weft_release(aware); return NULL; }
+      atom_count += pieces[i].chars;
+    }
+  }
+  deleted += base_len - base_next;
+  chain_count += (deleted + 0xFFFE) / 0xFFFF;
+  atom_count += deleted;
+  if (saves > 0) { chain_count++; atom_count += saves; }
+  if (atom_count == saves || chain_count > 255 || saves > 0xFFFF) {
+    weft_release(aware);
+    return NULL;
+  }
+
+  /* Allocate the patch, and write it: the save-awareness chain, then the
+     insertion chains, in order, then the deletion chains. Each chain's
+     descriptor is written when it's done. */
+  uint32_t patch_len = patch_necessary_buffer_length(chain_count, atom_count);
+  void *patch = malloc(patch_len), *descriptors = patch;
+  if (patch == NULL) { weft_release(aware); return NULL; }
+  write_patch_header(&descriptors, patch_len, chain_count);
+  uint32_t *atoms = (uint32_t *)((uint8_t *)descriptors + 6 * chain_count);
+  uint32_t *p32 = atoms, *head = atoms;
+  uint32_t offset = weft_get(weave->weft, yarn) + 1;
+  uint64_t pred = PACK_ID(0, 1); /* start atom */
+
+#define END_CHAIN() do {                                                  \
+    write_chain_descriptor(&descriptors, (uint8_t *)head - (uint8_t *)atoms, \
+                           run);                                          \
+    head = p32; run = 0;                                                  \
+  } while (0);
+
+  /* Save awareness of the other yarns first, so that everything after it in
+     the patch has that awareness too. */
+  run = 0;
+  for (y = 1; saves > 0 && weft_next(weave->weft, &y, &o); y++) {
+    if (y == yarn || weft_get(aware, y) >= o) continue;
+    WRITE_ATOM_SEQ(PACK_ID(yarn, offset++), PACK_ID(y, o), ATOM_CHAR_SAVE, p32);
+    run++;
+  }
+  if (run > 0) END_CHAIN();
+  weft_release(aware);
+
+  /* Inserted text goes after the current char before it. */
+  for (int i = 0; i < count; i++) {
+    if (pieces[i].text == NULL) {
+      if (run > 0) END_CHAIN();
+      pred = weave_visible_id(weave, pieces[i].base_end - 1);
+      continue;
+    }
+    const uint8_t *p = pieces[i].text, *end = p + pieces[i].bytes;
+    while (p < end) {
+      uint64_t id = PACK_ID(yarn, offset++);
+      WRITE_ATOM_SEQ(id, pred, utf8_decode(&p, end), p32);
+      pred = id; run++;
+    }
+  }
+  if (run > 0) END_CHAIN();
+
+  /* Deletors for the current chars that are between the pieces. */
+  base_next = 0;
+  for (int i = 0; i <= count; i++) {
+    if (i < count && pieces[i].text != NULL) continue;
+    uint32_t until = i < count ? pieces[i].base_start : base_len;
+    for (; base_next < until; base_next++) {
+      WRITE_ATOM_SEQ(PACK_ID(yarn, offset++), weave_visible_id(weave, base_next),
+                     ATOM_CHAR_DEL, p32);
+      if (++run == 0xFFFF) END_CHAIN();
+    }
+    if (i < count) base_next = pieces[i].base_end;
+  }
+  if (run > 0) END_CHAIN();
+#undef END_CHAIN
+
+  assert((uint8_t *)p32 - (uint8_t *)patch == patch_len);
+  return patch;
+}
@@ -0,0 +1,371 @@
+/* Flat wefts: an alternative to the JudyL wefts in weft.c, selected at build
+   time with "scons weft=flat". A weft is a single malloc()ed block holding a
+   small header followed by two parallel columns: the yarns, in ascending
+   order, and the top offset of each yarn. Documents rarely have more than a
+   few dozen yarns, so the whole thing fits in a handful of cache lines, and
+   covers/merge/compare can work on four lanes at a time with GCC's vector
+   extensions instead of descending a Judy array.
+
+   The empty weft is still NULL, so weaves and memodicts that start out with
+   (weft_t)NULL work unchanged. The columns are padded to a multiple of four
+   entries; unused yarn slots hold FLAT_WEFT_PAD so that they never compare
+   equal to a real yarn in a vector search, and unused offset slots hold 0. */
+
+#include "sburb.h"
+
+/* Four 32-bit lanes, and the same 128 bits viewed as two 64-bit words for
+   cheap "is any lane set?" tests. */
+typedef uint32_t v4u32 __attribute__ ((vector_size (16)));
+typedef uint64_t v2u64 __attribute__ ((vector_size (16)));
+
+#define FLAT_WEFT_PAD 0xFFFFFFFF
+
+typedef struct {
+  uint32_t len;                 /* Number of yarns in the weft */
+  uint32_t cap;                 /* Room for this many, a multiple of 4 */
+  uint64_t unused;              /* Keeps the columns 16-byte aligned */
+  uint32_t yarns[];             /* cap yarns, then cap offsets */
+} flat_weft_t;
+
+#define FW(weft)         ((flat_weft_t *)(weft))
+#define FW_LEN(weft)     ((weft) == NULL ? 0 : FW(weft)->len)
+#define FW_YARNS(fw)     ((fw)->yarns)
+#define FW_OFFSETS(fw)   ((fw)->yarns + (fw)->cap)
+
+/* Does any lane of a vector comparison result have its bits set? */
+#define V4_ANY(v) ({ v2u64 _w = (v2u64)(v); (_w[0] | _w[1]) != 0; })
+
+/* Allocate a flat weft with room for at least n entries, all padding. */
+static flat_weft_t *flat_weft_alloc(uint32_t n) {
+  uint32_t cap = (n + 3) & ~3; if (cap == 0) cap = 4;
+  flat_weft_t *fw = malloc(sizeof(flat_weft_t) + 2 * cap * sizeof(uint32_t));
+  if (fw == NULL) return NULL;
+  fw->len = 0; fw->cap = cap; fw->unused = 0;
+  memset(FW_YARNS(fw), 0xFF, cap * sizeof(uint32_t));
+  memset(FW_OFFSETS(fw), 0, cap * sizeof(uint32_t));
+  return fw;
+}
+
+/* Grow a flat weft so that it has room for at least n entries. Returns the
+   (possibly moved) weft, or NULL on malloc() failure, in which case the old
+   weft is untouched. */
+static flat_weft_t *flat_weft_grow(flat_weft_t *fw, uint32_t n) {
+  if (fw != NULL && n <= fw->cap) return fw;
+  flat_weft_t *bigger = flat_weft_alloc(MAX(n, fw == NULL ? 0 : 2 * fw->cap));
+  if (bigger == NULL) return NULL;
+  if (fw != NULL) {
+    memcpy(FW_YARNS(bigger), FW_YARNS(fw), fw->len * sizeof(uint32_t));
+    memcpy(FW_OFFSETS(bigger), FW_OFFSETS(fw), fw->len * sizeof(uint32_t));
+    bigger->len = fw->len;
+    free(fw);
+  }
+  return bigger;
+}
+
+/* Find the index of a yarn in a flat weft, four yarns at a time. Returns -1 if
+   the yarn is not present. */
+static inline int flat_weft_find(flat_weft_t *fw, uint32_t yarn) {
+  const v4u32 *yv = (const v4u32 *)FW_YARNS(fw);
+  v4u32 needle = {yarn, yarn, yarn, yarn};
+
+  for (uint32_t i = 0; i < fw->len; i += 4, yv++) {
+    v4u32 eq = *yv == needle;
+    if (V4_ANY(eq)) {
+      for (int lane = 0; lane < 4; lane++)
+        if (eq[lane] && i + lane < fw->len) return i + lane;
+      return -1;
+    }
+    if ((*yv)[3] > yarn) return -1; /* sorted, so it isn't further on */
+  }
+  return -1;
+}
+
+/* Find the position at which a yarn is, or would be inserted. */
+static inline uint32_t flat_weft_lower_bound(flat_weft_t *fw, uint32_t yarn) {
+  uint32_t lo = 0, hi = fw->len;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (FW_YARNS(fw)[mid] < yarn) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+/* Allocate and return a new, blank weft. */
+weft_t new_weft(void) {
+  return (weft_t)NULL;
+}
+
+/* Delete a weft, and free its memory. */
+void delete_weft(weft_t weft) {
+  free(weft);
+}
+
+/* Print a weft, as a sequence of lines, one per mapping. */
+void weft_print(weft_t weft) {
+  if (weft == NULL) {
+    printf("[null weft]\n");
+    return;
+  }
+
+  if (weft == ERRWEFT) {
+    printf("[error weft]\n");
+    return;
+  }
+
+  flat_weft_t *fw = FW(weft);
+  for (uint32_t i = 0; i < fw->len; i++)
+    printf("%u\t%u\n", FW_YARNS(fw)[i], FW_OFFSETS(fw)[i]);
+  printf("\n");
+}
+
+/* Create a copy of a weft, in new memory. If there is a malloc() failure,
+   returns ERRWEFT. */
+weft_t copy_weft(weft_t from) {
+  if (from == NULL) return NULL;
+  size_t size = sizeof(flat_weft_t) + 2 * FW(from)->cap * sizeof(uint32_t);
+  flat_weft_t *to = malloc(size);
+  if (to == NULL) return ERRWEFT;
+  memcpy(to, from, size);
+  return (weft_t)to;
+}
+
+/* Get the top of a given yarn. */
+uint32_t weft_get(weft_t weft, uint32_t yarn) {
+  /* Special case: all wefts have (0, 2). */
+  if (yarn == 0) return 2;
+  if (weft == NULL) return 0;
+
+  int i = flat_weft_find(FW(weft), yarn);
+  return i < 0 ? 0 : FW_OFFSETS(FW(weft))[i];
+}
+
+/* Insert or update the entry for a yarn. If extend is true, the offset only
+   ever goes up. Return 0 on success. */
+static int flat_weft_put(weft_t *weft, uint32_t yarn, uint32_t offset,
+                         int extend) {
+  flat_weft_t *fw = FW(*weft);
+
+  if (fw != NULL) {
+    int i = flat_weft_find(fw, yarn);
+    if (i >= 0) {
+      uint32_t *off = &FW_OFFSETS(fw)[i];
+      *off = extend ? MAX(*off, offset) : offset;
+      return 0;
+    }
+  }
+
+  fw = flat_weft_grow(fw, FW_LEN(*weft) + 1);
+  if (fw == NULL) return -1;    /* malloc() failure */
+  uint32_t pos = flat_weft_lower_bound(fw, yarn), tail = fw->len - pos;
+  memmove(FW_YARNS(fw) + pos + 1, FW_YARNS(fw) + pos, tail * sizeof(uint32_t));
+  memmove(FW_OFFSETS(fw) + pos + 1, FW_OFFSETS(fw) + pos,
+          tail * sizeof(uint32_t));
+  FW_YARNS(fw)[pos] = yarn; FW_OFFSETS(fw)[pos] = offset;
+  fw->len++;
+  *weft = (weft_t)fw;
+  return 0;
+}
+
+/* Set the top of a given yarn. Return 0 on success. Needs a pointer to the
+   weft. */
+int weft_set(weft_t *weft, uint32_t yarn, uint32_t offset) {
+  return flat_weft_put(weft, yarn, offset, FALSE);
+}
+
+/* Extend the top of a given yarn. Return 0 on success. Needs a pointer to the
+   weft. */
+int weft_extend(weft_t *weft, uint32_t yarn, uint32_t offset) {
+  return flat_weft_put(weft, yarn, offset, TRUE);
+}
+
+/* Does a weft cover a given atom id? Return a bool. As a special case, wefts
+   implicitly cover (0, 1) and (0, 2). */
+int weft_covers(weft_t weft, uint64_t id) {
+  return OFFSET(id) <= weft_get(weft, YARN(id));
+}
+
+/* Merge the contents of another weft into this one, modifying only this
+   one. The resulting weft will be a superweft of the two. Return 0 on
+   success.
+
+   The common case is two wefts over the same set of yarns, which is a
+   lane-wise max of the offset columns. Otherwise, do an ordinary merge of two
+   sorted lists into a fresh block. */
+int weft_merge_into(weft_t *dest, weft_t other) {
+  flat_weft_t *d = FW(*dest), *o = FW(other);
+
+  if (o == NULL || o->len == 0) return 0;
+  if (d == NULL) {
+    weft_t copy = copy_weft(other);
+    if (copy == ERRWEFT) return -1;
+    *dest = copy; return 0;
+  }
+
+  /* Same yarns in both? Then take the max of the offsets, in place. */
+  if (d->len == o->len) {
+    const v4u32 *dy = (const v4u32 *)FW_YARNS(d), *oy = (const v4u32 *)FW_YARNS(o);
+    int same = TRUE;
+    for (uint32_t i = 0; i < d->len; i += 4)
+      if (V4_ANY(*dy++ != *oy++)) { same = FALSE; break; }
+    if (same) {
+      v4u32 *doff = (v4u32 *)FW_OFFSETS(d);
+      const v4u32 *ooff = (const v4u32 *)FW_OFFSETS(o);
+      for (uint32_t i = 0; i < d->len; i += 4, doff++, ooff++) {
+        v4u32 gt = (v4u32)(*doff > *ooff);
+        *doff = (*doff & gt) | (*ooff & ~gt);
+      }
+      return 0;
+    }
+  }
+
+  /* General case: merge the two sorted columns. */
+  flat_weft_t *m = flat_weft_alloc(d->len + o->len);
+  if (m == NULL) return -1;     /* malloc() failure */
+  uint32_t i = 0, j = 0, k = 0;
+  uint32_t *dy = FW_YARNS(d), *doff = FW_OFFSETS(d);
+  uint32_t *oy = FW_YARNS(o), *ooff = FW_OFFSETS(o);
+  uint32_t *my = FW_YARNS(m), *moff = FW_OFFSETS(m);
+  while (i < d->len && j < o->len) {
+    if (dy[i] < oy[j]) {
+      my[k] = dy[i]; moff[k++] = doff[i++];
+    } else if (dy[i] > oy[j]) {
+      my[k] = oy[j]; moff[k++] = ooff[j++];
+    } else {
+      my[k] = dy[i]; moff[k++] = MAX(doff[i], ooff[j]); i++; j++;
+    }
+  }
+  for (; i < d->len; i++, k++) { my[k] = dy[i]; moff[k] = doff[i]; }
+  for (; j < o->len; j++, k++) { my[k] = oy[j]; moff[k] = ooff[j]; }
+  m->len = k;
+
+  free(d); *dest = (weft_t)m;
+  return 0;
+}
+
+/* Compare wefts: is a > b? Wefts are compared lexicographically as sequences
+   of (yarn, offset) pairs in yarn order, where having a yarn that the other
+   weft lacks counts as greater, and a strict prefix is smaller. We find the
+   first differing pair four lanes at a time, then decide with scalar code. */
+int weft_gt(weft_t a, weft_t b) {
+  uint32_t a_len = FW_LEN(a), b_len = FW_LEN(b);
+  uint32_t n = MIN(a_len, b_len);
+
+  if (n > 0) {
+    flat_weft_t *fa = FW(a), *fb = FW(b);
+    const v4u32 *ay = (const v4u32 *)FW_YARNS(fa), *by = (const v4u32 *)FW_YARNS(fb);
+    const v4u32 *ao = (const v4u32 *)FW_OFFSETS(fa), *bo = (const v4u32 *)FW_OFFSETS(fb);
+
+    for (uint32_t i = 0; i < n; i += 4) {
+      v4u32 ne = (ay[i/4] != by[i/4]) | (ao[i/4] != bo[i/4]);
+      if (!V4_ANY(ne)) continue;
+      for (uint32_t k = i; k < i + 4 && k < n; k++) {
+        uint32_t my_yarn = FW_YARNS(fa)[k], my_offset = FW_OFFSETS(fa)[k];
+        uint32_t other_yarn = FW_YARNS(fb)[k], other_offset = FW_OFFSETS(fb)[k];
+
+        if (my_yarn < other_yarn) return 1;
+        if (my_yarn > other_yarn) return 0;
+        if (my_offset > other_offset) return 1;
+        if (my_offset < other_offset) return 0;
+      }
+      break;                    /* difference was only in the padding */
+    }
+  }
+
+  return a_len > b_len;
+}
+
+/* Hash the contents of a weft. Equal wefts hash equally, regardless of how
+   they were built or how much padding they carry. */
+Word_t weft_hash(weft_t weft) {
+  uint64_t hash = 14695981039346656037ULL; /* FNV-1a offset basis */
+
+  for (uint32_t i = 0; i < FW_LEN(weft); i++)
+    hash = (hash ^ PACK_ID(FW_YARNS(FW(weft))[i], FW_OFFSETS(FW(weft))[i]))
+      * 1099511628211ULL;
+  return (Word_t)hash;
+}
+
+/* Do two wefts have exactly the same mappings? */
+int weft_equal(weft_t a, weft_t b) {
+  uint32_t len = FW_LEN(a);
+
+  if (len != FW_LEN(b)) return 0;
+  if (len == 0) return 1;
+  return memcmp(FW_YARNS(FW(a)), FW_YARNS(FW(b)), len * sizeof(uint32_t)) == 0
+    && memcmp(FW_OFFSETS(FW(a)), FW_OFFSETS(FW(b)), len * sizeof(uint32_t)) == 0;
+}
+
+/* Is a contained in b? That is, does b have a mapping for every yarn in a, at
+   least as high? If so, merging a into b would not change b. This looks at
+   the actual mappings, so the implicit (0, 2) does not count. Both columns
+   are sorted, so this is a single merge-style walk. */
+int weft_leq(weft_t a, weft_t b) {
+  uint32_t a_len = FW_LEN(a), b_len = FW_LEN(b), j = 0;
+
+  for (uint32_t i = 0; i < a_len; i++) {
+    uint32_t yarn = FW_YARNS(FW(a))[i];
+    while (j < b_len && FW_YARNS(FW(b))[j] < yarn) j++;
+    if (j == b_len || FW_YARNS(FW(b))[j] != yarn) return 0;
+    if (FW_OFFSETS(FW(b))[j] < FW_OFFSETS(FW(a))[i]) return 0;
+  }
+  return 1;
+}
+
+/* Return a new weft holding the mappings of a that b lacks, or has lower
+   offsets for. Merging the result into b gives the same weft as merging a into
+   b. Returns ERRWEFT on malloc() failure. */
+weft_t weft_diff(weft_t a, weft_t b) {
+  uint32_t a_len = FW_LEN(a), b_len = FW_LEN(b), j = 0;
+  flat_weft_t *diff = NULL;
+
+  for (uint32_t i = 0; i < a_len; i++) {
+    uint32_t yarn = FW_YARNS(FW(a))[i], offset = FW_OFFSETS(FW(a))[i];
+    while (j < b_len && FW_YARNS(FW(b))[j] < yarn) j++;
+    if (j < b_len && FW_YARNS(FW(b))[j] == yarn &&
+        FW_OFFSETS(FW(b))[j] >= offset) continue;
+    if (diff == NULL && (diff = flat_weft_alloc(a_len - i)) == NULL)
+      return ERRWEFT;
+    /* Entries come out in yarn order, so this is just an append. */
+    FW_YARNS(diff)[diff->len] = yarn; FW_OFFSETS(diff)[diff->len++] = offset;
+  }
+  return (weft_t)diff;
+}
+
+/* Find the first mapping in a weft whose yarn is at least *yarn. If there is
+   one, put its yarn and offset in *yarn and *offset, and return 1. Otherwise,
+   return 0. To go through a whole weft, start with yarn 0, and add 1 to the
+   yarn after each mapping. */
+int weft_next(weft_t weft, uint32_t *yarn, uint32_t *offset) {
+  uint32_t i;
+  if (weft == NULL) return 0;
+  i = flat_weft_lower_bound(FW(weft), *yarn);
+  if (i == FW(weft)->len) return 0;
+  *yarn = FW_YARNS(FW(weft))[i]; *offset = FW_OFFSETS(FW(weft))[i];
+  return 1;
+}
+
+
+/********************************* Debugging **********************************/
+#ifdef DEBUG
+
+/* Turn a string like "a5b3d1" into a weft, and return the new weft. Does not do
+   error checking, and requires that the weft be de-allocated by the client. */
+weft_t quickweft(const char *str) {
+  weft_t weft = new_weft();
+
+  for (int i = 0; i < strlen(str); i += 2)
+    weft_set(&weft, str[i] - 'a' + 1, str[i+1] - '0');
+
+  return weft;
+}
+
+/* Print a weft in quickweft() format. */
+void quickweft_print(weft_t weft) {
+  printf("<");
+  for (uint32_t i = 0; i < FW_LEN(weft); i++)
+    printf("%c%u", (char)(FW_YARNS(FW(weft))[i] & 0xFF) + 'a' - 1,
+           FW_OFFSETS(FW(weft))[i]);
+  printf(">\n");
+}
+
+#endif
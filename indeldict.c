@@ -0,0 +1,176 @@
+/* Predecessor lookup dicts, used by every weave representation to find the
+   anchors of a patch's chains during its pass over the weave. */
+
+#include "sburb.h"
+
+/************************** Predecessor lookup dicts **************************/
+
+/* A predecessor lookup dict is one of two types of JudyL arrays. A deldict maps
+   from ids to deletion atoms. An insdict maps from ids to insrecs. An insrec
+   contains a pointer to a chain, and the chain length. These things are used in
+   the patch insertion process; constructed during a preprocessing phase and
+   then used during a one-pass traversal of the weave. */
+
+/* Insert a pointer to a thing into either an insdict or a deldict. The thing
+   should be either an atom (for deldicts) or an insrec (for insdicts). */
+int indeldict_insert(Pvoid_t *dict, uint64_t id, void *thing) {
+  Word_t index_outer; Word_t *pvalue_outer;
+  Word_t index_inner; Word_t *pvalue_inner;
+  Pvoid_t inner_judy;           /* Inner judy arrays */
+  Pvoid_t temp = *dict;
+
+  index_outer = YARN(id); JLI(pvalue_outer, temp, index_outer);
+  if (pvalue_outer == PJERR) return -1; /* malloc() error */
+  if (*pvalue_outer == 0) {
+    inner_judy = (Pvoid_t)NULL; index_inner = OFFSET(id);
+  } else {
+    inner_judy = (Pvoid_t)*pvalue_outer; index_inner = OFFSET(id);
+  }
+
+  JLI(pvalue_inner, inner_judy, index_inner);
+  if (pvalue_inner == PJERR) return -1; /* malloc() error */
+  *pvalue_inner = (Word_t)thing;
+  *pvalue_outer = (Word_t)inner_judy;
+  *dict = temp; return 0;
+}
+
+/* Get the thing corresponding to the given id in an insdict or deldict. Returns
+   NULL if nothing was found corresponding to that id. */
+void *indeldict_get(Pvoid_t dict, uint64_t id) {
+  Word_t index_outer; Word_t *pvalue_outer;
+  Word_t index_inner; Word_t *pvalue_inner;
+  Pvoid_t inner_judy;
+
+  /* Look up the yarn */
+  if (dict == NULL) return NULL; /* common case: empty set */
+  index_outer = YARN(id); JLG(pvalue_outer, dict, index_outer);
+  if (pvalue_outer == PJERR) return NULL; /* malloc() error */
+  if (pvalue_outer == NULL) return NULL;  /* yarn not found */
+  
+  /* Yarn found. Look up the offset. */
+  inner_judy = (Pvoid_t)*pvalue_outer; index_inner = OFFSET(id);
+  JLG(pvalue_inner, inner_judy, index_inner);
+  if (pvalue_inner == PJERR) return NULL; /* malloc() error */
+  if (pvalue_inner == NULL) return NULL;  /* offset not found */
+  
+  /* Id found. Return thing. */
+  return (void *)*pvalue_inner;
+}
+
+/* Delete an insdict, de-allocating all insrecs in it. */
+void delete_insdict(insdict_t insdict) {
+  Word_t index_outer; Word_t *pvalue_outer;
+  Word_t index_inner; Word_t *pvalue_inner;
+  Pvoid_t inner_judy; Word_t rc_word;
+
+  /* Traverse the outer JudyL */
+  index_outer = 0;
+  JLF(pvalue_outer, insdict, index_outer);
+  while (pvalue_outer != NULL) {
+    inner_judy = (Pvoid_t)*pvalue_outer;
+    /* Traverse the inner JudyL, freeing insrecs */
+    index_inner = 0;
+    JLF(pvalue_inner, inner_judy, index_inner);
+    while (pvalue_inner != NULL) {
+      free((void *)*pvalue_inner);
+      JLN(pvalue_inner, inner_judy, index_inner);
+    }
+    /* Free the inner JudyL, and proceed to the next one */
+    JLFA(rc_word, inner_judy);
+    JLN(pvalue_outer, insdict, index_outer);
+  }
+  JLFA(rc_word, insdict);
+}
+
+/* Delete a deldict. */
+void delete_deldict(deldict_t deldict) {
+  Word_t index_outer; Word_t *pvalue_outer;
+  Pvoid_t inner_judy; Word_t rc_word;
+
+  /* Traverse the outer JudyL */
+  index_outer = 0;
+  JLF(pvalue_outer, deldict, index_outer);
+  while (pvalue_outer != NULL) {
+    inner_judy = (Pvoid_t)*pvalue_outer;
+    JLFA(rc_word, inner_judy);
+    JLN(pvalue_outer, deldict, index_outer);
+  }
+  JLFA(rc_word, deldict);
+}
+
+/* Allocate an insrec with a given chain and number of atoms in the chain. Has no
+   overhead over making it manually. Must be freed by the user. */
+static inline insrec_t *make_insrec(void *chain, uint16_t len_atoms) {
+  insrec_t *insrec = malloc(sizeof(insrec_t));
+  insrec->chain = chain; insrec->len_atoms = len_atoms;
+  return insrec;
+}
+
+
+/************************ Making insdicts and deldicts ************************/
+
+/* Add the awareness wefts of a patch's atoms to a memodict, for the atoms whose
+   predecessors are in other yarns. The patch must be ready to apply. Returns 0
+   on success. */
+int memoize_patch(memodict_t *memodict, patch_t patch) {
+  uint32_t *p32 = patch_atoms(patch);
+  uint64_t id, pred; uint32_t c;
+
+  for (uint32_t i = patch_length_atoms(patch); i > 0; i--) {
+    READ_ATOM_SEQ(id, pred, c, p32);
+    if (YARN(id) != YARN(pred))
+      LIFTERR(memodict_add(memodict, id, pull(*memodict, id, pred)));
+  }
+  return 0;
+}
+
+/* Take a patch that we've previously verified is ready to apply, and make the
+   insdict and deldict for it. Takes pointers to an insdict and a deldict, which
+   should initially be empty, and modifies them. Returns 0 on success.
+
+   How this works is, it goes through all the chains in the patch. For insertion
+   chains, it creates an insrec and inserts that into insdict. For deletion
+   chains, it iterates through all the atoms and adds each one to the deldict.
+   Afterward, it adds the awareness wefts of the patch's atoms to the weave's
+   memodict, which is passed in by pointer.
+*/
+int make_indeldict(patch_t patch, insdict_t *insdict, deldict_t *deldict,
+                   memodict_t *memodict) {
+  uint32_t *p32 = patch; void *ptr = patch;
+  uint32_t length_bytes; uint8_t chain_count;
+  READ_PATCH_HEADER(length_bytes, chain_count, ptr); p32 = ptr;
+  uint16_t chain_lengths[255];
+
+  /* Read chain lengths */
+  for (uint32_t chain = 0; chain < chain_count; chain++) {
+    uint16_t len_atoms = 0; uint32_t offset = 0;
+    READ_CHAIN_DESCRIPTOR(offset, len_atoms, p32);
+    chain_lengths[chain] = len_atoms;
+  }
+
+  /* Process each chain */
+  for (uint32_t chain = 0; chain < chain_count; chain++) {
+    uint64_t id, pred; uint32_t c;
+    READ_ATOM_SEQ(id, pred, c, p32); p32 -= 5; /* peek */
+    //    printf("$ Processing patch atom: (%u,%u),\t(%u,%u),\t%X\n",
+    //           YARN(id), OFFSET(id), YARN(pred), OFFSET(pred), (int)c);
+    if (c == ATOM_CHAR_DEL) {
+      /* Deletion chain. Add deletors to deldict. */
+      for (uint16_t i = chain_lengths[chain]; i > 0; i--) {
+        READ_ATOM_SEQ(id, pred, c, p32);
+        LIFTERR(indeldict_insert(deldict, pred, (void*)(p32 - 5)));
+      }
+      continue;
+    } else if (c == ATOM_CHAR_SAVE) {
+      /* Save-awareness chain. Add to insrec for end atom. */
+      LIFTERR(indeldict_insert(insdict, PACK_ID(0,2),
+                               (void*)make_insrec((void*)p32, chain_lengths[chain])));
+    } else {
+      /* Regular insertion chain. Create insrec and add to insdict. */
+      LIFTERR(indeldict_insert(insdict, pred,
+                               (void*)make_insrec((void*)p32, chain_lengths[chain])));
+    }
+    p32 += 5 * chain_lengths[chain];
+  }
+  return memoize_patch(memodict, patch);
+}
@@ -0,0 +1,239 @@
+/* Ingest pipelines: patches from the wire applied to a vector weave, with
+   decoding and checking done on other threads than applying.
+
+   Taking a patch off the wire is three jobs: decoding and validating it,
+   working out whether it's ready, and putting it in the weave. Only the last
+   needs the weave, so each gets a thread of its own, and they're joined by
+   rings (see ring.c):
+
+     ingest_push() -> decode -> check -> apply
+
+   The decode stage turns wire bytes into a patch with patch_from_wire(), and
+   checks it with patch_validate(); bad patches are dropped there. The check
+   stage finds each patch's blocking id against the most recent weft the
+   apply stage has sent back along a fourth ring, and drops patches that are
+   already in the weave. Since a weft only grows, a patch that's ready by an
+   old weft is ready by the current one; the apply stage still decides for
+   itself, since a blocked patch may have become ready since. The apply stage
+   takes whatever patches are waiting, up to a batch, and applies them in one
+   apply_and_drain(), so the faster the patches come, the bigger the batches.
+   A batch with a bad patch in it is applied again a patch at a time, so that
+   only the bad one is lost.
+
+   The weave belongs to the apply stage from new_ingest() until
+   ingest_finish(); nothing else may touch it in between. */
+
+#include "sburb.h"
+
+/* Defaults for the ring sizes and the most patches applied in one batch. */
+#ifndef INGEST_RING_SIZE
+#define INGEST_RING_SIZE 1024
+#endif
+#ifndef INGEST_BATCH
+#define INGEST_BATCH 256
+#endif
+#define INGEST_WEFT_RING_SIZE 4
+
+/* A patch on its way through the pipeline. */
+typedef struct {
+  uint8_t *buf;                 /* Wire bytes, until decoded */
+  uint32_t len;
+  patch_t patch;                /* The decoded patch */
+  uint64_t blocking_id;         /* As of the check stage */
+} ingest_item_t;
+
+/* Sent down the pipeline after the last item, to stop each stage. */
+static ingest_item_t end_of_input;
+
+struct ingest {
+  weave_t *weave;
+  ring_t input;                 /* ingest_push() to decode */
+  ring_t decoded;               /* Decode to check */
+  ring_t checked;               /* Check to apply */
+  ring_t wefts;                 /* Apply back to check: copies of the weft */
+  pthread_t decoder, checker, applier;
+  ingest_stats_t stats;         /* Each field is written by one stage */
+};
+
+/* Decode stage: wire bytes to validated patches. */
+static void *decode_main(void *arg) {
+  ingest_t ingest = arg;
+  ingest_item_t *item;
+  patch_info_t info;
+
+  while ((item = ring_pop_wait(ingest->input)) != &end_of_input) {
+    item->patch = patch_from_wire(item->buf, item->len);
+    free(item->buf); item->buf = NULL;
+    if (item->patch == NULL ||
+        patch_validate(item->patch, patch_length_bytes(item->patch), NULL,
+                       &info) != 0) {
+      ingest->stats.invalid++;
+      free(item->patch); free(item);
+      continue;
+    }
+    ring_push_wait(ingest->decoded, item);
+  }
+  ring_push_wait(ingest->decoded, &end_of_input);
+  return NULL;
+}
+
+/* Check stage: blocking ids against the apply stage's latest weft. */
+static void *check_main(void *arg) {
+  ingest_t ingest = arg;
+  ingest_item_t *item;
+  weft_t weft = NULL, newer;
+
+  while ((item = ring_pop_wait(ingest->decoded)) != &end_of_input) {
+    while ((newer = ring_pop(ingest->wefts)) != NULL) {
+      delete_weft(weft);
+      weft = newer;
+    }
+    item->blocking_id = patch_blocking_id(item->patch, weft);
+    if (item->blocking_id == 1) { /* already applied */
+      ingest->stats.duplicates++;
+      free(item->patch); free(item);
+      continue;
+    }
+    if (item->blocking_id != 0) ingest->stats.early_blocked++;
+    ring_push_wait(ingest->checked, item);
+  }
+  ring_push_wait(ingest->checked, &end_of_input);
+  delete_weft(weft);
+  return NULL;
+}
+
+/* Apply stage: batches of patches into the weave. */
+static void *apply_main(void *arg) {
+  ingest_t ingest = arg;
+  patch_t batch[INGEST_BATCH];
+  ingest_item_t *item;
+  int done = FALSE;
+
+  while (!done) {
+    int n = 0;
+    item = ring_pop_wait(ingest->checked);
+    do {
+      if (item == &end_of_input) { done = TRUE; break; }
+      batch[n++] = item->patch;
+      free(item);
+    } while (n < INGEST_BATCH && (item = ring_pop(ingest->checked)) != NULL);
+    if (n == 0) break;
+
+    /* If the batch fails, the patches before the one that failed are in and
+       the rest aren't, so go through it again a patch at a time, so that one
+       bad patch doesn't take the rest with it. The ones already in are
+       dropped as duplicates. */
+    if (apply_and_drain(ingest->weave, batch, n) == 0) {
+      ingest->stats.applied += n;
+    } else {
+      for (int i = 0; i < n; i++) {
+        if (apply_and_drain(ingest->weave, &batch[i], 1) == 0)
+          ingest->stats.applied++;
+        else
+          ingest->stats.failed++;
+      }
+    }
+    ingest->stats.batches++;
+    for (int i = 0; i < n; i++) free(batch[i]);
+
+    /* Tell the check stage about the new weft, if it has room. */
+    if (!done && !ring_full(ingest->wefts)) {
+      weft_t weft = copy_weft(ingest->weave->weft);
+      if (weft != ERRWEFT && weft != NULL &&
+          ring_push(ingest->wefts, weft) != 0)
+        delete_weft(weft);
+    }
+  }
+  return NULL;
+}
+
+/* Start an ingest pipeline for a weave, which belongs to the pipeline until
+   ingest_finish(). Returns NULL on failure. */
+ingest_t new_ingest(weave_t *weave) {
+  ingest_t ingest = calloc(1, sizeof(struct ingest));
+  int started = 0;
+
+  if (ingest == NULL) return NULL;
+  ingest->weave = weave;
+  if ((ingest->input = new_ring(INGEST_RING_SIZE)) == NULL ||
+      (ingest->decoded = new_ring(INGEST_RING_SIZE)) == NULL ||
+      (ingest->checked = new_ring(INGEST_RING_SIZE)) == NULL ||
+      (ingest->wefts = new_ring(INGEST_WEFT_RING_SIZE)) == NULL)
+    goto fail;
+  if (pthread_create(&ingest->decoder, NULL, decode_main, ingest) != 0)
+    goto fail;
+  started++;
+  if (pthread_create(&ingest->checker, NULL, check_main, ingest) != 0)
+    goto fail;
+  started++;
+  if (pthread_create(&ingest->applier, NULL, apply_main, ingest) != 0)
+    goto fail;
+  return ingest;
+
+ fail:
+  /* Stop whichever stages got started. The end of input only has to get as
+     far as the last of them, and the rings have room for it. */
+  if (started > 0) {
+    ring_push_wait(ingest->input, &end_of_input);
+    pthread_join(ingest->decoder, NULL);
+  }
+  if (started > 1) pthread_join(ingest->checker, NULL);
+  delete_ring(ingest->input); delete_ring(ingest->decoded);
+  delete_ring(ingest->checked); delete_ring(ingest->wefts);
+  free(ingest);
+  return NULL;
+}
+
+/* Push a patch, in any wire format, into an ingest pipeline. Takes ownership
+   of buf, which must have come from malloc(). Waits if the pipeline is
+   backed up. Only one thread may push to a pipeline. Returns 0 on success, or
+   -1 on malloc() failure, in which case buf still belongs to the caller. */
+int ingest_push(ingest_t ingest, uint8_t *buf, uint32_t len) {
+  ingest_item_t *item = malloc(sizeof(ingest_item_t));
+  if (item == NULL) return -1;
+  item->buf = buf; item->len = len; item->patch = NULL;
+  ingest->stats.received++;
+  ring_push_wait(ingest->input, item);
+  return 0;
+}
+
+/* Finish an ingest pipeline: wait for every patch pushed to be applied, stop
+   the threads, and hand the weave back. Fills in *stats, if it isn't
+   NULL. */
+void ingest_finish(ingest_t ingest, ingest_stats_t *stats) {
+  weft_t weft;
+
+  ring_push_wait(ingest->input, &end_of_input);
+  pthread_join(ingest->decoder, NULL);
+  pthread_join(ingest->checker, NULL);
+  pthread_join(ingest->applier, NULL);
+  /* The apply stage can send wefts after the check stage has stopped. */
+  while ((weft = ring_pop(ingest->wefts)) != NULL) delete_weft(weft);
+  if (stats != NULL) *stats = ingest->stats;
+  delete_ring(ingest->input); delete_ring(ingest->decoded);
+  delete_ring(ingest->checked); delete_ring(ingest->wefts);
+  free(ingest);
+}
+
+
+/********************************** Testing ***********************************/
+
+// int main(void) {
+//   weave_t weave = new_weave(0);
+//   ingest_t ingest = new_ingest(&weave);
+//   ingest_stats_t stats;
+//   patch_t patches[2] = { make_patch1(), make_patch2() };
+//
+//   for (int i = 1; i >= 0; i--) {   /* Out of order, to exercise blocking */
+//     uint8_t *buf = malloc(patch_wire_bound(patches[i], PATCH_WIRE_COMPACT));
+//     uint32_t len = patch_to_wire(patches[i], PATCH_WIRE_COMPACT, buf);
+//     LIFTERR(ingest_push(ingest, buf, len));
+//     free(patches[i]);
+//   }
+//   ingest_finish(ingest, &stats);
+//   printf("%llu applied in %llu batches\n", (long long)stats.applied,
+//          (long long)stats.batches);
+//   weave_scour_print(weave);
+//   delete_weave(weave);
+//   return 0;
+// }
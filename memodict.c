@@ -12,13 +12,20 @@
       do, then return an error code.
    3. Return a copy of this weft, extended to cover the current id. Hooray!
 
+   The wefts in the dict are interned (see weft_pool.c), so atoms with the same
+   awareness share a single weft. pull() (in pull.c) only allocates when the
+   pulled weft differs from the one stored in the dict.
+
+   This is the default memodict representation; see memodict_delta.c for a
+   more compact one.
+
    To add a weft to the monstrosity:
 
    1. Look up the yarn. If it's not found, create a new JudyL array; call this
       array =inner=. Insert an (offset -> weft) mapping into =inner=, and insert
       (yarn -> =inner=) into the outer array. Return. OTHERWISE:
    2. Use JLI to ensure that there is a mapping of offset->weft. If there's
-      already a weft at that position in the array, de-allocate it. Then set the
+      already a weft at that position in the array, release it. Then set the
       pointer (from JLI) to point to the new weft.
    3. Return a success value! Hooray!
 */
@@ -31,8 +38,8 @@ memodict_t new_memodict(void) {
   return (memodict_t)NULL;
 }
 
-/* Delete a memoization dict, and free its memory. Also frees the memory of all
-   wefts in the dict, so be careful if you were sharing those with other code. */
+/* Delete a memoization dict, and free its memory. Also releases the dict's
+   references to all of its wefts. */
 void delete_memodict(memodict_t memodict) {
   Word_t index_outer; Word_t *pvalue_outer;
   Word_t index_inner; Word_t *pvalue_inner;
@@ -47,7 +54,7 @@ void delete_memodict(memodict_t memodict) {
     index_inner = 0;
     JLF(pvalue_inner, inner_judy, index_inner);
     while (pvalue_inner != NULL) {
-      delete_weft((weft_t)*pvalue_inner);
+      weft_release((weft_t)*pvalue_inner);
       JLN(pvalue_inner, inner_judy, index_inner);
     }
     /* Free the inner JudyL, and proceed to the next one */
@@ -82,9 +89,10 @@ void memodict_print(memodict_t memodict) {
 }
 
 /* Add an (id, weft) pair to a memoization dict. You must give a pointer to the
-   memoization dict to be modified. If there is already a weft mapped to the
-   given id, then that previous weft will be deallocated and replaced by the new
-   one. */
+   memoization dict to be modified. The weft must be interned, and the dict
+   takes over the caller's reference to it. If there is already a weft mapped
+   to the given id, then that previous weft will be released and replaced by
+   the new one. */
 int memodict_add(memodict_t *memodict, uint64_t id, weft_t weft) {
   Word_t index_outer; Word_t *pvalue_outer;
   Word_t index_inner; Word_t *pvalue_inner;
@@ -107,7 +115,7 @@ int memodict_add(memodict_t *memodict, uint64_t id, weft_t weft) {
     inner_judy = (Pvoid_t)*pvalue_outer; index_inner = OFFSET(id);
     JLI(pvalue_inner, inner_judy, index_inner);
     if (pvalue_inner == PJERR) return -1; /* malloc() error */
-    if (*pvalue_inner != 0) delete_weft((weft_t)*pvalue_inner);
+    if (*pvalue_inner != 0) weft_release((weft_t)*pvalue_inner);
     *pvalue_inner = (Word_t)weft;
     *pvalue_outer = (Word_t)inner_judy;
   }
@@ -117,7 +125,8 @@ int memodict_add(memodict_t *memodict, uint64_t id, weft_t weft) {
 
 /* Look up an id in a memoization dict. Returns either an empty weft, or the
    weft in the given yarn with the highest offset less than or equal to the
-   given offset. Does not copy or modify any wefts, nor allocate new ones. */
+   given offset. Does not copy or modify any wefts, nor allocate new ones. Returns
+   a new reference to the weft, which the caller must weft_release(). */
 weft_t memodict_get(memodict_t memodict, uint64_t id) {
   Word_t index_outer; Word_t *pvalue_outer;
   Word_t index_inner; Word_t *pvalue_inner;
@@ -134,34 +143,31 @@ weft_t memodict_get(memodict_t memodict, uint64_t id) {
     inner_judy = (Pvoid_t)*pvalue_outer; index_inner = OFFSET(id);
     JLL(pvalue_inner, inner_judy, index_inner);
     if (pvalue_inner == NULL) return new_weft();
-    return (weft_t)*pvalue_inner;
+    return weft_retain((weft_t)*pvalue_inner);
   }
 }
 
-/* Pull the awareness weft of a given atom id, assuming a properly filled-out
-   memoization dict. This allocates and returns a new weft, which must be
-   explicitly freed by the caller. Optionally takes a predecessor id; if 0 is
-   passed in place of the predecessor id, then it will be ignored.
-
-   In the event of an error, returns ERRWEFT. */
-weft_t pull(memodict_t memodict, uint64_t id, uint64_t pred) {
-  weft_t weft = copy_weft(memodict_get(memodict, id));
-  if (weft == ERRWEFT) return ERRWEFT;
-  if (weft_extend(&weft, YARN(id), OFFSET(id)) != 0) {
-    delete_weft(weft);
-    return ERRWEFT;
-  }
+/* Find the first id at or after *id that has an entry of its own in a
+   memoization dict, and put it in *id. Returns 1 if there is one, 0 if not.
+   To go through every entry, start from 0 and add 1 each time. */
+int memodict_next(memodict_t memodict, uint64_t *id) {
+  Word_t index_outer; Word_t *pvalue_outer;
+  Word_t index_inner; Word_t *pvalue_inner;
 
-  if (pred != 0) {
-    weft_t pred_weft = memodict_get(memodict, pred); /* not extended */
-    if (weft_merge_into(&weft, pred_weft) != 0) {
-      delete_weft(weft);
-      return ERRWEFT;
+  index_outer = YARN(*id);
+  JLF(pvalue_outer, memodict, index_outer);
+  index_inner = index_outer == YARN(*id) ? OFFSET(*id) : 0;
+  while (pvalue_outer != NULL) {
+    Pvoid_t inner_judy = (Pvoid_t)*pvalue_outer;
+    JLF(pvalue_inner, inner_judy, index_inner);
+    if (pvalue_inner != NULL) {
+      *id = PACK_ID(index_outer, index_inner);
+      return 1;
     }
-    if (weft_extend(&weft, YARN(pred), OFFSET(pred)) != 0) return ERRWEFT;
+    index_inner = 0;
+    JLN(pvalue_outer, memodict, index_outer);
   }
-
-  return weft;
+  return 0;
 }
 
 /********************************* Debugging **********************************/
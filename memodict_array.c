@@ -0,0 +1,190 @@
+/* An array-based id-to-weft memoization dict. This has the same interface and
+   the same invariant as the one in memodict.c, but replaces the inner JudyL
+   arrays with one sorted array of (offset, weft) entries per yarn.
+
+   Offsets within a yarn are almost always added in increasing order (by
+   memoize_patch()), so adding an entry is usually an amortized O(1)
+   append. Inserting anywhere else is a memmove(), which is
+   fine because it almost never happens.
+
+   Lookups find the entry with the highest offset <= the one asked for, with a
+   branchless binary search over the offsets. Each yarn remembers the last
+   entry it found; since pulls tend to walk through a yarn in order, that entry
+   or the one after it is usually the answer, and then we don't search at
+   all. The outer array, keyed by yarn, is still a JudyL array. */
+
+#include "sburb.h"
+
+typedef struct {
+  Word_t length;                /* Number of entries */
+  Word_t capacity;              /* Number of entries allocated */
+  Word_t cursor;                /* Index of the last entry found */
+  uint32_t *offsets;            /* Sorted offsets */
+  weft_t *wefts;                /* wefts[i] is the weft for offsets[i] */
+} yarn_array_t;
+
+/* Allocate and return a new, empty memoization dict. */
+memodict_t new_memodict(void) {
+  return (memodict_t)NULL;
+}
+
+/* Delete a memoization dict, and free its memory. Also releases the dict's
+   references to all of its wefts. */
+void delete_memodict(memodict_t memodict) {
+  Word_t index = 0; Word_t *pvalue; Word_t rc_word;
+  JLF(pvalue, memodict, index);
+  while (pvalue != NULL) {
+    yarn_array_t *ya = (yarn_array_t *)*pvalue;
+    for (Word_t i = 0; i < ya->length; i++) weft_release(ya->wefts[i]);
+    free(ya->offsets); free(ya->wefts); free(ya);
+    JLN(pvalue, memodict, index);
+  }
+  JLFA(rc_word, memodict);
+}
+
+/* Print a memoization dict, for debugging purposes. */
+void memodict_print(memodict_t memodict) {
+  Word_t index = 0; Word_t *pvalue;
+  JLF(pvalue, memodict, index);
+  while (pvalue != NULL) {
+    yarn_array_t *ya = (yarn_array_t *)*pvalue;
+    for (Word_t i = 0; i < ya->length; i++) {
+      printf("/-----------------------------\\\n");
+      printf("  ID: %u, %u\n", (uint32_t)index, ya->offsets[i]);
+      weft_print(ya->wefts[i]);
+      printf("\\-----------------------------/\n\n");
+    }
+    JLN(pvalue, memodict, index);
+  }
+}
+
+/* Return the number of entries in a yarn array with offsets <= offset. The
+   last such entry, if any, is at one less than this. */
+static inline Word_t yarn_array_rank(yarn_array_t *ya, uint32_t offset) {
+  const uint32_t *base = ya->offsets;
+  Word_t n = ya->length, c = ya->cursor;
+
+  if (n == 0) return 0;
+
+  /* Try the cursor and the entry after it first. */
+  if (base[c] <= offset) {
+    if (c + 1 == n || base[c + 1] > offset) return c + 1;
+    if (c + 2 == n || base[c + 2] > offset) return c + 2;
+  }
+
+  /* Branchless binary search: base ends up at the last entry <= offset, or at
+     the first entry if there isn't one. */
+  while (n > 1) {
+    Word_t half = n / 2;
+    base = (base[half] <= offset) ? base + half : base;
+    n -= half;
+  }
+  return (base - ya->offsets) + (*base <= offset);
+}
+
+/* Make room for at least one more entry in a yarn array. Returns 0 on success,
+   -1 on malloc() failure. */
+static int yarn_array_grow(yarn_array_t *ya) {
+  Word_t capacity = ya->capacity == 0 ? 8 : ya->capacity * 2;
+  uint32_t *offsets; weft_t *wefts;
+
+  if (ya->length < ya->capacity) return 0;
+  offsets = realloc(ya->offsets, capacity * sizeof(uint32_t));
+  if (offsets == NULL) return -1;
+  ya->offsets = offsets;
+  wefts = realloc(ya->wefts, capacity * sizeof(weft_t));
+  if (wefts == NULL) return -1;
+  ya->wefts = wefts;
+  ya->capacity = capacity;
+  return 0;
+}
+
+/* Add an (id, weft) pair to a memoization dict. You must give a pointer to the
+   memoization dict to be modified. The weft must be interned, and the dict
+   takes over the caller's reference to it. If there is already a weft mapped
+   to the given id, then that previous weft will be released and replaced by
+   the new one. */
+int memodict_add(memodict_t *memodict, uint64_t id, weft_t weft) {
+  Word_t yarn = YARN(id); uint32_t offset = OFFSET(id);
+  Word_t *pvalue, rank;
+  memodict_t temp = *memodict;
+  yarn_array_t *ya;
+
+  /* Look up the yarn, adding an empty array for it if it's new. */
+  JLI(pvalue, temp, yarn);
+  if (pvalue == PJERR) goto fail; /* malloc() error */
+  if (*pvalue == 0) {
+    ya = calloc(1, sizeof(yarn_array_t));
+    if (ya == NULL) { int rc_int; JLD(rc_int, temp, yarn); goto fail; }
+    *pvalue = (Word_t)ya;
+  }
+  ya = (yarn_array_t *)*pvalue;
+  *memodict = temp;
+
+  /* Appending is the usual case. */
+  if (ya->length == 0 || ya->offsets[ya->length - 1] < offset) {
+    if (yarn_array_grow(ya) != 0) goto fail;
+    ya->offsets[ya->length] = offset; ya->wefts[ya->length] = weft;
+    ya->length++;
+    return 0;
+  }
+
+  /* Replace an existing entry, or insert a new one in the middle. */
+  rank = yarn_array_rank(ya, offset);
+  if (rank > 0 && ya->offsets[rank - 1] == offset) {
+    weft_release(ya->wefts[rank - 1]);
+    ya->wefts[rank - 1] = weft;
+    return 0;
+  }
+  if (yarn_array_grow(ya) != 0) goto fail;
+  memmove(ya->offsets + rank + 1, ya->offsets + rank,
+          (ya->length - rank) * sizeof(uint32_t));
+  memmove(ya->wefts + rank + 1, ya->wefts + rank,
+          (ya->length - rank) * sizeof(weft_t));
+  ya->offsets[rank] = offset; ya->wefts[rank] = weft;
+  ya->length++;
+  ya->cursor = 0;
+  return 0;
+
+ fail:
+  weft_release(weft);
+  return -1;
+}
+
+/* Look up an id in a memoization dict. Returns either an empty weft, or the
+   weft in the given yarn with the highest offset less than or equal to the
+   given offset. Does not copy or modify any wefts, nor allocate new ones. Returns
+   a new reference to the weft, which the caller must weft_release(). */
+weft_t memodict_get(memodict_t memodict, uint64_t id) {
+  Word_t *pvalue, rank;
+  yarn_array_t *ya;
+
+  JLG(pvalue, memodict, (Word_t)YARN(id));
+  if (pvalue == NULL || pvalue == PJERR) return new_weft();
+  ya = (yarn_array_t *)*pvalue;
+  rank = yarn_array_rank(ya, OFFSET(id));
+  if (rank == 0) return new_weft();
+  ya->cursor = rank - 1;
+  return weft_retain(ya->wefts[rank - 1]);
+}
+
+/* Find the first id at or after *id that has an entry of its own in a
+   memoization dict, and put it in *id. Returns 1 if there is one, 0 if not. */
+int memodict_next(memodict_t memodict, uint64_t *id) {
+  Word_t yarn = YARN(*id); Word_t *pvalue;
+  uint32_t offset;
+
+  JLF(pvalue, memodict, yarn);
+  offset = yarn == YARN(*id) ? OFFSET(*id) : 0;
+  while (pvalue != NULL) {
+    yarn_array_t *ya = (yarn_array_t *)*pvalue;
+    Word_t i = offset == 0 ? 0 : yarn_array_rank(ya, offset - 1);
+    if (i < ya->length) {
+      *id = PACK_ID(yarn, ya->offsets[i]);
+      return 1;
+    }
+    offset = 0;
+    JLN(pvalue, memodict, yarn);
+  }
+  return 0;
+}
@@ -0,0 +1,317 @@
+/* A delta-encoded id-to-weft memoization dict. This has the same interface
+   and the same invariant as the one in memodict.c, but takes much less memory
+   on documents with many authors: consecutive entries in a yarn usually differ
+   by only a few yarn tops, so most entries are stored as just those tops.
+
+   The outer JudyL array maps yarns to yarn_md_t structures. Each of these has
+   two JudyL arrays keyed by offset, and every entry in the yarn is in exactly
+   one of them:
+
+   - =full= holds checkpoints: complete wefts.
+   - =deltas= holds the wefts of the other entries as weft_diff() against the
+     previous entry in the yarn. The previous entry's weft must be <= this
+     entry's weft (see weft_leq()) for the delta to be stored, so that merging
+     the delta into the previous weft gives back the original.
+
+   To look up an id, find the last entry at or before its offset, and then
+   merge the deltas since the last checkpoint before it into a copy of that
+   checkpoint. A checkpoint is stored at least every
+   MEMODICT_CHECKPOINT_INTERVAL entries, which bounds the number of merges.
+   Each yarn also caches the last weft it reconstructed, so that walking
+   forward through a yarn only merges the deltas that have been stepped over.
+
+   Entries are almost always appended at the end of a yarn. Anything else is
+   stored as a checkpoint, and the entry after it is turned into a checkpoint
+   too, since its delta was against whatever used to come before it.
+
+   All the wefts involved, deltas included, are interned (see weft_pool.c). */
+
+#include "sburb.h"
+
+/* Store a full weft at least this often in each yarn. */
+#ifndef MEMODICT_CHECKPOINT_INTERVAL
+#define MEMODICT_CHECKPOINT_INTERVAL 16
+#endif
+
+typedef struct {
+  Pvoid_t full;                 /* offset -> complete weft */
+  Pvoid_t deltas;               /* offset -> diff against previous entry */
+  Word_t since_full;            /* Deltas appended since the last checkpoint */
+  Word_t cache_offset;          /* Offset of the cached entry */
+  weft_t cache;                 /* Reconstructed weft of that entry, or ERRWEFT */
+} yarn_md_t;
+
+/* Allocate and return a new, empty memoization dict. */
+memodict_t new_memodict(void) {
+  return (memodict_t)NULL;
+}
+
+/* Release every weft in a JudyL array of wefts, and free the array. */
+static void release_wefts(Pvoid_t judy) {
+  Word_t index = 0; Word_t *pvalue; Word_t rc_word;
+  JLF(pvalue, judy, index);
+  while (pvalue != NULL) {
+    weft_release((weft_t)*pvalue);
+    JLN(pvalue, judy, index);
+  }
+  JLFA(rc_word, judy);
+}
+
+/* Drop a yarn's cached weft. */
+static inline void drop_cache(yarn_md_t *ymd) {
+  if (ymd->cache != ERRWEFT) weft_release(ymd->cache);
+  ymd->cache = ERRWEFT;
+}
+
+/* Delete a memoization dict, and free its memory. Also releases the dict's
+   references to all of its wefts. */
+void delete_memodict(memodict_t memodict) {
+  Word_t index = 0; Word_t *pvalue; Word_t rc_word;
+  JLF(pvalue, memodict, index);
+  while (pvalue != NULL) {
+    yarn_md_t *ymd = (yarn_md_t *)*pvalue;
+    release_wefts(ymd->full); release_wefts(ymd->deltas);
+    drop_cache(ymd);
+    free(ymd);
+    JLN(pvalue, memodict, index);
+  }
+  JLFA(rc_word, memodict);
+}
+
+/* Find the last entry in a yarn with an offset <= *offset. Sets *offset to it
+   and *is_full to whether it's a checkpoint. Returns 0 if there is no such
+   entry, 1 otherwise. */
+static int last_entry(yarn_md_t *ymd, Word_t *offset, int *is_full) {
+  Word_t full_index = *offset, delta_index = *offset;
+  Word_t *pfull, *pdelta;
+  JLL(pfull, ymd->full, full_index);
+  JLL(pdelta, ymd->deltas, delta_index);
+  if (pfull == NULL && pdelta == NULL) return 0;
+  if (pdelta == NULL || (pfull != NULL && full_index > delta_index)) {
+    *offset = full_index; *is_full = 1;
+  } else {
+    *offset = delta_index; *is_full = 0;
+  }
+  return 1;
+}
+
+/* Reconstruct the weft of the entry at a given offset, which must exist in the
+   yarn, and cache it. Returns a new reference, or ERRWEFT on malloc()
+   failure. */
+static weft_t reconstruct(yarn_md_t *ymd, Word_t offset) {
+  Word_t base_offset = offset, index; Word_t *pvalue;
+  weft_t base, weft;
+
+  if (ymd->cache != ERRWEFT && ymd->cache_offset == offset)
+    return weft_retain(ymd->cache);
+
+  /* Start from the last checkpoint, or from the cache if that's closer. */
+  JLL(pvalue, ymd->full, base_offset);
+  assert(pvalue != NULL);     /* The first entry in a yarn is always full */
+  base = (weft_t)*pvalue;
+  if (base_offset == offset) return weft_retain(base);
+  if (ymd->cache != ERRWEFT && ymd->cache_offset > base_offset &&
+      ymd->cache_offset < offset) {
+    base_offset = ymd->cache_offset; base = ymd->cache;
+  }
+
+  weft = copy_weft(base);
+  if (weft == ERRWEFT) return ERRWEFT;
+  index = base_offset;
+  JLN(pvalue, ymd->deltas, index);
+  while (pvalue != NULL && index <= offset) {
+    if (weft_merge_into(&weft, (weft_t)*pvalue) != 0) {
+      delete_weft(weft);
+      return ERRWEFT;
+    }
+    JLN(pvalue, ymd->deltas, index);
+  }
+
+  weft = weft_intern(weft);
+  if (weft == ERRWEFT) return ERRWEFT;
+  drop_cache(ymd);
+  ymd->cache = weft_retain(weft); ymd->cache_offset = offset;
+  return weft;
+}
+
+/* Print a memoization dict, for debugging purposes. Checkpoints are marked
+   with a star. */
+void memodict_print(memodict_t memodict) {
+  Word_t index_outer = 0; Word_t *pvalue_outer;
+  JLF(pvalue_outer, memodict, index_outer);
+  while (pvalue_outer != NULL) {
+    yarn_md_t *ymd = (yarn_md_t *)*pvalue_outer;
+    Word_t offset = -1; int is_full;
+    /* Walk backward from the end of the yarn; it's only for debugging. */
+    while (last_entry(ymd, &offset, &is_full)) {
+      weft_t weft = reconstruct(ymd, offset);
+      printf("/-----------------------------\\\n");
+      printf("  ID: %u, %u%s\n", (uint32_t)index_outer, (uint32_t)offset,
+             is_full ? " *" : "");
+      weft_print(weft);
+      printf("\\-----------------------------/\n\n");
+      weft_release(weft);
+      if (offset == 0) break;
+      offset--;
+    }
+    JLN(pvalue_outer, memodict, index_outer);
+  }
+}
+
+/* Remove the entry at a given offset from whichever array it's in, releasing
+   its weft. Does nothing if there is no such entry. */
+static void remove_entry(yarn_md_t *ymd, Word_t offset) {
+  Word_t *pvalue; int rc_int;
+  JLG(pvalue, ymd->full, offset);
+  if (pvalue != NULL) {
+    weft_release((weft_t)*pvalue);
+    JLD(rc_int, ymd->full, offset);
+  }
+  JLG(pvalue, ymd->deltas, offset);
+  if (pvalue != NULL) {
+    weft_release((weft_t)*pvalue);
+    JLD(rc_int, ymd->deltas, offset);
+  }
+}
+
+/* Store a weft as a checkpoint at a given offset, taking over the reference
+   to it. Returns 0 on success, -1 on malloc() failure. */
+static int put_full(yarn_md_t *ymd, Word_t offset, weft_t weft) {
+  Word_t *pvalue;
+  remove_entry(ymd, offset);
+  JLI(pvalue, ymd->full, offset);
+  if (pvalue == PJERR) { weft_release(weft); return -1; }
+  *pvalue = (Word_t)weft;
+  return 0;
+}
+
+/* Add an (id, weft) pair to a memoization dict. You must give a pointer to the
+   memoization dict to be modified. The weft must be interned, and the dict
+   takes over the caller's reference to it. If there is already a weft mapped
+   to the given id, then that previous weft will be released and replaced by
+   the new one. */
+int memodict_add(memodict_t *memodict, uint64_t id, weft_t weft) {
+  Word_t yarn = YARN(id), offset = OFFSET(id), prev_offset, next_offset;
+  Word_t *pvalue, *pfull; int is_full;
+  memodict_t temp = *memodict;
+  yarn_md_t *ymd;
+  weft_t prev, delta;
+
+  JLI(pvalue, temp, yarn);
+  if (pvalue == PJERR) goto fail; /* malloc() error */
+  if (*pvalue == 0) {
+    ymd = malloc(sizeof(yarn_md_t));
+    if (ymd == NULL) { int rc_int; JLD(rc_int, temp, yarn); goto fail; }
+    ymd->full = (Pvoid_t)NULL; ymd->deltas = (Pvoid_t)NULL;
+    ymd->since_full = 0; ymd->cache = ERRWEFT;
+    *pvalue = (Word_t)ymd;
+  }
+  ymd = (yarn_md_t *)*pvalue;
+  *memodict = temp;
+
+  /* Re-adding an entry with the weft it already has changes nothing, so
+     don't let it turn this entry or the next one into checkpoints. Wefts are
+     interned, so equal ones are the same pointer. */
+  JLG(pfull, ymd->full, offset);
+  JLG(pvalue, ymd->deltas, offset);
+  if (pfull != NULL || pvalue != NULL) {
+    weft_t old = reconstruct(ymd, offset);
+    if (old == ERRWEFT) goto fail;
+    int same = old == weft;
+    weft_release(old);
+    if (same) { weft_release(weft); return 0; }
+  }
+
+  /* Is there anything after this entry? */
+  next_offset = -1;
+  if (last_entry(ymd, &next_offset, &is_full) && next_offset >= offset) {
+    /* Not an append. The next entry's delta may have been against something
+       else, so make it a checkpoint, and store this one as a checkpoint. */
+    Word_t next_full = offset;
+    drop_cache(ymd);
+    next_offset = offset;
+    JLN(pvalue, ymd->deltas, next_offset);
+    JLN(pfull, ymd->full, next_full);
+    if (pvalue != NULL && (pfull == NULL || next_offset < next_full)) {
+      weft_t next = reconstruct(ymd, next_offset);
+      drop_cache(ymd);
+      if (next == ERRWEFT || put_full(ymd, next_offset, next) != 0) goto fail;
+    }
+    return put_full(ymd, offset, weft);
+  }
+
+  /* Appending. Store a delta if we can. */
+  prev_offset = offset - 1;
+  if (offset == 0 || !last_entry(ymd, &prev_offset, &is_full) ||
+      ymd->since_full >= MEMODICT_CHECKPOINT_INTERVAL) {
+    ymd->since_full = 0;
+    if (put_full(ymd, offset, weft) != 0) return -1;
+  } else {
+    prev = reconstruct(ymd, prev_offset);
+    if (prev == ERRWEFT) goto fail;
+    if (!weft_leq(prev, weft)) {
+      weft_release(prev);
+      ymd->since_full = 0;
+      if (put_full(ymd, offset, weft) != 0) return -1;
+    } else {
+      delta = weft_intern(weft_diff(weft, prev));
+      weft_release(prev);
+      if (delta == ERRWEFT) goto fail;
+      JLI(pvalue, ymd->deltas, offset);
+      if (pvalue == PJERR) { weft_release(delta); goto fail; }
+      *pvalue = (Word_t)delta;
+      ymd->since_full++;
+    }
+  }
+
+  /* Appends usually get looked up next, so keep the weft around. */
+  drop_cache(ymd);
+  ymd->cache = weft; ymd->cache_offset = offset;
+  if (ymd->since_full == 0) weft_retain(weft); /* The checkpoint has one too */
+  return 0;
+
+ fail:
+  weft_release(weft);
+  return -1;
+}
+
+/* Look up an id in a memoization dict. Returns either an empty weft, or the
+   weft in the given yarn with the highest offset less than or equal to the
+   given offset. Returns a new reference to the weft, which the caller must
+   weft_release(), or ERRWEFT on malloc() failure. */
+weft_t memodict_get(memodict_t memodict, uint64_t id) {
+  Word_t yarn = YARN(id), offset = OFFSET(id); Word_t *pvalue;
+  int is_full;
+
+  JLG(pvalue, memodict, yarn);
+  if (pvalue == NULL || pvalue == PJERR) return new_weft();
+  yarn_md_t *ymd = (yarn_md_t *)*pvalue;
+  if (!last_entry(ymd, &offset, &is_full)) return new_weft();
+  return reconstruct(ymd, offset);
+}
+
+/* Find the first id at or after *id that has an entry of its own in a
+   memoization dict, checkpoint or delta, and put it in *id. Returns 1 if
+   there is one, 0 if not. */
+int memodict_next(memodict_t memodict, uint64_t *id) {
+  Word_t yarn = YARN(*id), offset; Word_t *pvalue;
+
+  JLF(pvalue, memodict, yarn);
+  offset = yarn == YARN(*id) ? OFFSET(*id) : 0;
+  while (pvalue != NULL) {
+    yarn_md_t *ymd = (yarn_md_t *)*pvalue;
+    Word_t full_index = offset, delta_index = offset;
+    Word_t *pfull, *pdelta;
+    JLF(pfull, ymd->full, full_index);
+    JLF(pdelta, ymd->deltas, delta_index);
+    if (pfull != NULL || pdelta != NULL) {
+      if (pfull == NULL || (pdelta != NULL && delta_index < full_index))
+        full_index = delta_index;
+      *id = PACK_ID(yarn, full_index);
+      return 1;
+    }
+    offset = 0;
+    JLN(pvalue, memodict, yarn);
+  }
+  return 0;
+}
@@ -0,0 +1,185 @@
+/* Memodictbench: reads in a data file of patches in the same format as
+   snarfstrip, and times the memoization dict on them. The memodict is
+   whichever one libsburb was built with, so to compare two of them, build and
+   run this once for each:
+
+     scons memodict=judy && ./memodictbench trace.txt
+     scons memodict=array && ./memodictbench trace.txt
+
+   Three things are timed. Memoizing is what applying the patches does to the
+   memodict: memoize_patch() on each of them in turn, into an empty memodict.
+   The lookups are memodict_get() on every atom id, once in the order the
+   patches created them and once in weave order, which is how pulls tend to
+   walk through a yarn and how they jump between yarns. Pulls are pull() on
+   every atom and its predecessor, in patch order. Each of these is repeated
+   until it has gone over at least MIN_BENCH_OPS atoms, so that small traces
+   still take long enough to time. */
+
+#include "sburb.h"
+#include "benchmark.h"
+
+#define MIN_BENCH_OPS (1 << 24)
+
+/* Read a patch from a file. Returns NULL at end of file. */
+static patch_t read_patch(FILE *file) {
+  unsigned int chain_count;
+  unsigned int chain_lengths[4096];
+  if (fscanf(file, "%u", &chain_count) != 1) return NULL;
+
+  /* Read chain lengths, calculate atom count */
+  uint32_t atom_count = 0;
+  for (int i = 0; i < chain_count; i++) {
+    int numsread = fscanf(file, "%u", &chain_lengths[i]);
+    assert(numsread == 1);
+    atom_count += chain_lengths[i];
+  }
+
+  /* Allocate everything and write header. */
+  void *patch, *patch_cursor;
+  uint32_t patch_len = patch_necessary_buffer_length(chain_count, atom_count);
+  patch = malloc(patch_len); patch_cursor = patch;
+  if (patch == NULL) return NULL;
+  write_patch_header(&patch_cursor, patch_len, chain_count);
+
+  /* Write the chain descriptors. */
+  uint32_t offset = 0;
+  for (int i = 0; i < chain_count; i++) {
+    write_chain_descriptor(&patch_cursor, offset, chain_lengths[i]);
+    offset += chain_size_bytes(chain_lengths[i]);
+  }
+
+  /* Write the atoms themselves. */
+  uint32_t *p32 = patch_cursor;
+  for (int i = 0; i < atom_count; i++) {
+    uint32_t c, py, po, iy, io;
+    int numsread = fscanf(file, "%u %u %u %u %u", &c, &py, &po, &iy, &io);
+    assert(numsread == 5);
+    WRITE_ATOM_SEQ(PACK_ID(iy, io), PACK_ID(py, po), c, p32);
+  }
+  return patch;
+}
+
+/* Look up every id in a list, and return how many of them had a non-empty
+   weft, so that the lookups can't be optimized away. */
+static uint32_t get_all(memodict_t memodict, uint64_t *ids, uint32_t n) {
+  uint32_t found = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    weft_t weft = memodict_get(memodict, ids[i]);
+    assert(weft != ERRWEFT);
+    found += weft != NULL;
+    weft_release(weft);
+  }
+  return found;
+}
+
+/* Print how long an operation took on average, and how many were done per
+   second. */
+static void report(const char *name, uint64_t ops, int us) {
+  double seconds = (us == 0 ? 1 : us) / 1e6;
+  printf("%-22s %8.1f ns/op %8.2f Mops/s\n", name,
+         seconds * 1e9 / ops, ops / seconds / 1e6);
+}
+
+int main(int argc, char **argv) {
+  weave_t weave = new_weave(128);
+
+  /* Check for right number of args */
+  if (argc != 2) {
+    printf("usage: %s file\n", argv[0]);
+    exit(1);
+  }
+
+  /* Open the input file, and read in all the patches. */
+  FILE *file = fopen(argv[1], "r");
+  if (file == NULL) {
+    printf("%s: could not open file %s\n", argv[0], argv[1]);
+    exit(1);
+  }
+  uint32_t patch_count = 0, patch_capacity = 1024;
+  patch_t *patches = malloc(patch_capacity * sizeof(patch_t));
+  patch_t patch;
+  assert(patches != NULL);
+  while ((patch = read_patch(file)) != NULL) {
+    if (patch_count == patch_capacity) {
+      patch_capacity *= 2;
+      patches = realloc(patches, patch_capacity * sizeof(patch_t));
+      assert(patches != NULL);
+    }
+    patches[patch_count++] = patch;
+  }
+  fclose(file);
+
+  /* Apply them, and list every atom's id and predecessor in patch order. */
+  uint32_t atom_count = 0;
+  for (uint32_t i = 0; i < patch_count; i++) {
+    LIFTERR(apply_patch(&weave, patches[i]));
+    atom_count += patch_length_atoms(patches[i]);
+  }
+  uint64_t *ids = malloc(atom_count * sizeof(uint64_t));
+  uint64_t *preds = malloc(atom_count * sizeof(uint64_t));
+  if (ids == NULL || preds == NULL) {
+    printf("%s: out of memory\n", argv[0]);
+    exit(1);
+  }
+  uint32_t deletions = 0;
+  for (uint32_t i = 0, n = 0; i < patch_count; i++) {
+    uint32_t *p32 = patch_atoms(patches[i]); uint32_t c;
+    for (uint32_t j = patch_length_atoms(patches[i]); j > 0; j--, n++) {
+      READ_ATOM_SEQ(ids[n], preds[n], c, p32);
+      deletions += c == ATOM_CHAR_DEL;
+    }
+  }
+  int reps = MIN_BENCH_OPS / (atom_count == 0 ? 1 : atom_count) + 1;
+  printf("%u patches, %u atoms (%u deletions), %d reps\n", patch_count,
+         atom_count, deletions, reps);
+
+  /* Memoize. */
+  BENCHMARK_INIT();
+  for (int r = 0; r < reps; r++) {
+    memodict_t memodict = new_memodict();
+    TICK();
+    for (uint32_t i = 0; i < patch_count; i++)
+      LIFTERR(memoize_patch(&memodict, patches[i]));
+    TOCK();
+    delete_memodict(memodict);
+  }
+  report("memoize", (uint64_t)atom_count * reps, benchmark_total_time);
+
+  /* Look up. */
+  uint32_t patch_found = 0, weave_found = 0;
+  BENCHMARK_INIT();
+  for (int r = 0; r < reps; r++) {
+    TICK(); patch_found = get_all(weave.memodict, ids, atom_count); TOCK();
+  }
+  report("get (patch order)", (uint64_t)atom_count * reps,
+         benchmark_total_time);
+  BENCHMARK_INIT();
+  for (int r = 0; r < reps; r++) {
+    TICK();
+    weave_found = get_all(weave.memodict, weave.ids, weave.length);
+    TOCK();
+  }
+  report("get (weave order)", (uint64_t)weave.length * reps,
+         benchmark_total_time);
+
+  /* Pull. */
+  BENCHMARK_INIT();
+  for (int r = 0; r < reps; r++) {
+    TICK();
+    for (uint32_t i = 0; i < atom_count; i++) {
+      weft_t weft = pull(weave.memodict, ids[i], preds[i]);
+      assert(weft != ERRWEFT);
+      weft_release(weft);
+    }
+    TOCK();
+  }
+  report("pull", (uint64_t)atom_count * reps, benchmark_total_time);
+  printf("%u of %u ids and %u of %u weave atoms had a memoized weft\n",
+         patch_found, atom_count, weave_found, weave.length);
+
+  /* Clean up and exit. */
+  for (uint32_t i = 0; i < patch_count; i++) free(patches[i]);
+  free(patches); free(ids); free(preds);
+  delete_weave(weave);
+  return 0;
+}
@@ -117,7 +117,7 @@ void print_patch(patch_t patch) {
   uint32_t *p32 = patch; void *ptr = patch;
   uint32_t length_bytes; uint8_t chain_count;
   READ_PATCH_HEADER(length_bytes, chain_count, ptr); p32 = ptr;
-  uint16_t *chain_lengths = malloc(chain_count * sizeof(uint16_t));
+  uint16_t chain_lengths[255];
   printf("== Patch with %u atoms in %u chains, taking %u bytes.\n",
          patch_length_atoms(patch), chain_count, length_bytes);
 
@@ -141,7 +141,6 @@ void print_patch(patch_t patch) {
     }
   }
   printf("END OF PATCH\n\n");
-  free(chain_lengths);
 }
 
 /* Return an id on which a patch is blocking, or 0 if the patch is ready to be
@@ -156,7 +155,7 @@ uint64_t patch_blocking_id(patch_t patch, weft_t weft) {
   uint32_t *p32 = patch; void *ptr = patch;
   uint32_t length_bytes; uint8_t chain_count;
   READ_PATCH_HEADER(length_bytes, chain_count, ptr); p32 = ptr;
-  uint16_t *chain_lengths = malloc(chain_count * sizeof(uint16_t));
+  uint16_t chain_lengths[255];
 
   /* Read chain lengths */
   for (uint32_t chain = 0; chain < chain_count; chain++) {
@@ -169,7 +168,6 @@ uint64_t patch_blocking_id(patch_t patch, weft_t weft) {
   READ_ATOM_SEQ(id, pred, c, p32); p32 -= 5; /* peek */
   if (weft_get(weft, YARN(id)) + 1 != OFFSET(id)) {
     //printf("XX  First atom is not directly above weft\n");
-    free(chain_lengths);
     if (weft_covers(weft, id)) return 1;
     else return PACK_ID(YARN(id), OFFSET(id) - 1);
   }
@@ -181,7 +179,6 @@ uint64_t patch_blocking_id(patch_t patch, weft_t weft) {
     int inschain = ATOM_CHAR_IS_VISIBLE(c); /* is this an insertion chain? */
     if (inschain && !weft_covers(weft, pred)) {
       //printf("XX  Insertion chain %u blocking on pred\n", chain);
-      free(chain_lengths);
       return pred;
     }
 
@@ -190,20 +187,17 @@ uint64_t patch_blocking_id(patch_t patch, weft_t weft) {
       /* Check predecessors of non-insertion atoms */
       if (!inschain && !weft_covers(weft, pred)) {
         //printf("XX  Non-insertion chain %u blocking on pred\n", chain);
-        free(chain_lengths);
         return pred;
       }
 
       /* Check to make sure atoms are above weft */
       if (weft_covers(weft, id)) {
         //printf("XX  Atom (%u,%u) not above weft\n", YARN(id), OFFSET(id));
-        free(chain_lengths);
         return 1;
       }
     }
   }
 
-  free(chain_lengths);
   return 0;
 }
 
@@ -213,6 +207,108 @@ uint64_t patch_highest_id(patch_t patch) {
   uint32_t *atom_ptr = patch_atoms(patch); atom_ptr += len_atoms*5 - 5;
   return *(uint64_t*)atom_ptr;
 }
+
+/* Check that a patch from an untrusted source is well-formed, before it goes
+   anywhere near a weave. len is the number of bytes that were actually
+   received. This makes one pass over the patch, and doesn't allocate anything.
+   Returns 0 if the patch is valid, and fills in *info, or -1 if it isn't, in
+   which case *info may have been partly written.
+
+   The rules are:
+
+   - The length in the header must be len, and must match the chain
+     descriptors, which must describe non-empty chains, back to back. This is
+     all checked before any atoms are read.
+   - Every atom must be in one yarn (not yarn 0, the start and end atoms'), with
+     offsets going up by one from the first atom's.
+   - A chain's type is the type of its head atom, and every atom in it must be
+     of that type. Start and end atoms aren't allowed.
+   - An insertion chain's atoms must each have the atom before as their
+     predecessor, except for the head, whose predecessor must be outside the
+     patch, and mustn't be the end atom. Their chars must be Unicode scalar
+     values.
+   - A deletor's predecessor must be outside the patch, and not the start or
+     end atom.
+   - There may be at most one save-awareness chain, and its predecessors must be
+     in other yarns, other than yarn 0.
+
+   info->blocking_id is what patch_blocking_id() would return for the patch
+   and weft, so that doesn't need to be called separately. */
+int patch_validate(patch_t patch, uint32_t len, weft_t weft,
+                   patch_info_t *info) {
+  uint8_t *ptr = patch;
+  uint32_t offset, atom_count = 0; uint16_t len_atoms;
+  uint8_t chain_count;
+
+  /* Check the length against the chain descriptors. */
+  if (len < 5 || patch_length_bytes(patch) != len) return -1;
+  chain_count = patch_chain_count(patch);
+  if (chain_count == 0 || len < 5 + 6 * (uint32_t)chain_count) return -1;
+  ptr += 5;
+  for (uint32_t chain = 0; chain < chain_count; chain++) {
+    READ_CHAIN_DESCRIPTOR(offset, len_atoms, ptr);
+    if (len_atoms == 0 || offset != chain_size_bytes(atom_count)) return -1;
+    atom_count += len_atoms;
+  }
+  if (len != patch_necessary_buffer_length(chain_count, atom_count)) return -1;
+
+  /* Get the id range from the first atom. */
+  uint32_t *p32 = (uint32_t *)ptr;
+  uint64_t id = *(uint64_t *)p32, pred, blocking_id = 0; uint32_t c;
+  uint32_t yarn = YARN(id), low = OFFSET(id), next = low;
+  if (yarn == 0 || low == 0 || low - 1 > UINT32_MAX - atom_count) return -1;
+  if (weft_get(weft, yarn) + 1 != low)
+    blocking_id = weft_covers(weft, id) ? 1 : PACK_ID(yarn, low - 1);
+
+  /* Check each chain's atoms. */
+  int saves = 0;
+  ptr = (uint8_t *)patch + 5;
+  for (uint32_t chain = 0; chain < chain_count; chain++) {
+    int type = PATCH_CHAIN_INSERT;
+    READ_CHAIN_DESCRIPTOR(offset, len_atoms, ptr);
+    for (uint16_t i = 0; i < len_atoms; i++, next++) {
+      READ_ATOM_SEQ(id, pred, c, p32);
+      if (id != PACK_ID(yarn, next) || OFFSET(pred) == 0) return -1;
+      if (i == 0) {
+        if (c == ATOM_CHAR_DEL) type = PATCH_CHAIN_DELETE;
+        else if (c == ATOM_CHAR_SAVE) type = PATCH_CHAIN_SAVE;
+        else if (ATOM_CHAR_IS_VISIBLE(c)) type = PATCH_CHAIN_INSERT;
+        else return -1;
+        if (type == PATCH_CHAIN_SAVE && saves++ > 0) return -1;
+        info->chain_types[chain] = type;
+      }
+
+      switch (type) {
+      case PATCH_CHAIN_INSERT:
+        if (!ATOM_CHAR_IS_VISIBLE(c) || !ATOM_CHAR_IS_UNICODE(c)) return -1;
+        if (i > 0) {
+          if (pred != PACK_ID(yarn, next - 1)) return -1;
+          continue;
+        }
+        if (YARN(pred) == 0 && OFFSET(pred) != 1) return -1;
+        break;
+      case PATCH_CHAIN_DELETE:
+        if (c != ATOM_CHAR_DEL || YARN(pred) == 0) return -1;
+        break;
+      case PATCH_CHAIN_SAVE:
+        if (c != ATOM_CHAR_SAVE || YARN(pred) == 0 || YARN(pred) == yarn)
+          return -1;
+        break;
+      }
+
+      /* Predecessors outside the patch are in another yarn, or below it. */
+      if (YARN(pred) == yarn && OFFSET(pred) >= low) return -1;
+      if (blocking_id == 0 && !weft_covers(weft, pred)) blocking_id = pred;
+    }
+  }
+
+  info->first_id = PACK_ID(yarn, low);
+  info->last_id = PACK_ID(yarn, next - 1);
+  info->atom_count = atom_count;
+  info->chain_count = chain_count;
+  info->blocking_id = blocking_id;
+  return 0;
+}
   
 
 /******************************** Testing code ********************************/
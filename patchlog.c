@@ -0,0 +1,363 @@
+/* Patch logs: durable storage for a vector weave, as a snapshot of it plus an
+   append-only log of the patches applied since.
+
+   A log lives at a path, and its snapshot next to it, at the same path with
+   ".snap" on the end. Every patch goes in the log before it's applied. The
+   log starts with a header, and each patch is a record:
+
+   <payload length><CRC-32 of payload><payload>
+
+   where the lengths and CRC are uint32_t, and the payload is the patch in the
+   raw wire format (see wire.c), which holds any valid patch exactly. Records
+   in other wire formats are read too. Appends are buffered, and written and
+   fsync()ed as a group, so that a burst of patches costs one fsync() rather
+   than one each; a patch is only durable once its group has been synced.
+
+   Every so often, the weave is checkpointed: saved as a snapshot, after which
+   the log is emptied. Opening a log recovers the weave by loading the
+   snapshot and replaying the log through apply_patch(), so it takes time
+   proportional to what's happened since the last checkpoint, not to the whole
+   history of the weave. A crash can leave a record at the end of the log half
+   written, or garbled; it's detected by its length or its CRC, and that record
+   and everything after it are dropped. Patches are validated before they're
+   logged, so a record that's intact but won't decode or validate didn't come
+   from a crash; it's skipped and counted, and replay goes on. A patch that
+   fails to apply makes the open fail, rather than be left out of the next
+   checkpoint for good.
+
+   A checkpoint's snapshot is renamed into place, and its directory synced,
+   before the log is emptied, so a crash can't keep the empty log and lose
+   the new snapshot.
+
+   Replaying a patch that's already in the weave does nothing, so there's no
+   need to keep the snapshot and the log exactly in step. If a crash comes
+   between saving a snapshot and emptying the log, the log's patches are just
+   applied again, and ignored. */
+
+#include "sburb.h"
+
+#define PATCHLOG_MAGIC      "SBRBPLOG"
+#define PATCHLOG_VERSION    1
+#define PATCHLOG_BYTE_ORDER 0x01020304
+
+/* Defaults for the limits; see patchlog_set_limits(). */
+#ifndef PATCHLOG_GROUP_PATCHES
+#define PATCHLOG_GROUP_PATCHES 64
+#endif
+#ifndef PATCHLOG_GROUP_BYTES
+#define PATCHLOG_GROUP_BYTES (64 * 1024)
+#endif
+#ifndef PATCHLOG_CHECKPOINT_PATCHES
+#define PATCHLOG_CHECKPOINT_PATCHES 10000
+#endif
+
+typedef struct {
+  char magic[8];                /* PATCHLOG_MAGIC, without the null */
+  uint32_t version;             /* PATCHLOG_VERSION */
+  uint32_t byte_order;          /* PATCHLOG_BYTE_ORDER, as the writer saw it */
+} patchlog_header_t;
+
+struct patchlog {
+  int fd;                       /* The log file, positioned at its end */
+  char *snapshot_path;
+  uint8_t *buf;                 /* Records not written yet */
+  uint32_t buf_length, buf_capacity;
+  uint32_t group_patches;       /* Patches in the buffer */
+  uint32_t tail_patches;        /* Patches in the log, buffer included */
+  uint32_t skipped_patches;     /* Records that failed on replay */
+  uint32_t max_group_patches;   /* Sync once the buffer has this many patches */
+  uint32_t max_group_bytes;     /* or this many bytes; 0 for no limit */
+  uint32_t checkpoint_patches;  /* Checkpoint once the log has this many */
+};
+
+/* The CRC-32 used by zlib, Ethernet and friends. */
+static uint32_t record_crc(const uint8_t *bytes, uint32_t n) {
+  static uint32_t table[256];
+  uint32_t crc = 0xFFFFFFFF;
+
+  if (table[1] == 0) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+  for (uint32_t i = 0; i < n; i++)
+    crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFF;
+}
+
+/* Write all of a buffer to a file descriptor. Returns 0 on success, -1 on
+   error. */
+static int write_all(int fd, const void *bytes, size_t n) {
+  const uint8_t *p = bytes;
+  while (n > 0) {
+    ssize_t written = write(fd, p, n);
+    if (written < 0) return -1;
+    p += written; n -= written;
+  }
+  return 0;
+}
+
+/* Sync the directory a file is in, so that a rename into it is durable.
+   Returns 0 on success, -1 on error. */
+static int sync_parent_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char dir[slash == NULL ? 2 : slash - path + 2];
+  int fd, rc;
+
+  if (slash == NULL) strcpy(dir, ".");
+  else if (slash == path) strcpy(dir, "/");
+  else { memcpy(dir, path, slash - path); dir[slash - path] = '\0'; }
+  if ((fd = open(dir, O_RDONLY)) < 0) return -1;
+  rc = fsync(fd);
+  close(fd);
+  return rc;
+}
+
+/* Read the log, replaying every good record into a weave, and put the length
+   of the good part of the log in *end. An empty file gets a header. Returns 0
+   on success, -1 if the file isn't a patch log, or on error. */
+static int replay_log(patchlog_t log, weave_t *weave, off_t *end) {
+  patchlog_header_t header;
+  struct stat st;
+  uint8_t *map, *p, *stop;
+
+  if (fstat(log->fd, &st) != 0) return -1;
+  if (st.st_size == 0) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PATCHLOG_MAGIC, sizeof(header.magic));
+    header.version = PATCHLOG_VERSION;
+    header.byte_order = PATCHLOG_BYTE_ORDER;
+    *end = sizeof(header);
+    return write_all(log->fd, &header, sizeof(header));
+  }
+  if (st.st_size < (off_t)sizeof(header)) return -1;
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, log->fd, 0);
+  if (map == MAP_FAILED) return -1;
+  memcpy(&header, map, sizeof(header));
+  if (memcmp(header.magic, PATCHLOG_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != PATCHLOG_VERSION ||
+      header.byte_order != PATCHLOG_BYTE_ORDER) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  /* Replay records until one is cut short, or doesn't match its CRC. That's
+     where a crash stopped us. */
+  p = map + sizeof(header); stop = map + st.st_size;
+  while (stop - p >= 8) {
+    uint32_t length, crc;
+    patch_info_t info;
+    memcpy(&length, p, 4); memcpy(&crc, p + 4, 4);
+    if (length == 0 || length > (uint64_t)(stop - p - 8) ||
+        record_crc(p + 8, length) != crc)
+      break;
+    patch_t patch = patch_from_wire(p + 8, length);
+    if (patch == NULL ||
+        patch_validate(patch, patch_length_bytes(patch), weave->weft,
+                       &info) != 0) {
+      log->skipped_patches++;
+    } else if (apply_patch(weave, patch) != 0) {
+      free(patch);
+      munmap(map, st.st_size);
+      return -1;
+    }
+    free(patch);
+    p += 8 + length;
+    log->tail_patches++;
+  }
+  *end = p - map;
+  munmap(map, st.st_size);
+  return 0;
+}
+
+/* Open the patch log at path, creating it if it isn't there, and recover its
+   weave into *weave: load the snapshot if there is one, or start with a new
+   weave if not, and then replay the log. A torn record at the end of the log
+   is dropped, and the log truncated to just before it. Records that don't
+   decode or validate are skipped; see patchlog_skipped_patches(). Returns the
+   log, which must be closed with patchlog_close(), or NULL if the log or the
+   snapshot can't be read, if a patch in the log fails to apply, or on malloc()
+   failure. */
+patchlog_t patchlog_open(const char *path, weave_t *weave) {
+  patchlog_t log = calloc(1, sizeof(struct patchlog));
+  off_t end;
+
+  if (log == NULL) return NULL;
+  log->max_group_patches = PATCHLOG_GROUP_PATCHES;
+  log->max_group_bytes = PATCHLOG_GROUP_BYTES;
+  log->checkpoint_patches = PATCHLOG_CHECKPOINT_PATCHES;
+  if ((log->snapshot_path = malloc(strlen(path) + 6)) == NULL) {
+    free(log);
+    return NULL;
+  }
+  sprintf(log->snapshot_path, "%s.snap", path);
+  if ((log->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) goto fail_free;
+
+  if (access(log->snapshot_path, F_OK) == 0) {
+    if (weave_load_snapshot(weave, log->snapshot_path) != 0) goto fail_close;
+  } else {
+    *weave = new_weave(0);
+  }
+  if (replay_log(log, weave, &end) != 0 ||
+      ftruncate(log->fd, end) != 0 || lseek(log->fd, end, SEEK_SET) != end ||
+      fsync(log->fd) != 0) {
+    delete_weave(*weave);
+    goto fail_close;
+  }
+  return log;
+
+ fail_close:
+  close(log->fd);
+ fail_free:
+  free(log->snapshot_path); free(log);
+  return NULL;
+}
+
+/* Set a patch log's limits: how many patches, and how many bytes of them, are
+   buffered before they're written and synced as a group, and how many patches
+   the log can have before patchlog_apply() checkpoints the weave. A limit of 0
+   means no limit. With a group of 1 patch, every patch is synced as it's
+   appended. */
+void patchlog_set_limits(patchlog_t log, uint32_t group_patches,
+                         uint32_t group_bytes, uint32_t checkpoint_patches) {
+  log->max_group_patches = group_patches;
+  log->max_group_bytes = group_bytes;
+  log->checkpoint_patches = checkpoint_patches;
+}
+
+/* Write out a patch log's buffered records, and fsync() the log. Returns 0 on
+   success, -1 on error, in which case the records stay buffered. */
+int patchlog_sync(patchlog_t log) {
+  if (log->buf_length == 0) return 0;
+  off_t start = lseek(log->fd, 0, SEEK_CUR);
+  if (start < 0) return -1;
+  if (write_all(log->fd, log->buf, log->buf_length) != 0 ||
+      fdatasync(log->fd) != 0) {
+    /* Don't leave part of the group behind for the next attempt to write
+       after. */
+    if (ftruncate(log->fd, start) == 0) lseek(log->fd, start, SEEK_SET);
+    return -1;
+  }
+  log->buf_length = 0; log->group_patches = 0;
+  return 0;
+}
+
+/* Append a patch to a patch log, as a buffered record, and sync the group if
+   that fills it up. Returns 0 on success, -1 on malloc() failure or if the
+   sync fails. */
+static int append_record(patchlog_t log, patch_t patch) {
+  uint32_t bound = 8 + patch_wire_bound(patch, PATCH_WIRE_RAW);
+
+  if (log->buf_length + bound > log->buf_capacity) {
+    uint32_t capacity = log->buf_capacity == 0 ? 4096 : log->buf_capacity;
+    while (capacity < log->buf_length + bound) capacity *= 2;
+    uint8_t *buf = realloc(log->buf, capacity);
+    if (buf == NULL) return -1;
+    log->buf = buf; log->buf_capacity = capacity;
+  }
+  uint8_t *record = log->buf + log->buf_length;
+  uint32_t length = patch_to_wire(patch, PATCH_WIRE_RAW, record + 8);
+  uint32_t crc = record_crc(record + 8, length);
+  memcpy(record, &length, 4); memcpy(record + 4, &crc, 4);
+  log->buf_length += 8 + length;
+  log->group_patches++; log->tail_patches++;
+
+  if ((log->max_group_patches > 0 &&
+       log->group_patches >= log->max_group_patches) ||
+      (log->max_group_bytes > 0 && log->buf_length >= log->max_group_bytes))
+    return patchlog_sync(log);
+  return 0;
+}
+
+/* Save a weave as its log's snapshot, and empty the log. The weave must be
+   the one the log was opened with, with every patch in the log applied to it.
+   Returns 0 on success, -1 on error. If the snapshot was saved but the log
+   couldn't be emptied, the log's patches will be replayed over the new
+   snapshot on recovery, which does no harm. */
+int patchlog_checkpoint(patchlog_t log, weave_t *weave) {
+  patchlog_header_t header;
+
+  if (patchlog_sync(log) != 0 ||
+      weave_save_snapshot(weave, log->snapshot_path) != 0 ||
+      sync_parent_dir(log->snapshot_path) != 0)
+    return -1;
+  if (ftruncate(log->fd, sizeof(header)) != 0 ||
+      lseek(log->fd, sizeof(header), SEEK_SET) != sizeof(header) ||
+      fdatasync(log->fd) != 0)
+    return -1;
+  log->tail_patches = 0;
+  return 0;
+}
+
+/* Log a patch and apply it to a weave, which must be the one the log was
+   opened with. The patch is validated first, and an invalid one is neither
+   logged nor applied. It's written ahead of being applied, so that if it's
+   in the weave after a crash, it's in the log too, as long as its group was
+   synced. If the log has grown to its checkpoint limit, the weave is
+   checkpointed. Returns 0 on success, -1 if the patch is invalid, or on
+   error. */
+int patchlog_apply(patchlog_t log, weave_t *weave, patch_t patch) {
+  patch_info_t info;
+  if (patch_validate(patch, patch_length_bytes(patch), weave->weft,
+                     &info) != 0)
+    return -1;
+  if (append_record(log, patch) != 0) return -1;
+  if (apply_patch(weave, patch) != 0) return -1;
+  if (log->checkpoint_patches > 0 &&
+      log->tail_patches >= log->checkpoint_patches)
+    return patchlog_checkpoint(log, weave);
+  return 0;
+}
+
+/* How many patches are in a log since its last checkpoint, including ones that
+   haven't been synced yet. This is how many recovery would replay. */
+uint32_t patchlog_tail_patches(patchlog_t log) {
+  return log->tail_patches;
+}
+
+/* How many records in a log were skipped when it was opened, because they
+   couldn't be decoded or validated. */
+uint32_t patchlog_skipped_patches(patchlog_t log) {
+  return log->skipped_patches;
+}
+
+/* Sync and close a patch log, and free its memory. The weave is left alone.
+   Returns 0 on success, or -1 if the last group couldn't be synced, in which
+   case its patches are lost. */
+int patchlog_close(patchlog_t log) {
+  int rc = patchlog_sync(log);
+  if (close(log->fd) != 0) rc = -1;
+  free(log->buf); free(log->snapshot_path); free(log);
+  return rc;
+}
+
+
+/********************************** Testing ***********************************/
+
+// int main(void) {
+//   weave_t weave;
+//   patch_t patch1 = make_patch1(), patch2 = make_patch2();
+//   remove("/tmp/sburb-log"); remove("/tmp/sburb-log.snap");
+//
+//   patchlog_t log = patchlog_open("/tmp/sburb-log", &weave);
+//   assert(log != NULL && weave.length == 2);
+//   LIFTERR(patchlog_apply(log, &weave, patch1));
+//   LIFTERR(patchlog_checkpoint(log, &weave));
+//   LIFTERR(patchlog_apply(log, &weave, patch2));
+//   assert(patchlog_tail_patches(log) == 1);
+//   LIFTERR(patchlog_close(log));
+//   uint32_t length = weave.length;
+//   delete_weave(weave);
+//
+//   log = patchlog_open("/tmp/sburb-log", &weave);
+//   assert(log != NULL && weave.length == length);
+//   assert(patchlog_tail_patches(log) == 1);
+//   weave_print(weave);
+//   LIFTERR(patchlog_close(log));
+//   delete_weave(weave);
+//   free(patch1); free(patch2);
+//   return 0;
+// }
@@ -0,0 +1,95 @@
+/* Position indices: for every atom in a vector weave, where in the weave it
+   is. With one of these, apply_patch() can go straight to the atoms that a
+   patch is anchored on instead of scanning the whole weave for them.
+
+   The offsets in a yarn are dense, starting at 1, so a position index is a
+   JudyL array mapping yarns to plain arrays of positions, indexed by
+   offset. Unknown atoms have position POSINDEX_NONE. Setting positions tends
+   to go through one yarn for a while, so the array for the last yarn used is
+   cached. */
+
+#include "sburb.h"
+
+struct posindex {
+  Pvoid_t yarns;                /* yarn -> yarn_positions_t* */
+  uint32_t last_yarn;           /* Yarn of the cached array */
+  struct yarn_positions *last;  /* Cached array, or NULL */
+};
+
+typedef struct yarn_positions {
+  uint32_t capacity;            /* Number of offsets there's room for */
+  uint32_t positions[];
+} yarn_positions_t;
+
+/* Allocate and return a new, empty position index. Returns NULL on malloc()
+   failure. */
+posindex_t new_posindex(void) {
+  posindex_t posindex = malloc(sizeof(struct posindex));
+  if (posindex == NULL) return NULL;
+  posindex->yarns = (Pvoid_t)NULL; posindex->last = NULL;
+  return posindex;
+}
+
+/* Delete a position index, and free its memory. Does nothing if given NULL. */
+void delete_posindex(posindex_t posindex) {
+  Word_t index = 0; Word_t *pvalue; Word_t rc_word;
+  if (posindex == NULL) return;
+  JLF(pvalue, posindex->yarns, index);
+  while (pvalue != NULL) {
+    free((void *)*pvalue);
+    JLN(pvalue, posindex->yarns, index);
+  }
+  JLFA(rc_word, posindex->yarns);
+  free(posindex);
+}
+
+/* Record the position of an atom. Returns 0 on success, or -1 on malloc()
+   failure, or if the atom's offset is too big for the index to hold. */
+int posindex_set(posindex_t posindex, uint64_t id, uint32_t pos) {
+  uint32_t yarn = YARN(id), offset = OFFSET(id);
+  yarn_positions_t *yp = posindex->last;
+  Word_t *pvalue = NULL;
+
+  if (yp == NULL || posindex->last_yarn != yarn) {
+    JLI(pvalue, posindex->yarns, (Word_t)yarn);
+    if (pvalue == PJERR) return -1; /* malloc() error */
+    yp = (yarn_positions_t *)*pvalue;
+  }
+
+  /* Grow the array to fit, doubling it, as far as a uint32_t capacity goes.
+     That leaves out only the very last offset. */
+  if (yp == NULL || offset >= yp->capacity) {
+    uint32_t old_capacity = yp == NULL ? 0 : yp->capacity;
+    uint64_t capacity = old_capacity == 0 ? 16 : old_capacity;
+    while (capacity <= offset) capacity *= 2;
+    if (capacity > UINT32_MAX) capacity = UINT32_MAX;
+    if (offset >= capacity ||
+        capacity > (SIZE_MAX - sizeof(yarn_positions_t)) / sizeof(uint32_t))
+      return -1;
+    if (pvalue == NULL) JLG(pvalue, posindex->yarns, (Word_t)yarn);
+    yp = realloc(yp, sizeof(yarn_positions_t) + capacity * sizeof(uint32_t));
+    if (yp == NULL) return -1;
+    for (uint64_t i = old_capacity; i < capacity; i++)
+      yp->positions[i] = POSINDEX_NONE;
+    yp->capacity = capacity;
+    *pvalue = (Word_t)yp;
+  }
+
+  yp->positions[offset] = pos;
+  posindex->last_yarn = yarn; posindex->last = yp;
+  return 0;
+}
+
+/* Look up the position of an atom. Returns POSINDEX_NONE if it's unknown. */
+uint32_t posindex_get(posindex_t posindex, uint64_t id) {
+  uint32_t yarn = YARN(id), offset = OFFSET(id);
+  yarn_positions_t *yp = posindex->last;
+  Word_t *pvalue;
+
+  if (yp == NULL || posindex->last_yarn != yarn) {
+    JLG(pvalue, posindex->yarns, (Word_t)yarn);
+    if (pvalue == NULL) return POSINDEX_NONE;
+    yp = (yarn_positions_t *)*pvalue;
+  }
+  return offset < yp->capacity ? yp->positions[offset] : POSINDEX_NONE;
+}
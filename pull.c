@@ -0,0 +1,47 @@
+/* Pulling awareness wefts out of a memoization dict. This only goes through
+   memodict_get(), so it works with every memodict representation. */
+
+#include "sburb.h"
+
+/* Pull the awareness weft of a given atom id, assuming a properly filled-out
+   memoization dict. This returns a reference to an interned weft, which must
+   be explicitly released by the caller with weft_release(). Optionally takes a
+   predecessor id; if 0 is passed in place of the predecessor id, then it will
+   be ignored.
+
+   Usually the weft stored for the id already covers the id and everything the
+   predecessor knows about, in which case we just hand out another reference to
+   it. Otherwise, we build the new weft in a private copy and intern that.
+
+   In the event of an error, returns ERRWEFT. */
+weft_t pull(memodict_t memodict, uint64_t id, uint64_t pred) {
+  weft_t base = memodict_get(memodict, id);
+  weft_t pred_weft = pred != 0 ? memodict_get(memodict, pred) : new_weft();
+  weft_t weft;
+
+  /* Fast path: nothing to add. Yarn 0 is skipped because weft_covers()
+     pretends every weft has it. */
+  if (YARN(id) != 0 && weft_covers(base, id) &&
+      (pred == 0 || (YARN(pred) != 0 && weft_covers(base, pred) &&
+                     weft_leq(pred_weft, base)))) {
+    weft_release(pred_weft);
+    return base;
+  }
+
+  weft = copy_weft(base);
+  if (weft == ERRWEFT) goto fail;
+  if (weft_extend(&weft, YARN(id), OFFSET(id)) != 0) goto fail;
+
+  if (pred != 0) {
+    if (weft_merge_into(&weft, pred_weft) != 0) goto fail;
+    if (weft_extend(&weft, YARN(pred), OFFSET(pred)) != 0) goto fail;
+  }
+
+  weft_release(base); weft_release(pred_weft);
+  return weft_intern(weft);
+
+ fail:
+  if (weft != ERRWEFT) delete_weft(weft);
+  weft_release(base); weft_release(pred_weft);
+  return ERRWEFT;
+}
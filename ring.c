@@ -0,0 +1,108 @@
+/* Rings: lock-free ring buffers of pointers, for passing things from one
+   thread to exactly one other.
+
+   The producer only ever writes the tail, and the consumer only ever writes
+   the head, so neither needs a lock or an atomic read-modify-write; each
+   just publishes its own index with a release store after touching the slot,
+   and reads the other's with an acquire load. The indices count up forever
+   and are masked to get slots, so a full ring and an empty one are told
+   apart by tail - head. They're kept on separate cache lines, so the two
+   threads don't fight over one. */
+
+#include "sburb.h"
+
+/* How long to spin before yielding, and to yield before sleeping, when
+   waiting on a ring. */
+#ifndef RING_SPINS
+#define RING_SPINS 64
+#endif
+#ifndef RING_YIELDS
+#define RING_YIELDS 64
+#endif
+#define RING_SLEEP_NS 50000
+
+struct ring {
+  uint32_t mask;                /* Capacity - 1; capacity is a power of two */
+  void **slots;
+  uint64_t head __attribute__((aligned(64))); /* Next slot to pop */
+  uint64_t tail __attribute__((aligned(64))); /* Next slot to push */
+};
+
+/* Make a new, empty ring with room for at least capacity pointers. Returns
+   NULL on malloc() failure. */
+ring_t new_ring(uint32_t capacity) {
+  ring_t ring;
+  uint32_t size = 2;
+
+  while (size < capacity) size *= 2;
+  if (posix_memalign((void **)&ring, 64, sizeof(struct ring)) != 0)
+    return NULL;
+  if ((ring->slots = malloc(size * sizeof(void *))) == NULL) {
+    free(ring);
+    return NULL;
+  }
+  ring->mask = size - 1;
+  ring->head = ring->tail = 0;
+  return ring;
+}
+
+/* Delete a ring. Whatever is still in it isn't freed. */
+void delete_ring(ring_t ring) {
+  if (ring == NULL) return;
+  free(ring->slots);
+  free(ring);
+}
+
+/* Push a pointer onto a ring. Producer only. Returns 0 on success, or -1 if
+   the ring is full. */
+int ring_push(ring_t ring, void *item) {
+  uint64_t tail = ring->tail;
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask)
+    return -1;
+  ring->slots[tail & ring->mask] = item;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Pop a pointer off a ring. Consumer only. Returns NULL if the ring is
+   empty, so don't push NULLs. */
+void *ring_pop(ring_t ring) {
+  uint64_t head = ring->head;
+  if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) return NULL;
+  void *item = ring->slots[head & ring->mask];
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+/* Is a ring full? Producer only; the answer can only go from yes to no
+   behind its back. */
+int ring_full(ring_t ring) {
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  return ring->tail - head > ring->mask;
+}
+
+/* Wait a little longer for the other end of a ring: spin at first, then
+   yield, then sleep, so that an idle pipeline doesn't eat whole cores. */
+static void ring_backoff(uint32_t *waits) {
+  if (*waits >= RING_SPINS + RING_YIELDS) {
+    struct timespec ts = { 0, RING_SLEEP_NS };
+    nanosleep(&ts, NULL);
+  } else if (*waits >= RING_SPINS) {
+    sched_yield();
+  }
+  (*waits)++;
+}
+
+/* Push a pointer onto a ring, waiting for room if it's full. */
+void ring_push_wait(ring_t ring, void *item) {
+  uint32_t waits = 0;
+  while (ring_push(ring, item) != 0) ring_backoff(&waits);
+}
+
+/* Pop a pointer off a ring, waiting for one if it's empty. */
+void *ring_pop_wait(ring_t ring) {
+  uint32_t waits = 0;
+  void *item;
+  while ((item = ring_pop(ring)) == NULL) ring_backoff(&waits);
+  return item;
+}
@@ -8,6 +8,13 @@
 #include <wchar.h>
 #include <assert.h>
 #include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
 #include <Judy.h>
 
 /***************************** General utilities ******************************/
@@ -37,21 +44,24 @@
 #define OFFSET(id) ((uint32_t)((id) & (uint64_t)0xFFFFFFFF))
 #define PACK_ID(yarn, offset) (((uint64_t)(yarn) << 32) | (uint64_t)(offset))
 
+/* Atoms in weaves are stored in three parallel arrays, one each for ids, preds
+   and chars, so that each is naturally aligned and a pass that only needs one
+   of them doesn't drag the others through the cache. */
+
 /* Read an atom from a location. Location pointers are incremented. Pass in only
    variable names. */
-#define READ_ATOM(id, pred, c, id_ptr, body_ptr) do {  \
-    id = *id_ptr++;                                    \
-    pred = *((uint64_t *)body_ptr);                    \
-    body_ptr += 2;                                     \
-    c = *body_ptr++;                                   \
+#define READ_ATOM(id, pred, c, id_ptr, pred_ptr, char_ptr) do { \
+    id = *id_ptr++;                                           \
+    pred = *pred_ptr++;                                       \
+    c = *char_ptr++;                                          \
   } while (0);
 
 /* Write an atom to a location. Location pointers are incremented. Pass in only
    variable names. */
-#define WRITE_ATOM(id, pred, c, id_ptr, body_ptr) do { \
-    *id_ptr++ = id;                                    \
-    *(uint64_t *)body_ptr = pred; body_ptr += 2;       \
-    *body_ptr++ = c;                                   \
+#define WRITE_ATOM(id, pred, c, id_ptr, pred_ptr, char_ptr) do { \
+    *id_ptr++ = id;                                            \
+    *pred_ptr++ = pred;                                        \
+    *char_ptr++ = c;                                           \
   } while (0);
 
 /* Read an atom from a location, sequentially. Location pointer (uint32_t *) is
@@ -72,18 +82,18 @@
 
 /* Read an atom from a location, plus an atom offset. Pass in only variable
    names. Pointers are not modified. */
-#define READ_ATOM_IDX(id, pred, c, id_ptr, body_ptr, i) do {  \
-    id = *(id_ptr + (i));                                     \
-    pred = *(uint64_t*)(body_ptr + 3*(i));                    \
-    c = *(body_ptr + 3*(i) + 2);                              \
+#define READ_ATOM_IDX(id, pred, c, id_ptr, pred_ptr, char_ptr, i) do { \
+    id = *(id_ptr + (i));                                            \
+    pred = *(pred_ptr + (i));                                        \
+    c = *(char_ptr + (i));                                           \
   } while (0);
 
 /* Write an atom to a location, plus an atom offset. Pass in only variable
    names. Pointers are not modified. */
-#define WRITE_ATOM_IDX(id, pred, c, id_ptr, body_ptr, i) do { \
-    *(id_ptr + (i)) = id;                                     \
-    *(uint64_t*)(body_ptr + 3*(i)) = pred;                    \
-    *(body_ptr + 3*(i) + 2) = c;                              \
+#define WRITE_ATOM_IDX(id, pred, c, id_ptr, pred_ptr, char_ptr, i) do { \
+    *(id_ptr + (i)) = id;                                             \
+    *(pred_ptr + (i)) = pred;                                         \
+    *(char_ptr + (i)) = c;                                            \
   } while (0);
 
 /* The four special atom characters. These are the only invisible chars. */
@@ -95,13 +105,19 @@
 /* Is an atom character c visible? May evaluate c twice. */
 #define ATOM_CHAR_IS_VISIBLE(c) ((c) < 0xE000 || (c) > 0xE003)
 
+/* Is c a Unicode scalar value: no higher than 0x10FFFF, and not a surrogate?
+   Only those can be inserted. May evaluate c twice. */
+#define ATOM_CHAR_IS_UNICODE(c) \
+  ((c) <= 0x10FFFF && ((c) < 0xD800 || (c) > 0xDFFF))
+
 
 /******************************* Data typedefs ********************************/
 
 /* A weft_t is a pointer to the weft structure itself. */
 typedef Pvoid_t weft_t;
 
-/* A memodict is a JudyL array of JudyL arrays of wefts. */
+/* A memodict is a JudyL array keyed by yarn. What it maps to depends on the
+   representation: see memodict.c, memodict_delta.c and memodict_array.c. */
 typedef Pvoid_t memodict_t;
 
 /* A vector is represented as an array of machine words, with the first one
@@ -114,11 +130,38 @@ typedef Word_t* vector_t;
 /* A patch, or rather, a pointer to a patch data structure. */
 typedef void* patch_t;
 
-/* A waiting set is a two-nested-judyl arrangement. */
-//typedef Pvoid_t waiting_set_t;
+/* Waiting set: patches that aren't ready yet, by the id they're blocking on.
+   NULL means an empty one, with no limits. */
+typedef struct waitset *waitset_t;
+
+/* A position index, for finding atoms in a vector weave. NULL means there
+   isn't one. */
+typedef struct posindex *posindex_t;
+
+/* A view of the visible text of a vector weave. NULL means there isn't one. */
+typedef struct textview *textview_t;
+
+/* A snapshot file mapped into memory, which a vector weave's arrays point
+   into. NULL means the weave has its own arrays. */
+typedef struct snapshot *snapshot_t;
+
+/* An open patch log, for keeping a vector weave on disk. */
+typedef struct patchlog *patchlog_t;
+
+/* A published, immutable version of a vector weave, and the place versions
+   are published to. See version.c. */
+typedef struct version *version_t;
+typedef struct versions *versions_t;
 
-/* Waiting set: a sparse array */
-typedef Pvoid_t waitset_t;
+/* A document manager: many vector weaves, applied to by a thread pool. */
+typedef struct docmgr *docmgr_t;
+
+/* A single-producer, single-consumer ring buffer of pointers. See ring.c. */
+typedef struct ring *ring_t;
+
+/* A pipeline of threads taking patches off the wire and into a vector
+   weave. See ingest.c. */
+typedef struct ingest *ingest_t;
 
 /*********************************** Wefts ************************************/
 
@@ -138,6 +181,19 @@ int weft_extend(weft_t *weft, uint32_t yarn, uint32_t offset);
 int weft_covers(weft_t weft, uint64_t id);
 int weft_merge_into(weft_t *dest, weft_t other);
 int weft_gt(weft_t a, weft_t b);
+Word_t weft_hash(weft_t weft);
+int weft_equal(weft_t a, weft_t b);
+int weft_leq(weft_t a, weft_t b);
+weft_t weft_diff(weft_t a, weft_t b);
+int weft_next(weft_t weft, uint32_t *yarn, uint32_t *offset);
+
+
+/******************************* Interned wefts *******************************/
+
+weft_t weft_intern(weft_t weft);
+weft_t weft_retain(weft_t weft);
+void weft_release(weft_t weft);
+void weft_pool_stats(Word_t *wefts, Word_t *refs);
 
 
 /************************ Id-to-weft memoization dicts ************************/
@@ -150,12 +206,67 @@ void delete_memodict(memodict_t memodict);
 void memodict_print(memodict_t memodict);
 int memodict_add(memodict_t *memodict, uint64_t id, weft_t weft);
 weft_t memodict_get(memodict_t memodict, uint64_t id);
+int memodict_next(memodict_t memodict, uint64_t *id);
+
+/* pull.c */
 weft_t pull(memodict_t memodict, uint64_t id, uint64_t pred);
 
 
+/************************** Predecessor lookup dicts **************************/
+
+/* A deldict maps ids to deletor atoms, and an insdict maps ids to insrecs. Both
+   are JudyL arrays of JudyL arrays, like memodicts. See indeldict.c. */
+typedef Pvoid_t deldict_t;
+typedef Pvoid_t insdict_t;
+typedef struct {
+  void *chain;
+  uint16_t len_atoms;
+} insrec_t;
+
+int indeldict_insert(Pvoid_t *dict, uint64_t id, void *thing);
+void *indeldict_get(Pvoid_t dict, uint64_t id);
+void delete_insdict(insdict_t insdict);
+void delete_deldict(deldict_t deldict);
+int memoize_patch(memodict_t *memodict, patch_t patch);
+int make_indeldict(patch_t patch, insdict_t *insdict, deldict_t *deldict,
+                   memodict_t *memodict);
+
+
+/****************************** Position indices ******************************/
+
+/* Position of an atom that isn't in the index. */
+#define POSINDEX_NONE ((uint32_t)-1)
+
+posindex_t new_posindex(void);
+void delete_posindex(posindex_t posindex);
+int posindex_set(posindex_t posindex, uint64_t id, uint32_t pos);
+uint32_t posindex_get(posindex_t posindex, uint64_t id);
+
+
+/********************************* Text views *********************************/
+
+/* A change to the text in a text view: at visible position pos, deleted chars
+   were removed, and then the inserted chars in text were put in their place. */
+typedef struct {
+  uint32_t pos;
+  uint32_t deleted;
+  uint32_t inserted;
+  const uint32_t *text;
+} textevent_t;
+
+textview_t new_textview(void);
+void delete_textview(textview_t view);
+const uint32_t *textview_text(textview_t view, uint32_t *length);
+const textevent_t *textview_events(textview_t view, uint32_t *count);
+void textview_clear_events(textview_t view);
+uint32_t *textview_splice(textview_t view, uint32_t pos, uint32_t deleted,
+                          uint32_t inserted);
+
+
 /*********************************** Weaves ***********************************/
 
 #include "vector_weave.h"
+#include "chunked_weave.h"
 
 
 /************************** Waiting sets and vectors **************************/
@@ -168,25 +279,27 @@ weft_t pull(memodict_t memodict, uint64_t id, uint64_t pred);
 vector_t new_vector(void);
 vector_t vector_append(vector_t vector, Word_t word);
 
-/* waiting_set_t new_waiting_set(void); */
-/* void delete_waiting_set(waiting_set_t wset, int delete_patches); */
-/* vector_t take_waiting_set(waiting_set_t *wset, uint64_t id); */
-/* int add_to_waiting_set(waiting_set_t *wset, uint64_t blocking_id, patch_t patch); */
-/* int waiting_set_empty(waiting_set_t wset); */
-/* void print_waiting_set(waiting_set_t wset); */
-
-/* /\* Safer deletor macro. Sets pointer to NULL afterward. *\/ */
-/* #define DELETE_WAITING_SET(wset, delete_patches) do {                     \ */
-/*     delete_waiting_set(wset, delete_patches); wset = (waiting_set_t)NULL; \ */
-/*   } while (0); */
+/* Counts of what's in a waiting set. */
+typedef struct {
+  uint32_t patches;             /* Patches in memory */
+  uint64_t bytes;               /* Bytes of patches in memory */
+  uint32_t spilled_patches;     /* Patches in the spill file */
+  uint64_t spilled_bytes;       /* Bytes of patches in the spill file */
+} waitset_stats_t;
 
 waitset_t new_waitset(void);
-void delete_waitset(waitset_t waitset, int delete_patches);
-int add_to_waitset(waitset_t *wset, patch_t patch);
+void delete_waitset(waitset_t wset);
+int waitset_set_limits(waitset_t *wset, uint32_t max_patches,
+                       uint64_t max_bytes, const char *spill_path);
+void waitset_stats(waitset_t wset, waitset_stats_t *stats);
+int waitset_park(waitset_t *wset, uint64_t blocking_id, patch_t patch);
+int add_to_waitset(waitset_t *wset, uint64_t blocking_id, patch_t patch);
 int waitset_empty(waitset_t wset);
-int remove_from_waitset(waitset_t *wset, int i);
+vector_t waitset_take_covered(waitset_t *wset, weft_t weft);
+int waitset_foreach(waitset_t wset,
+                    int (*fn)(uint64_t blocking_id, patch_t patch, void *arg),
+                    void *arg);
 void print_waitset(waitset_t wset);
-patch_t waitset_pop(waitset_t *wset);
 
 /********************************** Patches ***********************************/
 
@@ -201,6 +314,20 @@ patch_t waitset_pop(waitset_t *wset);
     len_atoms = *(uint16_t *)ptr; ptr = (typeof (ptr))((uint16_t *)ptr + 1); \
   } while (0);
 
+/* Chain types. */
+#define PATCH_CHAIN_INSERT 0
+#define PATCH_CHAIN_DELETE 1
+#define PATCH_CHAIN_SAVE   2
+
+/* What patch_validate() finds out about a valid patch. */
+typedef struct {
+  uint64_t first_id, last_id;   /* Range of atom ids in the patch */
+  uint64_t blocking_id;         /* As returned by patch_blocking_id() */
+  uint32_t atom_count;
+  uint8_t chain_count;
+  uint8_t chain_types[255];     /* PATCH_CHAIN_* for each chain */
+} patch_info_t;
+
 uint32_t patch_length_bytes(patch_t patch);
 uint8_t patch_chain_count(patch_t patch);
 uint32_t patch_length_atoms(patch_t patch);
@@ -214,6 +341,127 @@ void write_chain(void **dest, void *src, uint32_t atom_count);
 void print_patch(patch_t patch);
 uint64_t patch_blocking_id(patch_t patch, weft_t weft);
 uint64_t patch_highest_id(patch_t patch);
+int patch_validate(patch_t patch, uint32_t len, weft_t weft,
+                   patch_info_t *info);
+
+
+/******************************** Local edits *********************************/
+
+#define EDIT_INSERT 0
+#define EDIT_DELETE 1
+
+/* The most edits build_patch() will take at once. */
+#define BUILD_PATCH_MAX_EDITS 1024
+
+/* An edit to the visible text of a weave: insert len bytes of UTF-8 text at
+   visible position pos, or delete len chars starting there. */
+typedef struct {
+  int type;                     /* EDIT_INSERT or EDIT_DELETE */
+  uint32_t pos;
+  uint32_t len;
+  const char *text;             /* Only for insertions */
+} edit_t;
+
+patch_t build_patch(weave_t *weave, uint32_t yarn, const edit_t *edits,
+                    int edit_count);
+
+
+/******************************** Wire formats ********************************/
+
+/* Tags for the first byte of a patch on the wire. */
+#define PATCH_WIRE_RAW     0    /* The patch as it is in memory */
+#define PATCH_WIRE_COMPACT 1    /* Varints, elided ids and preds, UTF-8 chars */
+
+uint32_t patch_wire_bound(patch_t patch, int format);
+uint32_t patch_to_wire(patch_t patch, int format, uint8_t *buf);
+patch_t patch_from_wire(const uint8_t *buf, uint32_t len);
+
+
+/********************************* Snapshots **********************************/
+
+int weave_save_snapshot(weave_t *weave, const char *path);
+int weave_load_snapshot(weave_t *weave, const char *path);
+int weave_thaw(weave_t *weave);
+void delete_snapshot(snapshot_t snapshot);
+
+
+/********************************* Patch logs *********************************/
+
+patchlog_t patchlog_open(const char *path, weave_t *weave);
+void patchlog_set_limits(patchlog_t log, uint32_t group_patches,
+                         uint32_t group_bytes, uint32_t checkpoint_patches);
+int patchlog_apply(patchlog_t log, weave_t *weave, patch_t patch);
+int patchlog_sync(patchlog_t log);
+int patchlog_checkpoint(patchlog_t log, weave_t *weave);
+uint32_t patchlog_tail_patches(patchlog_t log);
+uint32_t patchlog_skipped_patches(patchlog_t log);
+int patchlog_close(patchlog_t log);
+
+
+/***************************** Published versions *****************************/
+
+versions_t new_versions(void);
+void delete_versions(versions_t versions);
+int weave_publish(versions_t versions, weave_t *weave);
+int versions_reclaim(versions_t versions);
+version_t version_acquire(versions_t versions);
+void version_release(version_t version);
+const weave_t *version_weave(version_t version);
+uint64_t version_number(version_t version);
+int weave_unshare(weave_t *weave);
+
+
+/***************************** Document managers ******************************/
+
+/* What a document manager knows about one of its documents. Times are in
+   nanoseconds. Latency is from a patch's submission until it's applied. */
+typedef struct {
+  uint32_t queued;              /* Patches waiting to be applied */
+  uint64_t applied;             /* Patches applied, or left waiting */
+  uint64_t failed;              /* Patches dropped for failing to apply */
+  uint64_t batches;             /* Times the queue was applied */
+  uint64_t apply_ns;            /* Total time spent applying */
+  uint64_t max_apply_ns;        /* Longest time one batch took */
+  uint64_t latency_ns;          /* Total latency of all applied patches */
+  uint64_t max_latency_ns;      /* Longest latency of one patch */
+} docstats_t;
+
+docmgr_t new_docmgr(int thread_count);
+void delete_docmgr(docmgr_t mgr);
+int docmgr_add(docmgr_t mgr, uint64_t id, weave_t *weave);
+int docmgr_submit(docmgr_t mgr, uint64_t id, patch_t patch);
+void docmgr_wait(docmgr_t mgr);
+version_t docmgr_acquire(docmgr_t mgr, uint64_t id);
+int docmgr_stats(docmgr_t mgr, uint64_t id, docstats_t *stats);
+
+
+/************************************ Rings ***********************************/
+
+ring_t new_ring(uint32_t capacity);
+void delete_ring(ring_t ring);
+int ring_push(ring_t ring, void *item);
+void *ring_pop(ring_t ring);
+int ring_full(ring_t ring);
+void ring_push_wait(ring_t ring, void *item);
+void *ring_pop_wait(ring_t ring);
+
+
+/****************************** Ingest pipelines ******************************/
+
+/* What an ingest pipeline did with the patches pushed into it. */
+typedef struct {
+  uint64_t received;            /* Patches pushed */
+  uint64_t invalid;             /* Dropped for failing to decode or validate */
+  uint64_t duplicates;          /* Dropped for being in the weave already */
+  uint64_t early_blocked;       /* Blocked when checked; applied or waiting */
+  uint64_t applied;             /* Applied, or left waiting */
+  uint64_t failed;              /* Dropped for failing to apply */
+  uint64_t batches;             /* Batches taken by the apply stage */
+} ingest_stats_t;
+
+ingest_t new_ingest(weave_t *weave);
+int ingest_push(ingest_t ingest, uint8_t *buf, uint32_t len);
+void ingest_finish(ingest_t ingest, ingest_stats_t *stats);
 
 
 /**************************** Debugging functions *****************************/
@@ -2,35 +2,36 @@
 
 /***************************** Atom serialization *****************************/
 
-/* Atoms are stored in two parallel arrays. The id array stores the ids, and the
-   body array stores (pred, char) pairs. Ids are (yarn, weft) pairs, and
-   chars are 32-bit unsigned ints. Hooray for UTF-32, I guess. */
+/* Atoms are stored in three parallel arrays, of ids, preds and chars. Ids are
+   (yarn, weft) pairs, and chars are 32-bit unsigned ints. Hooray for UTF-32, I
+   guess. */
 
 void test_par(void) {
-  uint64_t id_a[64];
-  uint32_t body_a[64*3];
+  uint64_t id_a[64], pred_a[64];
+  uint32_t char_a[64];
 
-  uint64_t id; uint64_t pred; uint32_t c; uint64_t *id_ptr; uint32_t *body_ptr;
-  id_ptr = id_a; body_ptr = body_a;
+  uint64_t id; uint64_t pred; uint32_t c;
+  uint64_t *id_ptr, *pred_ptr; uint32_t *char_ptr;
+  id_ptr = id_a; pred_ptr = pred_a; char_ptr = char_a;
   id = PACK_ID(4, 44);
   pred = PACK_ID(666, 6543210);
   c = 'Q';
 
   printf("id:(%u, %u) pred:(%u, %u) '%c'\n", YARN(id), OFFSET(id), YARN(pred), OFFSET(pred), c);
-  WRITE_ATOM(id, pred, c, id_ptr, body_ptr);
+  WRITE_ATOM(id, pred, c, id_ptr, pred_ptr, char_ptr);
 
   id = PACK_ID(0, 42);
   pred = PACK_ID(77, 108);
   c = 'Z';
 
   printf("id:(%u, %u) pred:(%u, %u) '%c'\n", YARN(id), OFFSET(id), YARN(pred), OFFSET(pred), c);
-  WRITE_ATOM(id, pred, c, id_ptr, body_ptr);
+  WRITE_ATOM(id, pred, c, id_ptr, pred_ptr, char_ptr);
 
-  id = 0; pred = 0; c = '%'; id_ptr = id_a; body_ptr = body_a;
+  id = 0; pred = 0; c = '%'; id_ptr = id_a; pred_ptr = pred_a; char_ptr = char_a;
 
-  READ_ATOM(id, pred, c, id_ptr, body_ptr);
+  READ_ATOM(id, pred, c, id_ptr, pred_ptr, char_ptr);
   printf("id:(%u, %u) pred:(%u, %u) '%c'\n", YARN(id), OFFSET(id), YARN(pred), OFFSET(pred), c);
-  READ_ATOM(id, pred, c, id_ptr, body_ptr);
+  READ_ATOM(id, pred, c, id_ptr, pred_ptr, char_ptr);
   printf("id:(%u, %u) pred:(%u, %u) '%c'\n", YARN(id), OFFSET(id), YARN(pred), OFFSET(pred), c);
 }
 
@@ -0,0 +1,477 @@
+/* Snapshots: a vector weave saved to a file, to be loaded again later without
+   replaying all the patches that built it.
+
+   A snapshot is laid out so that loading one is mostly a matter of mmap()ing
+   it. The atom arrays, the visibility bitmap and its Fenwick tree are stored
+   just as they are in memory, each starting on a page boundary, and a loaded
+   weave points straight into the mapping. Nothing in them is parsed, or even
+   read, until it's needed. The weft is small, so it's rebuilt right away.
+
+   The memodict and the waiting set aren't needed until the weave changes, so
+   they stay in the mapping until then. weave_thaw(), which everything that
+   changes a weave calls first, copies the arrays into memory of the weave's
+   own, rebuilds the memodict and the waiting set, and unmaps the snapshot. A
+   weave that's only ever read never pays for any of that. Position indices and
+   text views aren't saved; turn them on again after loading.
+
+   After a header, the sections are:
+
+   - ids, preds, chars: the atom arrays, with length entries each.
+   - visible, viscounts: the visibility bitmap and its Fenwick tree, for a
+     capacity of exactly length atoms.
+   - weft: (yarn, offset) pairs of uint32_t.
+   - wefts: every distinct weft in the memodict, each a uint32_t count of yarns
+     followed by that many (yarn, offset) pairs.
+   - memodict: (id, weft) pairs of uint64_t, in id order, where weft is the
+     byte offset of the id's weft in the wefts section.
+   - waitset: for each waiting patch, its blocking id as a uint64_t, and then
+     the patch itself, padded to a multiple of 8 bytes.
+
+   Everything is in the byte order of the machine that wrote it. The header
+   says which that was, and snapshots in the other byte order, or of another
+   version, aren't loaded. */
+
+#include "sburb.h"
+
+#define SNAPSHOT_MAGIC      "SBRBSNAP"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+#define SNAPSHOT_PAGE       4096 /* Alignment of the mappable sections */
+
+enum {
+  SECTION_IDS, SECTION_PREDS, SECTION_CHARS, SECTION_VISIBLE,
+  SECTION_VISCOUNTS, SECTION_WEFT, SECTION_WEFTS, SECTION_MEMODICT,
+  SECTION_WAITSET, SECTION_COUNT
+};
+
+typedef struct {
+  char magic[8];                /* SNAPSHOT_MAGIC, without the null */
+  uint32_t version;             /* SNAPSHOT_VERSION */
+  uint32_t byte_order;          /* SNAPSHOT_BYTE_ORDER, as the writer saw it */
+  uint64_t file_length;         /* Length of the whole file, in bytes */
+  uint32_t length;              /* Number of atoms in the weave */
+  uint32_t reserved;
+  struct {
+    uint64_t offset;            /* From the start of the file */
+    uint64_t size;              /* In bytes */
+  } sections[SECTION_COUNT];
+} snapshot_header_t;
+
+struct snapshot {
+  uint8_t *map;                 /* The whole file, starting with its header */
+  size_t size;
+};
+
+/* Get a pointer to a section of a mapped snapshot. */
+#define SECTION(map, s) \
+  ((map) + ((snapshot_header_t *)(map))->sections[s].offset)
+#define SECTION_SIZE(map, s) (((snapshot_header_t *)(map))->sections[s].size)
+
+
+
+/********************************** Writing ***********************************/
+
+/* A snapshot file being written, and how far into it we are. */
+typedef struct {
+  FILE *file;
+  uint64_t pos;
+} writer_t;
+
+/* Write some bytes. Returns 0 on success, -1 on error. */
+static int put_bytes(writer_t *w, const void *bytes, size_t n) {
+  if (n > 0 && fwrite(bytes, 1, n, w->file) != n) return -1;
+  w->pos += n;
+  return 0;
+}
+
+/* Write zeros up to a multiple of align bytes. Returns 0 on success, -1 on
+   error. */
+static int pad_to(writer_t *w, uint64_t align) {
+  static const uint8_t zeros[SNAPSHOT_PAGE];
+  return put_bytes(w, zeros, (align - w->pos % align) % align);
+}
+
+/* Start a section at the next multiple of align bytes. */
+static int begin_section(writer_t *w, snapshot_header_t *header, int s,
+                         uint64_t align) {
+  if (pad_to(w, align) != 0) return -1;
+  header->sections[s].offset = w->pos;
+  return 0;
+}
+
+/* Finish the section that was last begun. */
+static void end_section(writer_t *w, snapshot_header_t *header, int s) {
+  header->sections[s].size = w->pos - header->sections[s].offset;
+}
+
+/* Write a weft as (yarn, offset) pairs, preceded by how many there are if
+   counted is true. */
+static int put_weft(writer_t *w, weft_t weft, int counted) {
+  uint32_t yarn, offset, count = 0;
+  if (counted) {
+    for (yarn = 0; weft_next(weft, &yarn, &offset); yarn++) count++;
+    if (put_bytes(w, &count, sizeof(uint32_t)) != 0) return -1;
+  }
+  for (yarn = 0; weft_next(weft, &yarn, &offset); yarn++) {
+    uint32_t pair[2] = { yarn, offset };
+    if (put_bytes(w, pair, sizeof(pair)) != 0) return -1;
+  }
+  return 0;
+}
+
+/* Write the wefts and memodict sections. Every distinct weft is written once,
+   and entries refer to it by where it is in the wefts section. The wefts are
+   interned, so they're told apart by pointer; the references to them are held
+   until the end, so that none of them can be freed and its address reused
+   along the way. */
+static int put_memodict(writer_t *w, snapshot_header_t *header,
+                        memodict_t memodict) {
+  Pvoid_t written = (Pvoid_t)NULL; /* weft -> offset in wefts section */
+  Word_t *pvalue, index; Word_t rc_word;
+  uint64_t id;
+  int rc = begin_section(w, header, SECTION_WEFTS, 8);
+
+  for (id = 0; rc == 0 && memodict_next(memodict, &id); id++) {
+    weft_t weft = memodict_get(memodict, id);
+    if (weft == ERRWEFT) { rc = -1; break; }
+    JLI(pvalue, written, (Word_t)weft);
+    if (pvalue == PJERR) { weft_release(weft); rc = -1; break; }
+    if (*pvalue != 0) { weft_release(weft); continue; }
+    /* Offsets are stored plus one, so that zero means not written yet. */
+    *pvalue = w->pos - header->sections[SECTION_WEFTS].offset + 1;
+    rc = put_weft(w, weft, TRUE);
+  }
+  end_section(w, header, SECTION_WEFTS);
+
+  if (rc == 0) rc = begin_section(w, header, SECTION_MEMODICT, 8);
+  for (id = 0; rc == 0 && memodict_next(memodict, &id); id++) {
+    weft_t weft = memodict_get(memodict, id);
+    JLG(pvalue, written, (Word_t)weft);
+    weft_release(weft);
+    if (pvalue == NULL) { rc = -1; break; }
+    uint64_t entry[2] = { id, *pvalue - 1 };
+    rc = put_bytes(w, entry, sizeof(entry));
+  }
+  end_section(w, header, SECTION_MEMODICT);
+
+  index = 0; JLF(pvalue, written, index);
+  while (pvalue != NULL) {
+    weft_release((weft_t)index);
+    JLN(pvalue, written, index);
+  }
+  JLFA(rc_word, written);
+  return rc;
+}
+
+/* Write a waiting patch; called by waitset_foreach(). */
+static int put_waiting(uint64_t blocking_id, patch_t patch, void *arg) {
+  writer_t *w = arg;
+  if (put_bytes(w, &blocking_id, sizeof(uint64_t)) != 0 ||
+      put_bytes(w, patch, patch_length_bytes(patch)) != 0)
+    return -1;
+  return pad_to(w, 8);
+}
+
+/* Save a snapshot of a vector weave to a file, replacing whatever was there.
+   The snapshot is written to path with ".tmp" on the end, flushed to disk,
+   and then renamed to path, so a crash partway through leaves either the old
+   file or the new one. Returns 0 on success, -1 on error, with errno set by
+   whatever failed. */
+int weave_save_snapshot(weave_t *weave, const char *path) {
+  char tmp_path[strlen(path) + 5];
+  snapshot_header_t header;
+  uint32_t length = weave->length, words = VISIBLE_WORDS(length);
+  writer_t w;
+  int rc;
+
+  sprintf(tmp_path, "%s.tmp", path);
+  if ((w.file = fopen(tmp_path, "wb")) == NULL) return -1;
+  w.pos = 0;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.byte_order = SNAPSHOT_BYTE_ORDER;
+  header.length = length;
+
+  /* The header is written last, once the sections are all placed. */
+  rc = put_bytes(&w, &header, sizeof(header));
+
+#define PUT_ARRAY(s, array, bytes) do {                            \
+    if (rc == 0) rc = begin_section(&w, &header, s, SNAPSHOT_PAGE); \
+    if (rc == 0) rc = put_bytes(&w, array, bytes);                 \
+    end_section(&w, &header, s);                                   \
+  } while (0);
+
+  PUT_ARRAY(SECTION_IDS, weave->ids, length * sizeof(uint64_t));
+  PUT_ARRAY(SECTION_PREDS, weave->preds, length * sizeof(uint64_t));
+  PUT_ARRAY(SECTION_CHARS, weave->chars, length * sizeof(uint32_t));
+  PUT_ARRAY(SECTION_VISIBLE, weave->visible, words * sizeof(uint64_t));
+  PUT_ARRAY(SECTION_VISCOUNTS, weave->viscounts, (words + 1) * sizeof(uint32_t));
+#undef PUT_ARRAY
+
+  if (rc == 0) rc = begin_section(&w, &header, SECTION_WEFT, 8);
+  if (rc == 0) rc = put_weft(&w, weave->weft, FALSE);
+  end_section(&w, &header, SECTION_WEFT);
+
+  /* A weave that's still mapped has its memodict and waiting set in the
+     snapshot it came from, so those are copied over as they are. */
+  if (weave->snapshot != NULL) {
+    uint8_t *map = weave->snapshot->map;
+    for (int s = SECTION_WEFTS; s <= SECTION_WAITSET && rc == 0; s++) {
+      rc = begin_section(&w, &header, s, 8);
+      if (rc == 0) rc = put_bytes(&w, SECTION(map, s), SECTION_SIZE(map, s));
+      end_section(&w, &header, s);
+    }
+  } else {
+    if (rc == 0) rc = put_memodict(&w, &header, weave->memodict);
+    if (rc == 0) rc = begin_section(&w, &header, SECTION_WAITSET, 8);
+    if (rc == 0) rc = waitset_foreach(weave->wset, put_waiting, &w);
+    end_section(&w, &header, SECTION_WAITSET);
+  }
+
+  header.file_length = w.pos;
+  if (rc == 0 && (fseeko(w.file, 0, SEEK_SET) != 0 ||
+                  fwrite(&header, sizeof(header), 1, w.file) != 1 ||
+                  fflush(w.file) != 0 || fsync(fileno(w.file)) != 0))
+    rc = -1;
+  if (fclose(w.file) != 0) rc = -1;
+  if (rc == 0 && rename(tmp_path, path) != 0) rc = -1;
+  if (rc != 0) remove(tmp_path);
+  return rc;
+}
+
+
+
+/********************************** Loading ***********************************/
+
+/* Check that a mapped file is a snapshot this code can load, and that all its
+   sections are where they should be, and the right sizes. Doesn't look inside
+   the wefts, memodict and waitset sections; weave_thaw() does that. Returns 0
+   if it's fine, -1 if not. */
+static int check_header(uint8_t *map, size_t size) {
+  snapshot_header_t *header = (snapshot_header_t *)map;
+  uint64_t words;
+
+  if (size < sizeof(snapshot_header_t) ||
+      memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SNAPSHOT_VERSION ||
+      header->byte_order != SNAPSHOT_BYTE_ORDER ||
+      header->file_length != size || header->length < 2)
+    return -1;
+  for (int s = 0; s < SECTION_COUNT; s++) {
+    uint64_t offset = header->sections[s].offset;
+    uint64_t section_size = header->sections[s].size;
+    if (offset % 8 != 0 || offset > size || section_size > size - offset)
+      return -1;
+  }
+
+  words = VISIBLE_WORDS((uint64_t)header->length);
+  if (SECTION_SIZE(map, SECTION_IDS) != header->length * sizeof(uint64_t) ||
+      SECTION_SIZE(map, SECTION_PREDS) != header->length * sizeof(uint64_t) ||
+      SECTION_SIZE(map, SECTION_CHARS) != header->length * sizeof(uint32_t) ||
+      SECTION_SIZE(map, SECTION_VISIBLE) != words * sizeof(uint64_t) ||
+      SECTION_SIZE(map, SECTION_VISCOUNTS) != (words + 1) * sizeof(uint32_t) ||
+      SECTION_SIZE(map, SECTION_WEFT) % 8 != 0 ||
+      SECTION_SIZE(map, SECTION_MEMODICT) % 16 != 0)
+    return -1;
+  return 0;
+}
+
+/* Read a weft from (yarn, offset) pairs. Returns a new weft, or ERRWEFT on
+   malloc() failure. */
+static weft_t read_weft(const uint32_t *pairs, uint64_t count) {
+  weft_t weft = new_weft();
+  for (uint64_t i = 0; i < count; i++) {
+    if (weft_set(&weft, pairs[2 * i], pairs[2 * i + 1]) != 0) {
+      delete_weft(weft);
+      return ERRWEFT;
+    }
+  }
+  return weft;
+}
+
+/* Unmap a snapshot, and free the memory that kept track of it. */
+void delete_snapshot(snapshot_t snapshot) {
+  if (snapshot == NULL) return;
+  munmap(snapshot->map, snapshot->size);
+  free(snapshot);
+}
+
+/* Load a snapshot saved by weave_save_snapshot() into *weave, overwriting
+   whatever was there. The weave's arrays are mapped from the file read-only,
+   so this takes time proportional to the number of yarns in the weft, not the
+   size of the weave; see weave_thaw() for what happens when it changes.
+   Returns 0 on success, or -1 if the file can't be opened or mapped, isn't a
+   snapshot, or is the wrong version, in which case *weave is untouched. */
+int weave_load_snapshot(weave_t *weave, const char *path) {
+  struct stat st;
+  snapshot_t snapshot;
+  uint8_t *map;
+  weft_t weft;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0) return -1;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(snapshot_header_t)) {
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+  if (check_header(map, st.st_size) != 0 ||
+      (snapshot = malloc(sizeof(struct snapshot))) == NULL) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+  snapshot->map = map; snapshot->size = st.st_size;
+
+  weft = read_weft((uint32_t *)SECTION(map, SECTION_WEFT),
+                   SECTION_SIZE(map, SECTION_WEFT) / 8);
+  if (weft == ERRWEFT) { delete_snapshot(snapshot); return -1; }
+
+  weave->length    = ((snapshot_header_t *)map)->length;
+  weave->capacity  = weave->length;
+  weave->ids       = (uint64_t *)SECTION(map, SECTION_IDS);
+  weave->preds     = (uint64_t *)SECTION(map, SECTION_PREDS);
+  weave->chars     = (uint32_t *)SECTION(map, SECTION_CHARS);
+  weave->visible   = (uint64_t *)SECTION(map, SECTION_VISIBLE);
+  weave->viscounts = (uint32_t *)SECTION(map, SECTION_VISCOUNTS);
+  weave->weft      = weft;
+  weave->memodict  = (memodict_t)NULL;
+  weave->wset      = (waitset_t)NULL;
+  weave->posindex  = (posindex_t)NULL;
+  weave->textview  = (textview_t)NULL;
+  weave->snapshot  = snapshot;
+  weave->version   = (version_t)NULL;
+  return 0;
+}
+
+/* Rebuild a memodict from a mapped snapshot. Each distinct weft is read and
+   interned once, and then retained for every entry that has it. Returns 0 on
+   success, -1 on malloc() failure or if the sections are corrupt. */
+static int load_memodict(uint8_t *map, memodict_t *memodict) {
+  Pvoid_t wefts = (Pvoid_t)NULL; /* offset in wefts section -> weft + 1 */
+  Word_t *pvalue, index; Word_t rc_word;
+  uint8_t *table = SECTION(map, SECTION_WEFTS);
+  uint64_t table_size = SECTION_SIZE(map, SECTION_WEFTS);
+  uint64_t *entries = (uint64_t *)SECTION(map, SECTION_MEMODICT);
+  uint64_t entry_count = SECTION_SIZE(map, SECTION_MEMODICT) / 16;
+  int rc = 0;
+
+  for (uint64_t i = 0; i < entry_count && rc == 0; i++) {
+    uint64_t id = entries[2 * i], at = entries[2 * i + 1];
+    JLI(pvalue, wefts, (Word_t)at);
+    if (pvalue == PJERR) { rc = -1; break; }
+    if (*pvalue == 0) {
+      /* First time we've seen this one. The empty weft is NULL, so the
+         pointers are stored plus one. */
+      uint32_t count;
+      if (table_size < 4 || at % 4 != 0 || at > table_size - 4) {
+        rc = -1; break;
+      }
+      count = *(uint32_t *)(table + at);
+      if ((uint64_t)count * 8 > table_size - at - 4) { rc = -1; break; }
+      weft_t weft = weft_intern(read_weft((uint32_t *)(table + at + 4), count));
+      if (weft == ERRWEFT) { rc = -1; break; }
+      *pvalue = (Word_t)weft + 1;
+    }
+    rc = memodict_add(memodict, id, weft_retain((weft_t)(*pvalue - 1)));
+  }
+
+  index = 0; JLF(pvalue, wefts, index);
+  while (pvalue != NULL) {
+    if (*pvalue != 0) weft_release((weft_t)(*pvalue - 1));
+    JLN(pvalue, wefts, index);
+  }
+  JLFA(rc_word, wefts);
+  return rc;
+}
+
+/* Put the patches from a mapped snapshot in a waiting set. Returns 0 on
+   success, -1 on malloc() failure or if the section is corrupt. */
+static int load_waitset(uint8_t *map, waitset_t *wset) {
+  uint8_t *p = SECTION(map, SECTION_WAITSET);
+  uint8_t *end = p + SECTION_SIZE(map, SECTION_WAITSET);
+
+  while (p < end) {
+    uint64_t blocking_id; uint32_t length_bytes;
+    if (end - p < 16) return -1;
+    blocking_id = *(uint64_t *)p;
+    length_bytes = patch_length_bytes((patch_t)(p + 8));
+    if (length_bytes < 5 || length_bytes > (uint64_t)(end - p - 8)) return -1;
+    if (add_to_waitset(wset, blocking_id, (patch_t)(p + 8)) != 0) return -1;
+    p += 8 + (length_bytes + 7) / 8 * 8;
+  }
+  return 0;
+}
+
+/* Get a weave that was loaded from a snapshot ready to be changed: copy its
+   arrays out of the mapping, rebuild its memodict and waiting set, and unmap
+   the snapshot. Anything that changes a vector weave calls this first, and it
+   does nothing for a weave that isn't mapped, so there's rarely any need to
+   call it directly. It's the one place that touches the whole snapshot, and it
+   takes time proportional to the weave's size plus the memodict's.
+
+   If the weave has a waiting set already, because limits were set on it after
+   loading, the snapshot's patches are added to that one. Returns 0 on
+   success, or -1 on malloc() failure or if the snapshot turns out to be
+   corrupt, in which case the weave is still mapped. Trying again may put some
+   patches in the waiting set twice, which is harmless, since the second copy
+   of a patch is dropped when it's woken up. */
+int weave_thaw(weave_t *weave) {
+  snapshot_t snapshot = weave->snapshot;
+  if (snapshot == NULL) return 0;
+  uint8_t *map = snapshot->map;
+  uint32_t length = weave->length, words = VISIBLE_WORDS(length);
+  memodict_t memodict = new_memodict();
+
+  uint64_t *ids = malloc(length * sizeof(uint64_t));
+  uint64_t *preds = malloc(length * sizeof(uint64_t));
+  uint32_t *chars = malloc(length * sizeof(uint32_t));
+  uint64_t *visible = malloc(words * sizeof(uint64_t));
+  uint32_t *viscounts = malloc((words + 1) * sizeof(uint32_t));
+  if (ids == NULL || preds == NULL || chars == NULL || visible == NULL ||
+      viscounts == NULL || load_memodict(map, &memodict) != 0 ||
+      load_waitset(map, &weave->wset) != 0) {
+    free(ids); free(preds); free(chars); free(visible); free(viscounts);
+    delete_memodict(memodict);
+    return -1;
+  }
+  memcpy(ids, weave->ids, length * sizeof(uint64_t));
+  memcpy(preds, weave->preds, length * sizeof(uint64_t));
+  memcpy(chars, weave->chars, length * sizeof(uint32_t));
+  memcpy(visible, weave->visible, words * sizeof(uint64_t));
+  memcpy(viscounts, weave->viscounts, (words + 1) * sizeof(uint32_t));
+
+  weave->ids = ids; weave->preds = preds; weave->chars = chars;
+  weave->visible = visible; weave->viscounts = viscounts;
+  weave->memodict = memodict;
+  weave->snapshot = NULL;
+  delete_snapshot(snapshot);
+  return 0;
+}
+
+
+/********************************** Testing ***********************************/
+
+// int main(void) {
+//   weave_t weave = new_weave(0), loaded;
+//   patch_t patch1 = make_patch1();
+//
+//   LIFTERR(apply_patch(&weave, patch1));
+//   LIFTERR(weave_save_snapshot(&weave, "/tmp/sburb-snapshot"));
+//   LIFTERR(weave_load_snapshot(&loaded, "/tmp/sburb-snapshot"));
+//   assert(loaded.length == weave.length);
+//   assert(memcmp(loaded.ids, weave.ids, weave.length * sizeof(uint64_t)) == 0);
+//   assert(weave_visible_length(&loaded) == weave_visible_length(&weave));
+//   weave_print(loaded);
+//
+//   LIFTERR(weave_thaw(&loaded));
+//   assert(loaded.snapshot == NULL);
+//   weave_print(loaded);
+//
+//   delete_weave(weave); delete_weave(loaded);
+//   free(patch1);
+//   return 0;
+// }
@@ -1,28 +1,36 @@
 /* Snarfstrip: a simple driver program which reads in a data file containing a
    sequence of patches, applies those in turn to a blank weave, and then scours
-   the weave. */
+   the weave. With -p, the patches go through an ingest pipeline instead, so
+   that reading them overlaps with applying them. */
 
 #include "sburb.h"
 #include "benchmark.h"
 
 int main(int argc, char **argv) {
   weave_t weave = new_weave(128);
+  ingest_t ingest = NULL;
+  int pipelined = argc == 3 && strcmp(argv[1], "-p") == 0;
 
   /* Check for right number of args */
-  if (argc != 2) {
-    printf("usage: %s file\n", argv[0]);
+  if (argc != 2 && !pipelined) {
+    printf("usage: %s [-p] file\n", argv[0]);
     exit(1);
   }
 
   /* Open the input file. */
-  FILE *file = fopen(argv[1], "r");
+  FILE *file = fopen(argv[argc - 1], "r");
   if (file == NULL) {
-    printf("%s: could not open file %s\n", argv[0], argv[1]);
+    printf("%s: could not open file %s\n", argv[0], argv[argc - 1]);
     exit(1);
   }
 
   /* Read and apply the patches */
   BENCHMARK_INIT();
+  if (pipelined) {
+    TICK();
+    ingest = new_ingest(&weave);
+    assert(ingest != NULL);
+  }
   unsigned int chain_count;
   unsigned int chain_lengths[4096];
   while (fscanf(file, "%u", &chain_count) == 1) {
@@ -59,10 +67,28 @@ int main(int argc, char **argv) {
     assert((uint8_t*)p32 - (uint8_t*)patch == patch_len);
     assert(patch_length_atoms(patch) == atom_count);
     
-    /* Apply the patch, and free it. */
-    TICK(); LIFTERR(apply_patch(&weave, patch)); TOCK();
+    /* Apply the patch, or send it down the pipeline, and free it. */
+    if (pipelined) {
+      uint8_t *buf = malloc(patch_wire_bound(patch, PATCH_WIRE_RAW));
+      if (buf == NULL) return -1;
+      uint32_t len = patch_to_wire(patch, PATCH_WIRE_RAW, buf);
+      LIFTERR(ingest_push(ingest, buf, len));
+    } else {
+      TICK(); LIFTERR(apply_patch(&weave, patch)); TOCK();
+    }
     free(patch);
   }
+  if (pipelined) {
+    /* This times the reading too, since it overlaps with the applying. */
+    ingest_stats_t stats;
+    ingest_finish(ingest, &stats);
+    TOCK();
+    printf("%llu patches: %llu applied in %llu batches, %llu invalid, "
+           "%llu duplicates, %llu failed\n", (long long)stats.received,
+           (long long)stats.applied, (long long)stats.batches,
+           (long long)stats.invalid, (long long)stats.duplicates,
+           (long long)stats.failed);
+  }
 
   weave_print(weave);
   weave_scour_print(weave);
@@ -0,0 +1,105 @@
+/* Text views: the visible text of a weave, kept up to date as patches are
+   applied, so that getting the current text doesn't mean scouring the whole
+   weave again. Along with the text, a view has a list of the changes made to
+   it by the last batch of patches, for clients that need to follow along.
+
+   The text is a plain array of chars, and changes are spliced in with
+   memmove(). The changes are listed in order, as (pos, deleted, inserted)
+   events: at visible position pos, remove deleted chars, then insert inserted
+   chars. Each event's position is in the text as it is after the events
+   before it. Since one batch of patches rarely touches more than a few places
+   in the text, an event that starts right where the last one ended is merged
+   into it. */
+
+#include "sburb.h"
+
+struct textview {
+  uint32_t *text;               /* The visible chars */
+  uint32_t length;              /* Number of chars */
+  uint32_t capacity;            /* Number of chars allocated */
+  textevent_t *events;          /* Changes since textview_clear_events() */
+  uint32_t event_count;         /* Number of events */
+  uint32_t event_capacity;      /* Number of events allocated */
+};
+
+/* Allocate and return a new, empty text view. Returns NULL on malloc()
+   failure. */
+textview_t new_textview(void) {
+  return calloc(1, sizeof(struct textview));
+}
+
+/* Delete a text view, and free its memory. Does nothing if given NULL. */
+void delete_textview(textview_t view) {
+  if (view == NULL) return;
+  free(view->text); free(view->events);
+  free(view);
+}
+
+/* Return a text view's text, and put its length in *length. The text is not
+   null-terminated, and is only valid until the view next changes. */
+const uint32_t *textview_text(textview_t view, uint32_t *length) {
+  *length = view->length;
+  return view->text;
+}
+
+/* Return the events recorded by a text view since the last time they were
+   cleared, and put how many there are in *count. Each event's text points to
+   its inserted chars, in the view's text; like the text itself, the events are
+   only valid until the view next changes. */
+const textevent_t *textview_events(textview_t view, uint32_t *count) {
+  for (uint32_t i = 0; i < view->event_count; i++)
+    view->events[i].text = view->text + view->events[i].pos;
+  *count = view->event_count;
+  return view->events;
+}
+
+/* Forget all of a text view's events. */
+void textview_clear_events(textview_t view) {
+  view->event_count = 0;
+}
+
+/* Record a change to a text view's text, merging it into the last event if it
+   starts where that one ended. Returns 0 on success, -1 on malloc() failure. */
+static int record_event(textview_t view, uint32_t pos, uint32_t deleted,
+                        uint32_t inserted) {
+  textevent_t *last = view->event_count > 0 ?
+    &view->events[view->event_count - 1] : NULL;
+
+  if (last != NULL && pos == last->pos + last->inserted) {
+    last->deleted += deleted; last->inserted += inserted;
+    return 0;
+  }
+  if (view->event_count == view->event_capacity) {
+    uint32_t capacity = view->event_capacity == 0 ? 8 : view->event_capacity * 2;
+    textevent_t *events = realloc(view->events, capacity * sizeof(textevent_t));
+    if (events == NULL) return -1;
+    view->events = events; view->event_capacity = capacity;
+  }
+  textevent_t *event = &view->events[view->event_count++];
+  event->pos = pos; event->deleted = deleted; event->inserted = inserted;
+  event->text = NULL;
+  return 0;
+}
+
+/* Change a text view's text: at position pos, remove deleted chars, and make
+   room for inserted chars in their place. Records an event for the change.
+   Returns a pointer to where the inserted chars go, which the caller must fill
+   in, or NULL on malloc() failure. */
+uint32_t *textview_splice(textview_t view, uint32_t pos, uint32_t deleted,
+                          uint32_t inserted) {
+  uint32_t length = view->length - deleted + inserted;
+
+  if (length > view->capacity || view->text == NULL) {
+    uint32_t capacity = view->capacity == 0 ? 64 : view->capacity;
+    while (capacity < length) capacity *= 2;
+    uint32_t *text = realloc(view->text, capacity * sizeof(uint32_t));
+    if (text == NULL) return NULL;
+    view->text = text; view->capacity = capacity;
+  }
+  if (record_event(view, pos, deleted, inserted) != 0) return NULL;
+
+  memmove(view->text + pos + inserted, view->text + pos + deleted,
+          (view->length - pos - deleted) * sizeof(uint32_t));
+  view->length = length;
+  return view->text + pos;
+}
@@ -17,34 +17,50 @@ weave_t new_weave(uint32_t capacity) {
   if (capacity == 0) capacity = 4;
   if (capacity == 1) capacity = 2;
   weave.ids      = malloc(capacity * sizeof(uint64_t));
-  weave.bodies   = malloc(capacity * 3 * sizeof(uint32_t));
+  weave.preds    = malloc(capacity * sizeof(uint64_t));
+  weave.chars    = malloc(capacity * sizeof(uint32_t));
+  weave.visible  = calloc(VISIBLE_WORDS(capacity), sizeof(uint64_t));
+  weave.viscounts = calloc(VISIBLE_WORDS(capacity) + 1, sizeof(uint32_t));
   weave.length   = 2;
   weave.capacity = capacity;
   weave.weft     = (weft_t)NULL;
   weave.memodict = (memodict_t)NULL;
   weave.wset     = (waitset_t)NULL;
-  uint64_t *ids  = weave.ids; uint32_t *bodies = weave.bodies;
+  weave.posindex = (posindex_t)NULL;
+  weave.textview = (textview_t)NULL;
+  weave.snapshot = (snapshot_t)NULL;
+  weave.version  = (version_t)NULL;
+  uint64_t *ids  = weave.ids, *preds = weave.preds; uint32_t *chars = weave.chars;
 
-  WRITE_ATOM(PACK_ID(0, 1), PACK_ID(0, 1), ATOM_CHAR_START, ids, bodies);
-  WRITE_ATOM(PACK_ID(0, 2), PACK_ID(0, 1), ATOM_CHAR_END,   ids, bodies);
+  WRITE_ATOM(PACK_ID(0, 1), PACK_ID(0, 1), ATOM_CHAR_START, ids, preds, chars);
+  WRITE_ATOM(PACK_ID(0, 2), PACK_ID(0, 1), ATOM_CHAR_END,   ids, preds, chars);
   return weave;
 }
 
-/* Delete a weave, and free its memory. */
+/* Delete a weave, and free its memory. If the weave was loaded from a
+   snapshot and hasn't changed since, its arrays are unmapped instead, and if
+   it was published and hasn't changed since, they're left to the version. */
 void delete_weave(weave_t weave) {
-  free(weave.ids); free(weave.bodies);
+  if (weave.snapshot != NULL) {
+    delete_snapshot(weave.snapshot);
+  } else if (weave.version == NULL) {
+    free(weave.ids); free(weave.preds); free(weave.chars);
+    free(weave.visible); free(weave.viscounts);
+  }
   delete_weft(weave.weft);
   delete_memodict(weave.memodict);
-  delete_waitset(weave.wset, TRUE);
+  delete_waitset(weave.wset);
+  delete_posindex(weave.posindex);
+  delete_textview(weave.textview);
 }
 
 /* Print a weave, for debugging. Not a concise format! */
 void weave_print(weave_t weave) {
   uint64_t id, pred; uint32_t c;
-  uint64_t *ids = weave.ids; uint32_t *bodies = weave.bodies;
+  uint64_t *ids = weave.ids, *preds = weave.preds; uint32_t *chars = weave.chars;
 
   for (int i = 0; i < weave.length; i++) {
-    READ_ATOM(id, pred, c, ids, bodies);
+    READ_ATOM(id, pred, c, ids, preds, chars);
     printf("<id: %u,%u\tpred: %u,%u\t",
            YARN(id), OFFSET(id), YARN(pred), OFFSET(pred));
     if (c < 128) printf("%c>\n", (char)c);
@@ -53,100 +69,432 @@ void weave_print(weave_t weave) {
   printf("\n");
 }
 
+/* Start keeping a position index for a weave, so that applying patches can go
+   straight to their anchors instead of scanning the weave for them. The index
+   costs 4 bytes per atom, and has to be updated for every atom that an
+   insertion moves. Returns 0 on success, -1 on malloc() failure. */
+int weave_index_positions(weave_t *weave) {
+  if (weave->posindex != NULL) return 0;
+  posindex_t posindex = new_posindex();
+  if (posindex == NULL) return -1;
+  for (uint32_t i = 0; i < weave->length; i++) {
+    if (posindex_set(posindex, weave->ids[i], i) != 0) {
+      delete_posindex(posindex);
+      return -1;
+    }
+  }
+  weave->posindex = posindex;
+  return 0;
+}
+
+/* Record the new position of an atom in a weave's position index, if it has
+   one. If that fails, the index is dropped, and we go back to scanning. */
+static inline void index_position(weave_t *weave, uint64_t id, uint32_t pos) {
+  if (weave->posindex != NULL && posindex_set(weave->posindex, id, pos) != 0) {
+    delete_posindex(weave->posindex);
+    weave->posindex = NULL;
+  }
+}
+
+/* Work out whether atom i of a weave is visible, and set its bit in the
+   visibility bitmap to match. Since deletors go right after the atoms they
+   delete, this only needs to look at atom i and the atom after it, so it must
+   be called again for atom i whenever atom i + 1 changes. */
+static inline void update_visibility(weave_t *weave, uint32_t i) {
+  uint64_t bit = (uint64_t)1 << (i % 64);
+  int visible = ATOM_CHAR_IS_VISIBLE(weave->chars[i]) &&
+    !(i + 1 < weave->length && weave->chars[i + 1] == ATOM_CHAR_DEL &&
+      weave->preds[i + 1] == weave->ids[i]);
+  if (visible) weave->visible[i / 64] |= bit;
+  else         weave->visible[i / 64] &= ~bit;
+}
+
+/* Is atom i of a weave visible, according to its visibility bitmap? */
+#define IS_VISIBLE(weave, i) (((weave)->visible[(i) / 64] >> ((i) % 64)) & 1)
+
+
+
+/***************************** Visible positions ******************************/
+
+/* To get from visible positions to atoms and back without scouring, a weave
+   keeps a Fenwick tree over the visibility bitmap, counting the visible atoms
+   in each word of it. viscounts[j], for j from 1, holds the count for words
+   j - lowbit(j) through j - 1, so the count of visible atoms before any word
+   is a sum of O(log n) entries. Since an insertion moves everything after it
+   anyway, the tree is just rebuilt after each one, which is linear in the
+   number of words rather than atoms. */
+
+/* Rebuild a weave's Fenwick tree from its visibility bitmap. */
+static void rebuild_viscounts(weave_t *weave) {
+  uint32_t words = VISIBLE_WORDS(weave->length);
+  uint32_t *tree = weave->viscounts;
+  for (uint32_t j = 1; j <= words; j++)
+    tree[j] = __builtin_popcountll(weave->visible[j - 1]);
+  for (uint32_t j = 1; j <= words; j++) {
+    uint32_t parent = j + (j & -j);
+    if (parent <= words) tree[parent] += tree[j];
+  }
+}
+
+/* Return the number of visible atoms before atom i of a weave. */
+static uint32_t visible_rank(weave_t *weave, uint32_t i) {
+  uint32_t count = 0;
+  for (uint32_t j = i / 64; j > 0; j -= j & -j)
+    count += weave->viscounts[j];
+  if (i % 64 != 0)
+    count += __builtin_popcountll(weave->visible[i / 64] &
+                                  (((uint64_t)1 << (i % 64)) - 1));
+  return count;
+}
+
+/* Count the visible atoms in a weave from atom from up to, but not including,
+   atom to. */
+static inline uint32_t count_visible(weave_t *weave, uint32_t from,
+                                     uint32_t to) {
+  return visible_rank(weave, to) - visible_rank(weave, from);
+}
+
+/* Return the number of visible chars in a weave. */
+uint32_t weave_visible_length(weave_t *weave) {
+  return visible_rank(weave, weave->length);
+}
+
+/* Return the id of the atom holding the visible char at position k in a weave,
+   counting from 0, or 0 if there are only k visible chars or fewer. Takes
+   O(log n) time. */
+uint64_t weave_visible_id(weave_t *weave, uint32_t k) {
+  uint32_t words = VISIBLE_WORDS(weave->length), j = 0, step = 1;
+  uint64_t word;
+
+  /* Find the word holding it, descending the Fenwick tree. */
+  while (step * 2 <= words) step *= 2;
+  for (; step > 0; step /= 2) {
+    if (j + step <= words && weave->viscounts[j + step] <= k) {
+      j += step; k -= weave->viscounts[j];
+    }
+  }
+  if (j == words) return 0;
+
+  /* Then find the bit in the word. */
+  word = weave->visible[j];
+  if (__builtin_popcountll(word) <= k) return 0;
+  for (; k > 0; k--) word &= word - 1;
+  return weave->ids[j * 64 + __builtin_ctzll(word)];
+}
+
+/* Return the visible position of an atom in a weave: the number of visible
+   chars before it, which is where a cursor right before it would be. Returns
+   POSINDEX_NONE if the atom isn't in the weave. This takes O(log n) time if
+   the weave has a position index, and scans the weave otherwise. */
+uint32_t weave_visible_index(weave_t *weave, uint64_t id) {
+  uint32_t pos = POSINDEX_NONE;
+  if (weave->posindex != NULL) {
+    pos = posindex_get(weave->posindex, id);
+  } else {
+    for (uint32_t i = 0; i < weave->length; i++)
+      if (weave->ids[i] == id) { pos = i; break; }
+  }
+  return pos == POSINDEX_NONE ? POSINDEX_NONE : visible_rank(weave, pos);
+}
+
+
+/********************************* Text views *********************************/
+
+/* Start keeping a text view for a weave, with the weave's visible text in
+   it. From then on, applying patches updates the text, and leaves a list of
+   the changes in the view: see textview.c. Returns 0 on success, -1 on malloc()
+   failure. */
+int weave_view_text(weave_t *weave) {
+  if (weave->textview != NULL) return 0;
+  textview_t view = new_textview();
+  if (view == NULL) return -1;
+  uint32_t *text = textview_splice(view, 0, 0,
+                                   count_visible(weave, 0, weave->length));
+  if (text == NULL) { delete_textview(view); return -1; }
+  for (uint32_t i = 0; i < weave->length; i++)
+    if (IS_VISIBLE(weave, i)) *text++ = weave->chars[i];
+  textview_clear_events(view);
+  weave->textview = view;
+  return 0;
+}
+
+/* Bring a weave's text view up to date after apply_insvec(). Takes the insvec,
+   and whether the atom before each insertion point was visible beforehand.
+
+   Going through the insertions in order, there are only two things that can
+   change the text: the atom before an insertion can stop being visible, if a
+   deletor for it went in, and any visible atoms in the inserted chain are new
+   text. Old atoms never become visible. Each insertion costs O(log n) to find
+   its visible position, plus the splice. If updating the text fails, the view
+   is dropped. */
+static void update_textview(weave_t *weave, vector_t insvec,
+                            uint8_t *was_visible) {
+  textview_t view = weave->textview;
+  uint32_t shift = 0;           /* How many atoms went in before this point */
+
+  for (Word_t r = 0; r < VECTOR_LEN(insvec); r += 3) {
+    uint32_t index = VECTOR_GET(insvec, r), len = VECTOR_GET(insvec, r + 1);
+    uint32_t pos = index + shift, vis = visible_rank(weave, pos), n;
+    uint32_t *text;
+
+    /* The atom before the insertion, if it's an old one, may be deleted. */
+    if ((r == 0 || VECTOR_GET(insvec, r - 3) != index) && was_visible[r / 3] &&
+        !IS_VISIBLE(weave, pos - 1))
+      if (textview_splice(view, vis, 1, 0) == NULL) goto fail;
+
+    /* Then the visible atoms in the chain are inserted. */
+    n = count_visible(weave, pos, pos + len);
+    if (n > 0) {
+      if ((text = textview_splice(view, vis, 0, n)) == NULL) goto fail;
+      for (uint32_t i = pos; i < pos + len; i++)
+        if (IS_VISIBLE(weave, i)) *text++ = weave->chars[i];
+    }
+    shift += len;
+  }
+  return;
+
+ fail:
+  delete_textview(view);
+  weave->textview = NULL;
+}
+
 
 /***************************** Insertion vectors ******************************/
 
-/* Take a weave and a vector of alternating index, chain_len, chain* words, and insert
-   those atoms into the weave, in-place. Does not modify weft. */
-weave_t apply_insvec_inplace(weave_t weave, vector_t insvec, uint32_t atom_count) {
-  int displacement = atom_count; /* How far to move items to the right */
-  int vec_len = (int)VECTOR_LEN(insvec); /* Remaining length of insertion vector */
-  Word_t *vec_head = insvec + 2 + vec_len - 3; /* Head of insvec pairs */
+/* An insertion vector is a vector of alternating index, chain_len, chain*
+   words, sorted by index: each chain goes right before atom index of the
+   weave, and chains with the same index go in in the order they're listed.
+   Between one insertion point and the next, the weave's atoms all move the
+   same distance, so they're moved as a block: a memmove() for each array, and
+   a block of bits for the visibility bitmap. The only atoms whose visibility
+   has to be worked out again are the chains' and the ones right before them;
+   every other atom still has the same atom after it. */
 
-  weave.length += atom_count;
+/* Copies of big weaves are split between threads with at least this many
+   atoms each, up to MOVE_MAX_THREADS of them. */
+#ifndef MOVE_ATOMS_PER_THREAD
+#define MOVE_ATOMS_PER_THREAD (1 << 20)
+#endif
+#ifndef MOVE_MAX_THREADS
+#define MOVE_MAX_THREADS 8
+#endif
 
-  for (int i = weave.length - 1; i >= 0; i--) {
-    uint64_t id = 0, pred = 0; uint32_t c = ATOM_CHAR_START;
-    // printf("\ni = %i, displacement = %i\n", i, displacement);
-    // printf("vec_head[0] = %i, i - displacement+1 = %i\n",
-    //        vec_len > 0 ? (int)vec_head[0] : 69, i - displacement+1);
-    if (vec_len == 0) break;
-    if (vec_len > 0 && i - displacement + 1 == (int)vec_head[0]) {
-      int chain_len = (int)vec_head[1];
-      uint32_t *chain = (uint32_t *)vec_head[2];
-      // Copy over the chain.
-      for (int j = i - chain_len + 1; j <= i; j++) {
-        READ_ATOM_SEQ(id, pred, c, chain);
-        //printf("COPY id: %llu, pred: %llu, c: %X\n", id, pred, c);
-        WRITE_ATOM_IDX(id, pred, c, weave.ids, weave.bodies, j);
-        /* Add to memodict if necessary */
-        if (YARN(id) != YARN(pred))
-          memodict_add(&weave.memodict, id, pull(weave.memodict, id, pred));
-      }
-      /* Add chain to weft */
-      weft_extend(&weave.weft, YARN(id), OFFSET(id));
-      i -= chain_len; i++; displacement -= chain_len;
-      vec_len -= 3; vec_head -= 3;
-    } else {
-      //printf("Moving from %i to %i\n", i - displacement, i);
-      READ_ATOM_IDX(id, pred, c, weave.ids, weave.bodies, i - displacement);
-      //printf("MOVE id: %llu, pred: %llu, c: %X\n", id, pred, c);
-      WRITE_ATOM_IDX(id, pred, c, weave.ids, weave.bodies, i);
+/* How many threads to split work on so many atoms between: at least one, and
+   no more than max, or than there are CPUs. */
+static uint32_t thread_count(uint32_t atoms, uint32_t per_thread,
+                             uint32_t max) {
+  uint32_t n = atoms / per_thread;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > max) n = max;
+  if (cpus > 0 && n > cpus) n = cpus;
+  return n < 1 ? 1 : n;
+}
+
+/* Get n bits of a bitmap, from 1 to 64 of them, starting at bit pos. */
+static inline uint64_t get_bits(const uint64_t *bits, uint64_t pos,
+                                uint32_t n) {
+  uint64_t word = pos / 64, shift = pos % 64, value = bits[word] >> shift;
+  if (shift + n > 64) value |= bits[word + 1] << (64 - shift);
+  return n == 64 ? value : value & (((uint64_t)1 << n) - 1);
+}
+
+/* Set n bits of a bitmap, from 1 to 64 of them, starting at bit pos. */
+static inline void put_bits(uint64_t *bits, uint64_t pos, uint32_t n,
+                            uint64_t value) {
+  uint64_t word = pos / 64, shift = pos % 64;
+  uint64_t mask = n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+  bits[word] = (bits[word] & ~(mask << shift)) | (value << shift);
+  if (shift + n > 64)
+    bits[word + 1] = (bits[word + 1] & ~(mask >> (64 - shift))) |
+      (value >> (64 - shift));
+}
+
+/* Copy n bits from bit from of src to bit to of dst, 64 at a time, starting
+   at the end. If src and dst are the same bitmap, to must be >= from. */
+static void move_bits(uint64_t *dst, uint64_t to, const uint64_t *src,
+                      uint64_t from, uint64_t n) {
+  while (n > 0) {
+    uint32_t k = n < 64 ? n : 64;
+    n -= k;
+    put_bits(dst, to + n, k, get_bits(src, from + n, k));
+  }
+}
+
+/* Move n atoms from index from of one weave's arrays to index to of another's,
+   which may be the same ones. The visibility bitmap isn't touched. */
+static inline void move_atoms(weave_t *dst, uint32_t to, const weave_t *src,
+                              uint32_t from, uint32_t n) {
+  if (n == 0 || (dst->ids == src->ids && to == from)) return;
+  memmove(dst->ids + to, src->ids + from, n * sizeof(uint64_t));
+  memmove(dst->preds + to, src->preds + from, n * sizeof(uint64_t));
+  memmove(dst->chars + to, src->chars + from, n * sizeof(uint32_t));
+}
+
+/* Write n atoms of a chain into a weave's arrays, starting at index i. */
+static inline void copy_chain(weave_t *weave, uint32_t i, uint32_t *chain,
+                               uint32_t n) {
+  uint64_t id, pred; uint32_t c;
+  for (uint32_t j = i; j < i + n; j++) {
+    READ_ATOM_SEQ(id, pred, c, chain);
+    WRITE_ATOM_IDX(id, pred, c, weave->ids, weave->preds, weave->chars, j);
+  }
+}
+
+/* Once every atom is where it belongs, bring everything else up to date: the
+   visibility of the atoms that have new atoms after them, the position index,
+   if there is one, and the weft, for the inserted atoms. This only goes over
+   the chains, and the atoms right before them, unless there's a position
+   index, in which case every atom that moved is reindexed. The memodict is
+   left alone; memoize_patch() is what puts the chains' atoms in it. */
+static void finish_insvec(weave_t *weave, vector_t insvec,
+                          uint32_t old_length) {
+  uint32_t shift = 0, k = 0;    /* Atoms inserted so far; next old atom */
+  uint64_t id = 0, pred; uint32_t c;
+
+  for (Word_t r = 0; r < VECTOR_LEN(insvec); r += 3) {
+    uint32_t index = VECTOR_GET(insvec, r), len = VECTOR_GET(insvec, r + 1);
+    uint32_t *chain = (uint32_t *)VECTOR_GET(insvec, r + 2);
+    uint32_t pos = index + shift;
+
+    if (weave->posindex != NULL && shift > 0)
+      for (; k < index; k++)
+        index_position(weave, weave->ids[k + shift], k + shift);
+    k = index;
+    if (pos > 0) update_visibility(weave, pos - 1);
+    for (uint32_t j = pos; j < pos + len; j++) {
+      READ_ATOM_SEQ(id, pred, c, chain);
+      index_position(weave, id, j);
+      update_visibility(weave, j);
     }
+    /* A chain's last atom has its highest id. */
+    weft_extend(&weave->weft, YARN(id), OFFSET(id));
+    shift += len;
   }
+  if (weave->posindex != NULL && shift > 0)
+    for (; k < old_length; k++)
+      index_position(weave, weave->ids[k + shift], k + shift);
+}
 
+/* Take a weave and an insertion vector, and insert those atoms into the
+   weave, in place. The weave must have room for them. Goes from the back to
+   the front, so each block of old atoms moves out of the way before the block
+   before it moves into its place. */
+weave_t apply_insvec_inplace(weave_t weave, vector_t insvec, uint32_t atom_count) {
+  uint32_t old_length = weave.length, end = old_length, shift = atom_count;
+
+  weave.length += atom_count;
+  for (Word_t r = VECTOR_LEN(insvec); r > 0; r -= 3) {
+    uint32_t index = VECTOR_GET(insvec, r - 3), len = VECTOR_GET(insvec, r - 2);
+    uint32_t *chain = (uint32_t *)VECTOR_GET(insvec, r - 1);
+    move_atoms(&weave, index + shift, &weave, index, end - index);
+    move_bits(weave.visible, index + shift, weave.visible, index, end - index);
+    shift -= len;
+    copy_chain(&weave, index + shift, chain, len);
+    end = index;
+  }
+  finish_insvec(&weave, insvec, old_length);
   return weave;
 }
 
-/* Take a weave and a vector of alternating index, chain* words, and insert
-   those atoms into the weave, allocating new memory to hold the atom_count new
-   atoms. Does not modify weft. */
+/* One thread's share of copying a weave into new arrays: the atoms from..to-1
+   of the new weave. */
+typedef struct {
+  weave_t *weave;               /* The new arrays */
+  const weave_t *old;           /* The old ones */
+  vector_t insvec;
+  uint32_t from, to;
+} copy_part_t;
+
+/* Fill in a part of the new weave, from the old weave's blocks and the
+   chains, whichever of them overlap it. */
+static void *copy_part(void *arg) {
+  copy_part_t *part = arg;
+  vector_t insvec = part->insvec;
+  uint32_t i = 0, k = 0;        /* Next atom of the new weave, of the old one */
+
+  for (Word_t r = 0; r <= VECTOR_LEN(insvec) && i < part->to; r += 3) {
+    int last = r == VECTOR_LEN(insvec);
+    uint32_t index = last ? part->old->length : VECTOR_GET(insvec, r);
+    uint32_t lo = i > part->from ? i : part->from;
+    uint32_t hi = i + (index - k) < part->to ? i + (index - k) : part->to;
+    if (lo < hi) move_atoms(part->weave, lo, part->old, k + (lo - i), hi - lo);
+    i += index - k; k = index;
+    if (last) break;
+
+    uint32_t len = VECTOR_GET(insvec, r + 1);
+    uint32_t *chain = (uint32_t *)VECTOR_GET(insvec, r + 2);
+    lo = i > part->from ? i : part->from;
+    hi = i + len < part->to ? i + len : part->to;
+    if (lo < hi) copy_chain(part->weave, lo, chain + 5 * (lo - i), hi - lo);
+    i += len;
+  }
+  return NULL;
+}
+
+/* Take a weave and an insertion vector, and insert those atoms into the
+   weave, allocating new arrays with room for them. Nothing overlaps, so the
+   copying of a big weave is split between threads, each taking a range of
+   the new weave. The old arrays are freed, unless a published version has
+   them. */
 weave_t apply_insvec_alloc(weave_t weave, vector_t insvec, uint32_t atom_count) {
-  int vec_len = (int)VECTOR_LEN(insvec); /* Remaining length of insertion vector */
-  Word_t *vec_head = insvec + 2; /* Head of insvec pairs */
-  /* Old value variables */
-  uint64_t *old_ids = weave.ids; uint32_t *old_bodies = weave.bodies;
-  void *old_ids_head = weave.ids; void *old_bodies_head = weave.bodies;
+  copy_part_t parts[MOVE_MAX_THREADS];
+  pthread_t threads[MOVE_MAX_THREADS];
+  int started[MOVE_MAX_THREADS];
+  weave_t old = weave;
   weave.length += atom_count;
-  
+
   /* Allocate new weave vectors. New capacity is lowest power of two greater
      than length; e.g. if weave.length is 21, then capacity will be 32. */
   weave.capacity = (uint32_t)pow(2.0, ceil(log2((double)weave.length)));
   weave.ids      = malloc(weave.capacity * sizeof(uint64_t));
-  weave.bodies   = malloc(weave.capacity * 3 * sizeof(uint32_t));
-  uint64_t *new_ids = weave.ids; uint32_t *new_bodies = weave.bodies;
-  
-  /* Copy items, inserting chains in their proper places. */
-  for (int i = 0, k = 0; i < weave.length; i++) {
-    uint64_t id = 0, pred = 0; uint32_t c = ATOM_CHAR_START; /* current atom */
-    if (vec_len > 0 && k == (int)vec_head[0]) { /* chain here */
-      int chain_len = (int)vec_head[1]; uint32_t *chain = (uint32_t *)vec_head[2];
-      for (int j = 0; j < chain_len; j++) {
-        READ_ATOM_SEQ(id, pred, c, chain);
-        WRITE_ATOM(id, pred, c, new_ids, new_bodies);
-        /* Add to memodict if necessary */
-        //if (YARN(id) != YARN(pred))
-        //  memodict_add(&weave.memodict, id, pull(weave.memodict, id, pred));
-      }
-      /* Add chain to weft */
-      weft_extend(&weave.weft, YARN(id), OFFSET(id));
-      i += chain_len - 1;
-      vec_len -= 3; vec_head += 3;
-    } else {
-      READ_ATOM(id, pred, c, old_ids, old_bodies);
-      WRITE_ATOM(id, pred, c, new_ids, new_bodies);
-      k++;
-    }
+  weave.preds    = malloc(weave.capacity * sizeof(uint64_t));
+  weave.chars    = malloc(weave.capacity * sizeof(uint32_t));
+  weave.visible  = calloc(VISIBLE_WORDS(weave.capacity), sizeof(uint64_t));
+  weave.viscounts = malloc((VISIBLE_WORDS(weave.capacity) + 1) *
+                           sizeof(uint32_t));
+
+  /* Copy the atoms, a part of the new weave per thread. */
+  uint32_t nparts = thread_count(weave.length, MOVE_ATOMS_PER_THREAD,
+                                 MOVE_MAX_THREADS);
+  for (uint32_t p = 0; p < nparts; p++) {
+    parts[p].weave = &weave; parts[p].old = &old; parts[p].insvec = insvec;
+    parts[p].from = (uint64_t)weave.length * p / nparts;
+    parts[p].to = (uint64_t)weave.length * (p + 1) / nparts;
+  }
+  for (uint32_t p = 1; p < nparts; p++)
+    started[p] = pthread_create(&threads[p], NULL, copy_part, &parts[p]) == 0;
+  copy_part(&parts[0]);
+  for (uint32_t p = 1; p < nparts; p++) {
+    if (started[p]) pthread_join(threads[p], NULL);
+    else copy_part(&parts[p]);
+  }
+
+  /* Then the old atoms' visibility bits, a block at a time. */
+  uint32_t k = 0, shift = 0;
+  for (Word_t r = 0; r < VECTOR_LEN(insvec); r += 3) {
+    uint32_t index = VECTOR_GET(insvec, r);
+    move_bits(weave.visible, k + shift, old.visible, k, index - k);
+    shift += VECTOR_GET(insvec, r + 1); k = index;
   }
+  move_bits(weave.visible, k + shift, old.visible, k, old.length - k);
+  finish_insvec(&weave, insvec, old.length);
 
-  free(old_ids_head); free(old_bodies_head);
+  if (old.version == NULL) {
+    free(old.ids); free(old.preds); free(old.chars);
+    free(old.visible); free(old.viscounts);
+  }
+  weave.version = NULL;
   return weave;
 }
 
-/* Take a weave and a vector of alternating index, chain* words, and insert
-   those atoms into the weave. You must explicitly tell this function how many
-   atoms will be inserted, so that it can allocate the right amount of
-   memory. Does not modify weft. */
+/* Take a weave and an insertion vector, and insert those atoms into the
+   weave. You must explicitly tell this function how many atoms will be
+   inserted, so that it can allocate the right amount of memory. Extends the
+   weft to cover the inserted atoms, keeps the position index and visibility
+   bitmap up to date, and rebuilds the visible position counts. The memodict
+   must already have the inserted atoms; see memoize_patch(). The
+   weave must not be mapped from a snapshot; call weave_thaw() first. A
+   published weave always gets new arrays, leaving the version's alone. */
 weave_t apply_insvec(weave_t weave, vector_t insvec, uint32_t atom_count) {
   /* Debugging: show insvec */
 /* #ifdef DEBUG */
@@ -161,305 +509,763 @@ weave_t apply_insvec(weave_t weave, vector_t insvec, uint32_t atom_count) {
 /*          YARN(pred), OFFSET(pred), (int)c); */
 /* #endif */
 
-  if (atom_count < weave.capacity)
-    return apply_insvec_inplace(weave, insvec, atom_count);
+  if (weave.length + atom_count <= weave.capacity && weave.version == NULL)
+    weave = apply_insvec_inplace(weave, insvec, atom_count);
   else
-    return apply_insvec_alloc(weave, insvec, atom_count);
+    weave = apply_insvec_alloc(weave, insvec, atom_count);
+  rebuild_viscounts(&weave);
+  return weave;
 }
 
 
-/************************** Predecessor lookup dicts **************************/
+/****************************** Applying patches ******************************/
+
+/* Patches are applied in batches. Finding where a chain goes takes a pass over
+   the weave, and inserting it takes a rewrite of everything after it, so
+   apply_patches() does each of these once for a whole batch of patches, rather
+   than once per patch.
+
+   While the batch is being worked out, the weave is left alone, and the chains
+   that will go into it are kept in a batch_t, by gap: gap i is right before
+   atom i of the weave, and has a list of the chains (or pieces of chains, if
+   a later patch splits them) that go there, in order. The weave as it will be
+   after the batch is the weave with these lists spliced in. A vpos_t is a
+   position in that weave, so chains can be placed after chains from earlier in
+   the same batch, or anchored inside them. */
+
+/* A position in the weave as it will be: the atom t of segment seg of gap
+   gap. If seg is past the last segment in the gap, it's atom gap of the weave
+   itself, and t is zero. */
+typedef struct {
+  Word_t gap;
+  Word_t seg;
+  Word_t t;
+} vpos_t;
 
-/* A predecessor lookup dict is one of two types of JudyL arrays. A deldict maps
-   from ids to deletion atoms. An insdict maps from ids to insrecs. An insrec
-   contains a pointer to a chain, and the chain length. These things are used in
-   the patch insertion process; constructed during a preprocessing phase and
-   then used during a one-pass traversal of the weave. */
+/* A chain placed by an earlier patch in the batch, for finding atoms in it. */
+typedef struct {
+  uint32_t *chain;
+  uint32_t len;
+  Word_t gap;
+} placed_chain_t;
 
-typedef Pvoid_t deldict_t;
-typedef Pvoid_t insdict_t;
+/* Where one chain or deletor of a patch goes. */
 typedef struct {
-  void *chain;
-  uint16_t len_atoms;
-} insrec_t;
-
-/* Insert a pointer to a thing into either an insdict or a deldict. The thing
-   should be either an atom (for deldicts) or an insrec (for insdicts). */
-int indeldict_insert(Pvoid_t *dict, uint64_t id, void *thing) {
-  Word_t index_outer; Word_t *pvalue_outer;
-  Word_t index_inner; Word_t *pvalue_inner;
-  Pvoid_t inner_judy;           /* Inner judy arrays */
-  Pvoid_t temp = *dict;
-
-  index_outer = YARN(id); JLI(pvalue_outer, temp, index_outer);
-  if (pvalue_outer == PJERR) return -1; /* malloc() error */
-  if (*pvalue_outer == 0) {
-    inner_judy = (Pvoid_t)NULL; index_inner = OFFSET(id);
+  vpos_t pos;                   /* Insertion point */
+  vpos_t anchor;                /* Position of its predecessor */
+  int deletor;                  /* Is this a deletor? */
+  uint32_t seq;                 /* Order it was found in */
+  uint32_t len;
+  uint32_t *chain;
+} placement_t;
+
+typedef struct {
+  weave_t *weave;
+  Pvoid_t anchors;              /* id -> 1 + index in weave */
+  Pvoid_t gaps;                 /* gap -> vector of (len, chain*) segments */
+  Pvoid_t placed;               /* id of chain head -> placed_chain_t* */
+  uint32_t atom_count;          /* Atoms in all the segments */
+} batch_t;
+
+/* Get the segment vector for a gap, or NULL if nothing goes there. */
+static inline vector_t batch_segments(batch_t *b, Word_t gap) {
+  Word_t *pvalue;
+  if (b->gaps == NULL) return NULL;
+  JLG(pvalue, b->gaps, gap);
+  return pvalue == NULL ? NULL : (vector_t)*pvalue;
+}
+
+/* How many segments are in a gap's vector? */
+#define SEGMENT_COUNT(segs) ((segs) == NULL ? 0 : VECTOR_LEN(segs) / 2)
+#define SEGMENT_LEN(segs, k)   VECTOR_GET(segs, 2*(k))
+#define SEGMENT_CHAIN(segs, k) ((uint32_t *)VECTOR_GET(segs, 2*(k) + 1))
+
+/* Look at the atom at a position. Returns FALSE past the end of the weave. */
+static int vpos_peek(batch_t *b, vpos_t *pos, uint64_t *id, uint64_t *pred,
+                     uint32_t *c) {
+  vector_t segs = batch_segments(b, pos->gap);
+  if (pos->seg < SEGMENT_COUNT(segs)) {
+    uint32_t *atom = SEGMENT_CHAIN(segs, pos->seg) + 5 * pos->t;
+    READ_ATOM_SEQ(*id, *pred, *c, atom);
+    return TRUE;
+  }
+  if (pos->gap >= b->weave->length) return FALSE;
+  READ_ATOM_IDX(*id, *pred, *c, b->weave->ids, b->weave->preds, b->weave->chars,
+                pos->gap);
+  return TRUE;
+}
+
+/* Move a position to the next atom. */
+static void vpos_advance(batch_t *b, vpos_t *pos) {
+  vector_t segs = batch_segments(b, pos->gap);
+  if (pos->seg < SEGMENT_COUNT(segs)) {
+    if (++pos->t == SEGMENT_LEN(segs, pos->seg)) { pos->seg++; pos->t = 0; }
   } else {
-    inner_judy = (Pvoid_t)*pvalue_outer; index_inner = OFFSET(id);
-  }
-
-  JLI(pvalue_inner, inner_judy, index_inner);
-  if (pvalue_inner == PJERR) return -1; /* malloc() error */
-  *pvalue_inner = (Word_t)thing;
-  *pvalue_outer = (Word_t)inner_judy;
-  *dict = temp; return 0;
-}
-
-/* Get the thing corresponding to the given id in an insdict or deldict. Returns
-   NULL if nothing was found corresponding to that id. */
-void *indeldict_get(Pvoid_t dict, uint64_t id) {
-  Word_t index_outer; Word_t *pvalue_outer;
-  Word_t index_inner; Word_t *pvalue_inner;
-  Pvoid_t inner_judy;
-
-  /* Look up the yarn */
-  if (dict == NULL) return NULL; /* common case: empty set */
-  index_outer = YARN(id); JLG(pvalue_outer, dict, index_outer);
-  if (pvalue_outer == PJERR) return NULL; /* malloc() error */
-  if (pvalue_outer == NULL) return NULL;  /* yarn not found */
-  
-  /* Yarn found. Look up the offset. */
-  inner_judy = (Pvoid_t)*pvalue_outer; index_inner = OFFSET(id);
-  JLG(pvalue_inner, inner_judy, index_inner);
-  if (pvalue_inner == PJERR) return NULL; /* malloc() error */
-  if (pvalue_inner == NULL) return NULL;  /* offset not found */
-  
-  /* Id found. Return thing. */
-  return (void *)*pvalue_inner;
-}
-
-/* Delete an insdict, de-allocating all insrecs in it. */
-void delete_insdict(insdict_t insdict) {
-  Word_t index_outer; Word_t *pvalue_outer;
-  Word_t index_inner; Word_t *pvalue_inner;
-  Pvoid_t inner_judy; Word_t rc_word;
-
-  /* Traverse the outer JudyL */
-  index_outer = 0;
-  JLF(pvalue_outer, insdict, index_outer);
-  while (pvalue_outer != NULL) {
-    inner_judy = (Pvoid_t)*pvalue_outer;
-    /* Traverse the inner JudyL, freeing insrecs */
-    index_inner = 0;
-    JLF(pvalue_inner, inner_judy, index_inner);
-    while (pvalue_inner != NULL) {
-      free((void *)*pvalue_inner);
-      JLN(pvalue_inner, inner_judy, index_inner);
+    pos->gap++; pos->seg = 0; pos->t = 0;
+  }
+}
+
+/* Compare two positions, returning <0, 0 or >0. */
+static inline int vpos_cmp(vpos_t *a, vpos_t *b) {
+  if (a->gap != b->gap) return a->gap < b->gap ? -1 : 1;
+  if (a->seg != b->seg) return a->seg < b->seg ? -1 : 1;
+  if (a->t != b->t) return a->t < b->t ? -1 : 1;
+  return 0;
+}
+
+/* Find the position of an atom, which must be in the weave or in a chain
+   placed earlier in the batch. Returns 0 on success, 1 if it's in neither. */
+static int batch_find(batch_t *b, uint64_t id, vpos_t *pos) {
+  Word_t *pvalue; Word_t index = id;
+
+  /* In the weave? */
+  JLG(pvalue, b->anchors, index);
+  if (pvalue != NULL && *pvalue != 0) {
+    pos->gap = *pvalue - 1; pos->seg = SEGMENT_COUNT(batch_segments(b, pos->gap));
+    pos->t = 0; return 0;
+  }
+
+  /* In a placed chain? Find the chain, then the segment holding the atom. */
+  JLL(pvalue, b->placed, index);
+  if (pvalue == NULL) return 1;
+  placed_chain_t *pc = (placed_chain_t *)*pvalue;
+  if (YARN(index) != YARN(id) || OFFSET(id) - OFFSET(index) >= pc->len) return 1;
+  uint32_t *atom = pc->chain + 5 * (OFFSET(id) - OFFSET(index));
+  vector_t segs = batch_segments(b, pc->gap);
+  for (Word_t k = 0; k < SEGMENT_COUNT(segs); k++) {
+    uint32_t *chain = SEGMENT_CHAIN(segs, k);
+    if (atom >= chain && atom < chain + 5 * SEGMENT_LEN(segs, k)) {
+      pos->gap = pc->gap; pos->seg = k; pos->t = (atom - chain) / 5;
+      return 0;
     }
-    /* Free the inner JudyL, and proceed to the next one */
-    JLFA(rc_word, inner_judy);
-    JLN(pvalue_outer, insdict, index_outer);
   }
-  JLFA(rc_word, insdict);
+  return 1;
 }
 
-/* Delete a deldict. */
-void delete_deldict(deldict_t deldict) {
-  Word_t index_outer; Word_t *pvalue_outer;
-  Pvoid_t inner_judy; Word_t rc_word;
+/* Find where an insertion chain goes, starting from the position right after
+   its anchor. Skip the anchor's deletors, then step over the causal blocks of
+   any siblings that the chain's head doesn't know about and that sort after
+   it. Returns 0 on success, leaving the insertion point in *pos, 1 if there's
+   nowhere for it to go, or -1 on malloc() failure. */
+static int batch_walk(batch_t *b, vpos_t *pos, uint64_t id_head, uint64_t pred_head) {
+  uint64_t id_neighbor, p; uint32_t c;
+  memodict_t memodict = b->weave->memodict;
+
+  /* Skip past any deletor atoms. */
+  while (vpos_peek(b, pos, &id_neighbor, &p, &c) && c == ATOM_CHAR_DEL)
+    vpos_advance(b, pos);
+
+  /* Pull the awareness weft of the chain's head. */
+  weft_t head_weft = pull(memodict, id_head, pred_head);
+  if (head_weft == ERRWEFT) return -1;
+
+  while (vpos_peek(b, pos, &id_neighbor, &p, &c)) {
+    /* Peek at right neighbor. If we're aware of it, insert chain here. */
+    if (weft_covers(head_weft, id_neighbor)) {
+      weft_release(head_weft); return 0;
+    }
+
+    /* We must insert in weft order. If my weft is greater than that of the
+       atom to my right, which I shall call r, insert me here. */
+    uint64_t rid = id_neighbor;
+    weft_t r_weft = pull(memodict, rid, 0);
+    if (weft_gt(head_weft, r_weft)) {
+      weft_release(head_weft); weft_release(r_weft); return 0;
+    }
 
-  /* Traverse the outer JudyL */
-  index_outer = 0;
-  JLF(pvalue_outer, deldict, index_outer);
-  while (pvalue_outer != NULL) {
-    inner_judy = (Pvoid_t)*pvalue_outer;
-    JLFA(rc_word, inner_judy);
-    JLN(pvalue_outer, deldict, index_outer);
+    /* Step past the causal block of r, and try looking at the new right
+       neighbor on the next iteration of this loop. The block ends at the
+       first atom whose predecessor p is not r, and where r is aware of p. If
+       we come to the end, we will run into the end atom sentinel, which will
+       stop the iteration and give us our insertion point. */
+    vpos_advance(b, pos);
+    while (vpos_peek(b, pos, &id_neighbor, &p, &c) &&
+           !(p != rid && weft_covers(r_weft, p)))
+      vpos_advance(b, pos);
+    weft_release(r_weft);
   }
-  JLFA(rc_word, deldict);
+
+  weft_release(head_weft);
+  return 1;                     /* Ran off the end; shouldn't happen */
 }
 
-/* Allocate an insrec with a given chain and number of atoms in the chain. Has no
-   overhead over making it manually. Must be freed by the user. */
-static inline insrec_t *make_insrec(void *chain, uint16_t len_atoms) {
-  insrec_t *insrec = malloc(sizeof(insrec_t));
-  insrec->chain = chain; insrec->len_atoms = len_atoms;
-  return insrec;
+/* Order placements by insertion point. Deletors go right after the atoms they
+   delete, so they come first; after that, it's the order their anchors are in,
+   and then the order they were found in. */
+static int placement_cmp(const void *a, const void *b) {
+  placement_t *pa = (placement_t *)a, *pb = (placement_t *)b;
+  int cmp = vpos_cmp(&pa->pos, &pb->pos);
+  if (cmp != 0) return cmp;
+  if (pa->deletor != pb->deletor) return pa->deletor ? -1 : 1;
+  cmp = vpos_cmp(&pa->anchor, &pb->anchor);
+  if (cmp != 0) return cmp;
+  return pa->seq < pb->seq ? -1 : 1;
 }
 
+/* Insert a segment into a gap's vector at index k. */
+static int batch_insert_segment(batch_t *b, Word_t gap, Word_t k, Word_t len,
+                                uint32_t *chain) {
+  Word_t *pvalue;
+  JLI(pvalue, b->gaps, gap);
+  if (pvalue == PJERR) return -1; /* malloc() error */
+  vector_t segs = *pvalue == 0 ? new_vector() : (vector_t)*pvalue;
+  segs = vector_append(segs, 0); segs = vector_append(segs, 0);
+  if (segs == NULL) return -1;
+  Word_t *recs = segs + 2;
+  memmove(recs + 2*k + 2, recs + 2*k, (VECTOR_LEN(segs) - 2 - 2*k) * sizeof(Word_t));
+  recs[2*k] = len; recs[2*k + 1] = (Word_t)chain;
+  *pvalue = (Word_t)segs;
+  return 0;
+}
 
-/************************ Making insdicts and deldicts ************************/
+/* Put a chain into the batch at a position, splitting the segment there if the
+   position is in the middle of one. Returns the gap the chain went into, or -1
+   on malloc() failure. */
+static Word_t batch_place(batch_t *b, vpos_t *pos, uint32_t len, uint32_t *chain) {
+  Word_t k = pos->seg;
+  if (pos->t > 0) {
+    vector_t segs = batch_segments(b, pos->gap);
+    Word_t seg_len = SEGMENT_LEN(segs, k);
+    uint32_t *seg_chain = SEGMENT_CHAIN(segs, k);
+    k++;
+    if (pos->t < seg_len) {
+      SEGMENT_LEN(segs, k - 1) = pos->t;
+      if (batch_insert_segment(b, pos->gap, k, seg_len - pos->t,
+                               seg_chain + 5 * pos->t) != 0) return -1;
+    }
+  }
+  if (batch_insert_segment(b, pos->gap, k, len, chain) != 0) return -1;
+  b->atom_count += len;
+  return pos->gap;
+}
 
-/* Take a patch that we've previously verified is ready to apply, and make the
-   insdict and deldict for it. Takes pointers to an insdict and a deldict, which
-   should initially be empty, and modifies them. Returns 0 on success.
+/* Work out where all the chains of a ready patch go, and put them in the
+   batch. Returns 0 on success, 1 if the patch can never be placed, since an
+   atom it needs isn't anywhere, or -1 on malloc() failure. */
+static int batch_add_patch(batch_t *b, patch_t patch) {
+  uint32_t *p32; void *ptr = patch;
+  uint32_t length_bytes, n = 0; uint8_t chain_count;
+  uint64_t id, pred; uint32_t c;
+  int rc = 0;
 
-   How this works is, it goes through all the chains in the patch. For insertion
-   chains, it creates an insrec and inserts that into insdict. For deletion
-   chains, it iterates through all the atoms and adds each one to the deldict.
-*/
-int make_indeldict(patch_t patch, insdict_t *insdict, deldict_t *deldict, 
-                   weave_t *weave) {
-  uint32_t *p32 = patch; void *ptr = patch;
-  uint32_t length_bytes; uint8_t chain_count;
-  READ_PATCH_HEADER(length_bytes, chain_count, ptr); p32 = ptr;
-  uint16_t *chain_lengths = malloc(chain_count * sizeof(uint16_t));
+  LIFTERR(memoize_patch(&b->weave->memodict, patch));
 
-  /* Read chain lengths */
+  placement_t *places = malloc(patch_length_atoms(patch) * sizeof(placement_t));
+  if (places == NULL) return -1;
+  READ_PATCH_HEADER(length_bytes, chain_count, ptr);
+  uint16_t chain_lengths[256];
   for (uint32_t chain = 0; chain < chain_count; chain++) {
-    uint16_t len_atoms = 0; uint32_t offset = 0;
-    READ_CHAIN_DESCRIPTOR(offset, len_atoms, p32);
-    chain_lengths[chain] = len_atoms;
+    uint32_t offset;
+    READ_CHAIN_DESCRIPTOR(offset, chain_lengths[chain], ptr);
   }
+  p32 = ptr;
 
-  /* Process each chain */
-  for (uint32_t chain = 0; chain < chain_count; chain++) {
-    uint64_t id, pred; uint32_t c;
+  /* Find the insertion point of each chain, or of each deletor. */
+  for (uint32_t chain = 0; chain < chain_count && rc == 0; chain++) {
+    uint32_t *head = p32;
     READ_ATOM_SEQ(id, pred, c, p32); p32 -= 5; /* peek */
-    //    printf("$ Processing patch atom: (%u,%u),\t(%u,%u),\t%X\n",
-    //           YARN(id), OFFSET(id), YARN(pred), OFFSET(pred), (int)c);
     if (c == ATOM_CHAR_DEL) {
-      /* Deletion chain. Add deletors to deldict. */
-      for (uint16_t i = chain_lengths[chain]; i > 0; i--) {
+      for (uint16_t i = chain_lengths[chain]; i > 0 && rc == 0; i--) {
+        placement_t *pl = &places[n];
+        pl->chain = p32; pl->len = 1; pl->deletor = TRUE; pl->seq = n;
         READ_ATOM_SEQ(id, pred, c, p32);
-        LIFTERR(indeldict_insert(deldict, pred, (void*)(p32 - 5)));
-        if (YARN(id) != YARN(pred))
-          memodict_add(&(weave->memodict), id, pull(weave->memodict, id, pred));
+        rc = batch_find(b, pred, &pl->anchor);
+        /* An atom the weft covers but that isn't here was deleted and
+           compacted away (see weave_compact()), so deleting it again is a
+           no-op, and the deletor goes the same way. */
+        if (rc != 0 && weft_covers(b->weave->weft, pred)) { rc = 0; continue; }
+        pl->pos = pl->anchor; vpos_advance(b, &pl->pos);
+        n++;
       }
       continue;
-    } else if (c == ATOM_CHAR_SAVE) {
-      /* Save-awareness chain. Add to insrec for end atom. */
-      LIFTERR(indeldict_insert(insdict, PACK_ID(0,2),
-                               (void*)make_insrec((void*)p32, chain_lengths[chain])));
+    }
+
+    placement_t *pl = &places[n];
+    pl->chain = head; pl->len = chain_lengths[chain]; pl->deletor = FALSE;
+    pl->seq = n++;
+    if (c == ATOM_CHAR_SAVE) {
+      /* Save-awareness chains go right after the end atom. */
+      rc = batch_find(b, PACK_ID(0,2), &pl->anchor);
+      pl->pos = pl->anchor; vpos_advance(b, &pl->pos);
     } else {
-      /* Regular insertion chain. Create insrec and add to insdict. */
-      LIFTERR(indeldict_insert(insdict, pred,
-                               (void*)make_insrec((void*)p32, chain_lengths[chain])));
+      rc = batch_find(b, pred, &pl->anchor);
+      pl->pos = pl->anchor; vpos_advance(b, &pl->pos);
+      if (rc == 0) rc = batch_walk(b, &pl->pos, id, pred);
     }
-    for (uint16_t i = chain_lengths[chain]; i > 0; i--) {
+    p32 += 5 * chain_lengths[chain];
+  }
+
+  /* Insert them back to front, so that splitting segments doesn't move the
+     insertion points we haven't got to yet. */
+  if (rc == 0) qsort(places, n, sizeof(placement_t), placement_cmp);
+  for (uint32_t i = n; i > 0 && rc == 0; i--) {
+    placement_t *pl = &places[i - 1];
+    Word_t gap = batch_place(b, &pl->pos, pl->len, pl->chain);
+    if (gap == (Word_t)-1) { rc = -1; break; }
+    if (pl->deletor) continue;
+
+    /* Remember where the chain went, in case later patches anchor on it. */
+    placed_chain_t *pc = malloc(sizeof(placed_chain_t));
+    Word_t *pvalue;
+    if (pc == NULL) { rc = -1; break; }
+    pc->chain = pl->chain; pc->len = pl->len; pc->gap = gap;
+    JLI(pvalue, b->placed, *(uint64_t *)pl->chain);
+    if (pvalue == PJERR) { free(pc); rc = -1; break; }
+    *pvalue = (Word_t)pc;
+  }
+  free(places);
+  return rc;
+}
+
+/* Free everything in a batch. Doesn't touch the weave. */
+static void delete_batch(batch_t *b) {
+  Word_t index, rc_word; Word_t *pvalue;
+  index = 0; JLF(pvalue, b->gaps, index);
+  while (pvalue != NULL) {
+    free((void *)*pvalue);
+    JLN(pvalue, b->gaps, index);
+  }
+  index = 0; JLF(pvalue, b->placed, index);
+  while (pvalue != NULL) {
+    free((void *)*pvalue);
+    JLN(pvalue, b->placed, index);
+  }
+  JLFA(rc_word, b->gaps); JLFA(rc_word, b->placed); JLFA(rc_word, b->anchors);
+}
+
+/* Add every id that a patch's chains could be anchored on to a JudyL array,
+   with a value of 0. */
+static int collect_anchors(Pvoid_t *anchors, patch_t patch) {
+  uint32_t *p32; void *ptr = patch;
+  uint32_t length_bytes; uint8_t chain_count;
+  uint64_t id, pred; uint32_t c;
+  Word_t *pvalue;
+
+  READ_PATCH_HEADER(length_bytes, chain_count, ptr);
+  uint16_t chain_lengths[256];
+  for (uint32_t chain = 0; chain < chain_count; chain++) {
+    uint32_t offset;
+    READ_CHAIN_DESCRIPTOR(offset, chain_lengths[chain], ptr);
+  }
+  p32 = ptr;
+
+  for (uint32_t chain = 0; chain < chain_count; chain++) {
+    for (uint16_t i = 0; i < chain_lengths[chain]; i++) {
       READ_ATOM_SEQ(id, pred, c, p32);
-      if (YARN(id) != YARN(pred))
-        memodict_add(&(weave->memodict), id, pull(weave->memodict, id, pred));
+      if (c == ATOM_CHAR_SAVE) pred = PACK_ID(0,2);
+      else if (i > 0 && c != ATOM_CHAR_DEL) continue;
+      JLI(pvalue, *anchors, (Word_t)pred);
+      if (pvalue == PJERR) return -1; /* malloc() error */
     }
   }
-  free(chain_lengths);
   return 0;
 }
 
-/****************************** Applying patches ******************************/
+/* Weaves with at least this many atoms per thread are scanned for anchors by
+   more than one thread, up to SCAN_MAX_THREADS of them. */
+#ifndef SCAN_ATOMS_PER_THREAD
+#define SCAN_ATOMS_PER_THREAD (1 << 18)
+#endif
+#ifndef SCAN_MAX_THREADS
+#define SCAN_MAX_THREADS 8
+#endif
+
+/* One thread's share of an anchor scan: the atoms from..to-1 of the weave. */
+typedef struct {
+  const uint64_t *ids;
+  Pvoid_t anchors;
+  uint32_t from, to;
+  vector_t found;               /* (pvalue, 1 + index) pairs, in weave order */
+} scan_part_t;
+
+/* Look up every atom in a part of the weave among the anchors. Only reads
+   the anchors; what it finds goes in the part's own vector. */
+static void *scan_part(void *arg) {
+  scan_part_t *part = arg;
+  Word_t *pvalue;
+  for (uint32_t i = part->from; i < part->to; i++) {
+    JLG(pvalue, part->anchors, (Word_t)part->ids[i]);
+    if (pvalue != NULL) {
+      part->found = vector_append(part->found, (Word_t)pvalue);
+      part->found = vector_append(part->found, i + 1);
+    }
+  }
+  return NULL;
+}
+
+/* Find the index of every anchor in the weave, by scanning it. A big weave is
+   cut into contiguous parts scanned at the same time, each by its own thread,
+   and then what they found is written into the anchors in weave order. Each
+   id is in the weave at most once, so the parts never find the same anchor.
+   If a thread can't be started, its part gets scanned on this one. */
+static void scan_anchors(weave_t *weave, Pvoid_t anchors) {
+  scan_part_t parts[SCAN_MAX_THREADS];
+  pthread_t threads[SCAN_MAX_THREADS];
+  int started[SCAN_MAX_THREADS];
+  uint32_t nparts = thread_count(weave->length, SCAN_ATOMS_PER_THREAD,
+                                 SCAN_MAX_THREADS);
+
+  for (uint32_t k = 0; k < nparts; k++) {
+    parts[k].ids = weave->ids; parts[k].anchors = anchors;
+    parts[k].from = (uint64_t)weave->length * k / nparts;
+    parts[k].to = (uint64_t)weave->length * (k + 1) / nparts;
+    parts[k].found = new_vector();
+  }
+
+  /* Scan the first part here, and the others on threads of their own. */
+  for (uint32_t k = 1; k < nparts; k++)
+    started[k] = pthread_create(&threads[k], NULL, scan_part, &parts[k]) == 0;
+  scan_part(&parts[0]);
+  for (uint32_t k = 1; k < nparts; k++) {
+    if (started[k]) pthread_join(threads[k], NULL);
+    else scan_part(&parts[k]);
+  }
+
+  for (uint32_t k = 0; k < nparts; k++) {
+    vector_t found = parts[k].found;
+    for (Word_t r = 0; r < VECTOR_LEN(found); r += 2)
+      *(Word_t *)VECTOR_GET(found, r) = VECTOR_GET(found, r + 1);
+    free(found);
+  }
+}
+
+/* Put the patches a failed batch didn't get to back in the waiting set, to be
+   tried again, each blocking on the id it's waiting for, or on the one before
+   its first atom if it's ready. Patches that are parked are set to NULL in the
+   array; the rest stay the caller's. */
+static void park_rest(weave_t *weave, patch_t *patches, int n) {
+  for (int i = 0; i < n; i++) {
+    if (patches[i] == NULL) continue;
+    uint64_t blocking_id = patch_blocking_id(patches[i], weave->weft);
+    if (blocking_id == 1) continue; /* already applied */
+    if (blocking_id == 0) {
+      uint64_t first_id = *(uint64_t *)patch_atoms(patches[i]);
+      blocking_id = PACK_ID(YARN(first_id), OFFSET(first_id) - 1);
+    }
+    if (waitset_park(&weave->wset, blocking_id, patches[i]) == 0)
+      patches[i] = NULL;
+  }
+}
+
+/* Apply a batch of patches to a weave, in order. Patches that aren't ready go
+   in the waiting set, and duplicates are dropped. If owned is true, the
+   patches were allocated with malloc(), and the ones that go in the waiting
+   set are handed over to it rather than copied, and set to NULL in the
+   array.
+
+   However many patches there are, this makes one pass over the weave to find
+   the atoms they're anchored on, and then rewrites the weave once. If the weave
+   has a position index, there's no pass; the anchors are looked up in it. On a
+   big weave, the pass is split between threads (see scan_anchors()), but
+   working out where chains go after that is done here, on the whole weave, so
+   nothing cares where the parts began and ended.
+
+   If a patch can't be placed, the batch stops there, but the patches before it
+   are still spliced in, since they're already in the weft and the memodict;
+   whatever the failed patch had placed is left out. The patches after it are
+   left alone, or, if owned is true, put back in the waiting set, along with
+   the failed patch itself, unless it can never be placed. */
+static int apply_batch(weave_t *weave, patch_t *patches, int n, int owned) {
+  batch_t b = { weave, NULL, NULL, NULL, 0 };
+  Word_t *pvalue;
+  patch_t failed = NULL;        /* The patch the batch stopped on, if any */
+  int i = 0, rest = 0, rc = 0;
+
+  if (weave_thaw(weave) != 0) return -1;
+
+  /* Find the indices of everything in the weave that might be an anchor,
+     either from the position index or by scanning the weave. */
+  for (int j = 0; j < n && rc == 0; j++)
+    rc = collect_anchors(&b.anchors, patches[j]);
+  if (weave->posindex != NULL) {
+    Word_t index = 0;
+    JLF(pvalue, b.anchors, index);
+    while (pvalue != NULL) {
+      uint32_t pos = posindex_get(weave->posindex, (uint64_t)index);
+      if (pos != POSINDEX_NONE) *pvalue = pos + 1;
+      JLN(pvalue, b.anchors, index);
+    }
+  } else if (rc == 0) {
+    scan_anchors(weave, b.anchors);
+  }
+
+  /* Work out where everything goes, a patch at a time. The weft is updated as
+     we go, so that later patches can build on earlier ones. */
+  for (; i < n && rc == 0; i++) {
+    uint64_t blocking_id = patch_blocking_id(patches[i], weave->weft);
+    rest = i;
+    if (blocking_id == 1) continue; /* already applied */
+    if (blocking_id != 0 && owned) {
+      rc = waitset_park(&weave->wset, blocking_id, patches[i]);
+      if (rc == 0) patches[i] = NULL;
+    } else if (blocking_id != 0) {
+      rc = add_to_waitset(&weave->wset, blocking_id, patches[i]);
+    } else {
+      uint64_t high_id = patch_highest_id(patches[i]);
+      rc = batch_add_patch(&b, patches[i]);
+      if (rc == 0)
+        rc = weft_extend(&weave->weft, YARN(high_id), OFFSET(high_id));
+      if (rc != 0) failed = patches[i];
+      if (rc > 0) { rest = i + 1; rc = -1; } /* dropped for good */
+    }
+  }
+
+  /* Splice all the chains into the weave at once, leaving out any that belong
+     to the failed patch. */
+  if (b.atom_count > 0) {
+    vector_t insvec = new_vector();
+    uint32_t atom_count = 0;
+    uint8_t *failed_start = (uint8_t *)failed;
+    uint8_t *failed_end = failed == NULL ? NULL :
+      failed_start + patch_length_bytes(failed);
+    Word_t gap = 0;
+    JLF(pvalue, b.gaps, gap);
+    while (pvalue != NULL) {
+      vector_t segs = (vector_t)*pvalue;
+      for (Word_t k = 0; k < SEGMENT_COUNT(segs); k++) {
+        uint8_t *chain = (uint8_t *)SEGMENT_CHAIN(segs, k);
+        if (chain >= failed_start && chain < failed_end) continue;
+        insvec = vector_append(insvec, gap);
+        insvec = vector_append(insvec, SEGMENT_LEN(segs, k));
+        insvec = vector_append(insvec, (Word_t)chain);
+        atom_count += SEGMENT_LEN(segs, k);
+      }
+      JLN(pvalue, b.gaps, gap);
+    }
+    /* The text view needs to know what was visible before. */
+    uint8_t *was_visible = NULL;
+    if (weave->textview != NULL && atom_count > 0) {
+      was_visible = malloc(VECTOR_LEN(insvec) / 3);
+      if (was_visible == NULL) {
+        delete_textview(weave->textview); weave->textview = NULL;
+      }
+      for (Word_t r = 0; was_visible != NULL && r < VECTOR_LEN(insvec); r += 3)
+        was_visible[r / 3] = IS_VISIBLE(weave, VECTOR_GET(insvec, r) - 1);
+    }
+    if (atom_count > 0) *weave = apply_insvec(*weave, insvec, atom_count);
+    if (was_visible != NULL) update_textview(weave, insvec, was_visible);
+    free(was_visible); free(insvec);
+  }
+
+  if (rc != 0 && owned) park_rest(weave, patches + rest, n - rest);
+  delete_batch(&b);
+  return rc;
+}
+
+/* Apply a batch of patches to a weave, in order, modifying the weave. Takes a
+   pointer to the weave, so it can modify it. Returns 0 on success. Does not
+   check patch validity.
+
+   Patches may depend on earlier patches in the batch. A patch that isn't ready
+   when its turn comes is put in the waiting set, under the id it's blocking
+   on, and a patch that's already in the weave is ignored. This doesn't go
+   through the waiting set afterward; apply_and_drain() does that. If a patch
+   can't be applied, the ones before it still are, and the ones after it
+   aren't, and -1 is returned.
+
+   If the weave has a text view, it's updated, and its events are the changes
+   made by this batch. */
+int apply_patches(weave_t *weave, patch_t *patches, int n) {
+  if (weave->textview != NULL) textview_clear_events(weave->textview);
+  return apply_batch(weave, patches, n, FALSE);
+}
+
+/* Apply every waiting patch whose blocking id the weft now covers, and then
+   everything that unblocks, and so on, until nothing more can be applied.
+   Each round of woken patches is sorted by yarn and offset, so that patches
+   from the same yarn land in sequence, and applied as one batch; anything
+   that's still blocked goes back in the waiting set without being copied. If
+   a round fails, whatever it didn't apply goes back too, to be tried on the
+   next drain, except a patch that can never be placed. */
+static int drain_waitset(weave_t *weave) {
+  vector_t woken;
+  int rc = 0;
+
+  while (rc == 0 &&
+         (woken = waitset_take_covered(&weave->wset, weave->weft)) != NULL) {
+    patch_t *patches = (patch_t *)&VECTOR_GET(woken, 0);
+    rc = apply_batch(weave, patches, VECTOR_LEN(woken), TRUE);
+    for (Word_t i = 0; i < VECTOR_LEN(woken); i++) free(patches[i]);
+    free(woken);
+  }
+  return rc;
+}
+
+/* Apply a batch of patches to a weave, like apply_patches(), and then apply
+   any waiting patches that they unblock, and whatever those unblock, until
+   there's nothing left that can be applied. Returns 0 on success. If the weave
+   has a text view, its events are the changes made by the whole call. */
+int apply_and_drain(weave_t *weave, patch_t *patches, int n) {
+  if (weave->textview != NULL) textview_clear_events(weave->textview);
+  int rc = apply_batch(weave, patches, n, FALSE);
+  if (rc == 0) rc = drain_waitset(weave);
+  return rc;
+}
 
 /* Apply a patch to a weave, modifying the weave. Takes a pointer to the weave,
    so it can modify it. Returns 0 on success. Does not check patch validity.
-
-   This may just put the patch in the waiting set, and it will not go through
-   the waiting set after applying the patch to try to pull out waiting patches,
-   so that's all up to the client code. */
+   A patch that isn't ready goes in the waiting set, and anything the patch
+   unblocks is applied along with it, as with apply_and_drain(). */
 int apply_patch(weave_t *weave, patch_t patch) {
-  /* Check if the patch is ready to insert. If not, block. */
-  if (patch_blocking_id(patch, weave->weft) != 0) {
-    uint64_t id = patch_blocking_id(patch, weave->weft);
-    printf("blocking on (%u,%u)\n", YARN(id), OFFSET(id));
-    add_to_waitset(&weave->wset, patch);
-    return 0;
-  }
-
-  /* Build insdict and deldict */
-  insdict_t insdict = NULL; deldict_t deldict = NULL;
-  LIFTERR(make_indeldict(patch, &insdict, &deldict, weave));
-  //print_judyl2(insdict);
-
-  /* Iterate through the weave, looking at each atom to see if it's an anchor
-     for anything in the insdict or deldict. If so, add that to an insertion
-     vector. */
-  vector_t insvec = new_vector();
-  uint64_t id, pred; uint32_t c;
-  uint64_t *ids = weave->ids; uint32_t *bodies = weave->bodies;
+  return apply_and_drain(weave, &patch, 1);
+}
 
-  for (uint32_t i = 0; i < weave->length; i++) {
-    READ_ATOM(id, pred, c, ids, bodies);
-    
-    /* Check deldict */
-    void *delatom = indeldict_get(deldict, id);
-    if (delatom != NULL) {
-      insvec = vector_append(insvec, (Word_t)i+1);
-      insvec = vector_append(insvec, 1);
-      insvec = vector_append(insvec, (Word_t)delatom);
-      continue;
+
+/********************************* Compaction *********************************/
+
+/* A deleted atom stays in the weave forever, along with its deletors, in case
+   some patch that hasn't arrived yet is anchored on it or has to be placed
+   around it. Once every replica has seen an atom and its deletors, and every
+   patch still to come is aware of them, neither can happen: a new chain whose
+   walk reaches the atom stops there, since it knows about it, and stops in
+   the same place if the atom is gone, as long as nothing is anchored on it.
+   So compaction takes a stable weft, and removes deleted atoms that have no
+   children left, and whose deletors are covered by it. Save-awareness atoms,
+   which sit after the end atom where no walk goes, are removed the same way;
+   the awareness they stand for is in the memodict.
+
+   Memodict entries are only ever looked up for atoms still in the weave and
+   atoms still to come, so an entry is dropped if the yarn has no atoms left
+   that would find it, and a later entry in the yarn is still at or below the
+   stable weft, for new atoms to find instead. */
+
+/* Add the anchors of a waiting patch to a JudyL array; called by
+   waitset_foreach(). */
+static int collect_waiting_anchors(uint64_t blocking_id, patch_t patch,
+                                   void *anchors) {
+  return collect_anchors((Pvoid_t *)anchors, patch);
+}
+
+/* Drop the memodict entries that nothing will look up any more. This
+   rebuilds the memodict from the entries that are left, since that works the
+   same for every representation. Returns 0 on success, -1 on malloc()
+   failure, in which case the memodict is unchanged. */
+static int prune_memodict(weave_t *weave, weft_t stable) {
+  Pvoid_t needed = (Pvoid_t)NULL; /* entry id -> whether it's needed */
+  Word_t *pvalue, index; Word_t rc_word;
+  memodict_t pruned = new_memodict();
+  uint64_t id; Word_t dropped = 0;
+  int rc = 0;
+
+  /* Entries above the stable weft are for atoms that may not be everywhere
+     yet, and are kept. */
+  for (id = 0; rc == 0 && memodict_next(weave->memodict, &id); id++) {
+    JLI(pvalue, needed, (Word_t)id);
+    if (pvalue == PJERR) rc = -1;
+    else *pvalue = OFFSET(id) > weft_get(stable, YARN(id));
+  }
+
+  /* So is the last one at or below it in each yarn, which new atoms in the
+     yarn will find, and the one each atom in the weave finds. */
+  index = 0; JLF(pvalue, needed, index);
+  while (rc == 0 && pvalue != NULL) {
+    uint32_t yarn = YARN(index);
+    Word_t last = PACK_ID(yarn, weft_get(stable, yarn));
+    JLL(pvalue, needed, last);
+    if (pvalue != NULL && YARN(last) == yarn) *pvalue = 1;
+    index = PACK_ID(yarn + 1, 0);
+    if (yarn == 0xFFFFFFFF) break;
+    JLF(pvalue, needed, index);
+  }
+  for (uint32_t i = 0; rc == 0 && i < weave->length; i++) {
+    index = weave->ids[i];
+    JLL(pvalue, needed, index);
+    if (pvalue != NULL && YARN(index) == YARN(weave->ids[i])) *pvalue = 1;
+  }
+
+  index = 0; JLF(pvalue, needed, index);
+  while (pvalue != NULL) {
+    if (*pvalue == 0) dropped++;
+    JLN(pvalue, needed, index);
+  }
+
+  /* Rebuild the memodict without the rest. */
+  index = 0; JLF(pvalue, needed, index);
+  while (rc == 0 && dropped > 0 && pvalue != NULL) {
+    if (*pvalue != 0) {
+      weft_t weft = memodict_get(weave->memodict, index);
+      if (weft == ERRWEFT) rc = -1;
+      else rc = memodict_add(&pruned, index, weft);
     }
-    /* Check insdict */
-    insrec_t *insrec = indeldict_get(insdict, id);
-    if (insrec != NULL) {
-      /* Easy insertion: save-awareness chains */
-      uint32_t *irptr = insrec->chain;
-      uint64_t id_head, pred_head; uint32_t c_head;
-      READ_ATOM_SEQ(id_head, pred_head, c_head, irptr);
-      if (c_head == ATOM_CHAR_SAVE) {
-        //printf("+ Saving awareness\n");
-        insvec = vector_append(insvec, (Word_t)i+1);
-        insvec = vector_append(insvec, (Word_t)insrec->len_atoms);
-        insvec = vector_append(insvec, (Word_t)insrec->chain);
-        goto cont;
-      }
+    JLN(pvalue, needed, index);
+  }
+  if (rc == 0 && dropped > 0) {
+    delete_memodict(weave->memodict);
+    weave->memodict = pruned;
+  } else {
+    delete_memodict(pruned);
+  }
+  JLFA(rc_word, needed);
+  return rc;
+}
 
-      /* Begin local subtraversal */
-      uint64_t *ids_local = ids; uint32_t *bodies_local = bodies;
-
-      /* Skip past any deletor atoms, and put cursor after them. */
-      uint64_t id_neighbor, pred_neighbor; uint32_t c_neighbor;
-      do {
-        READ_ATOM(id_neighbor, pred_neighbor, c_neighbor, ids_local, bodies_local);
-      } while (c_neighbor == ATOM_CHAR_DEL);
-      ids_local--; bodies_local -= 3;
-
-      /* Pull the awareness weft of the insrec's head. */
-      weft_t head_weft = pull(weave->memodict, id_head, pred_head);
-      //weft_print(head_weft);
-
-      // NOTE: we can and should break out of here early.
-      for (uint32_t j = i; j <= weave->length;) {
-        /* Peek at right neighbor. If we're aware of it, insert chain here. */
-        if (weft_covers(head_weft, id_neighbor)) {
-          //printf("+ Aware of neighbor insertion\n");
-          insvec = vector_append(insvec, (Word_t)j+1);
-          insvec = vector_append(insvec, (Word_t)insrec->len_atoms);
-          insvec = vector_append(insvec, (Word_t)insrec->chain);
-          free(head_weft); goto cont;
-        }
-
-        /* We must insert in weft order. First, check if my weftI is greater
-           than that of the atom to my right (that I see with cur.current()),
-           which I shall call r. If so, insert me here. */
-        uint64_t rid = id_neighbor;
-        weft_t r_weft = pull(weave->memodict, rid, 0);
-        if (weft_gt(head_weft, r_weft)) { /* Insert here. */
-          //printf("+ Weftgt insertion\n");
-          insvec = vector_append(insvec, (Word_t)j+1);
-          insvec = vector_append(insvec, (Word_t)insrec->len_atoms);
-          insvec = vector_append(insvec, (Word_t)insrec->chain);
-          free(head_weft); free(r_weft); goto cont;
-        }
-
-        /* Step past the causal block of r, and try looking at the new right
-           neighbor on the next iteration of this loop. We do this by stepping
-           until READ_ATOM returns an atom whose predecessor p is not r, and
-           where r is aware of p. If we come to the end, we will run into the
-           end atom sentinel, which will stop the iteration and give us our
-           insertion point. */
-        uint64_t p; uint32_t cur_c;
-        ids_local++; bodies_local += 3; /* Skip past neighbor */
-        do {
-          READ_ATOM(id_neighbor, p, cur_c, ids_local, bodies_local); j++;
-          //printf("Skipping causal block: (%u,%u)\n", YARN(id_neighbor), OFFSET(id_neighbor));
-        } while (!(p != rid && weft_covers(r_weft, p)));
-        free(r_weft);
-      }
-      printf("WTF??\n");
-      free(head_weft); return -1;                /* What happened? */
-      
-      cont: continue;           /* Good end */
+/* Remove deleted atoms and their deletors from a weave, along with
+   save-awareness atoms, wherever they're covered by a stable weft, and drop
+   the memodict entries that are no longer needed. The arrays are rewritten in
+   place, and the position index, if there is one, is rebuilt; the text and
+   the weft don't change.
+
+   The stable weft has to be one that every replica has seen all of, such that
+   every patch that can still arrive, from anywhere, is aware of all of it.
+   Atoms that waiting patches are anchored on are kept. Returns 0 on success,
+   -1 on malloc() failure, in which case the weave is unchanged. */
+int weave_compact(weave_t *weave, weft_t stable) {
+  Pvoid_t anchors = (Pvoid_t)NULL;
+  Word_t *pvalue; Word_t rc_word;
+  uint32_t n = weave->length, k;
+  uint64_t next_pred = 0;       /* Pred of the first atom after i being kept */
+
+  if (weave_thaw(weave) != 0 || weave_unshare(weave) != 0) return -1;
+  uint64_t *drop = calloc(VISIBLE_WORDS(n), sizeof(uint64_t));
+  if (drop == NULL ||
+      waitset_foreach(weave->wset, collect_waiting_anchors, &anchors) != 0) {
+    free(drop); JLFA(rc_word, anchors);
+    return -1;
+  }
+
+  /* Work backward, so that an atom's children have been dealt with by the
+     time we get to it. Deletors are dealt with along with what they
+     delete. */
+  for (uint32_t i = n; i-- > 0;) {
+    uint32_t c = weave->chars[i], j = i + 1;
+    int stable_deletors = TRUE;
+    if (c == ATOM_CHAR_DEL) continue;
+    for (; j < n && weave->chars[j] == ATOM_CHAR_DEL &&
+           weave->preds[j] == weave->ids[i]; j++)
+      stable_deletors = stable_deletors && weft_covers(stable, weave->ids[j]);
+
+    JLG(pvalue, anchors, (Word_t)weave->ids[i]);
+    if ((c == ATOM_CHAR_SAVE || (ATOM_CHAR_IS_VISIBLE(c) && j > i + 1)) &&
+        stable_deletors && weft_covers(stable, weave->ids[i]) &&
+        next_pred != weave->ids[i] && pvalue == NULL) {
+      for (k = i; k < j; k++) drop[k / 64] |= (uint64_t)1 << (k % 64);
+    } else {
+      next_pred = weave->preds[i];
     }
   }
-  
-  delete_insdict(insdict); delete_deldict(deldict);
+  JLFA(rc_word, anchors);
+
+  if (prune_memodict(weave, stable) != 0) { free(drop); return -1; }
 
-  /* Apply the insertion vector */
-  *weave = apply_insvec(*weave, insvec, patch_length_atoms(patch));
-  free(insvec);
+  /* Slide the atoms that are left down over the ones that aren't. */
+  for (uint32_t i = k = 0; i < n; i++) {
+    if ((drop[i / 64] >> (i % 64)) & 1) continue;
+    if (k != i)
+      WRITE_ATOM_IDX(weave->ids[i], weave->preds[i], weave->chars[i],
+                     weave->ids, weave->preds, weave->chars, k);
+    k++;
+  }
+  free(drop);
+  weave->length = k;
+  memset(weave->visible, 0, VISIBLE_WORDS(n) * sizeof(uint64_t));
+  for (uint32_t i = 0; i < k; i++) update_visibility(weave, i);
+  rebuild_viscounts(weave);
 
-  /* Update the weft */
-  uint64_t high_id = patch_highest_id(patch);
-  LIFTERR(weft_extend(&weave->weft, YARN(high_id), OFFSET(high_id)));
+  if (weave->posindex != NULL) {
+    delete_posindex(weave->posindex);
+    weave->posindex = NULL;
+    weave_index_positions(weave);
+  }
   return 0;
 }
 
@@ -469,65 +1275,40 @@ int apply_patch(weave_t *weave, patch_t patch) {
 /* Create an initial weave traversal state for a weave. */
 weave_traversal_state_t starting_traversal_state(weave_t weave) {
   weave_traversal_state_t wts;
-  wts.ids = weave.ids; wts.bodies = weave.bodies;
-  wts.remaining_atoms = weave.length;
+  wts.chars = weave.chars; wts.visible = weave.visible;
+  wts.i = 0; wts.remaining_atoms = weave.length;
   return wts;
 }
 
-/* Scour a weave, partially. Takes a weave traversal state pointer and a vector
-   weave, as well as a pointer to a buffer of given length to which it should
-   write the characters. The buffer should hold wide chars. Returns the number
-   of characters written. */
-// int scour(wchar_t *buf, int buflen, weave_traversal_state_t *wts) {
-//   uint64_t *ids = wts->ids; uint32_t *bodies = wts->bodies;
-//   int length = wts->remaining_atoms;
-//   int chars_written = 0, i = 0;
-// 
-//   for (i = 0; i < length && chars_written < buflen; i++) {
-//     uint64_t id, pred; uint32_t c;
-//     READ_ATOM(id, pred, c, ids, bodies); i++;
-//   checkdel:
-//     if (ATOM_CHAR_IS_VISIBLE(c)) {
-//       uint64_t vid = id; uint32_t vc = c;
-//       while (i < length) {
-//         READ_ATOM(id, pred, c, ids, bodies); i++;
-//         printf("c: %x, pred:%llu, vid:%llu\n", c, pred, vid);
-//         if (c == ATOM_CHAR_DEL && pred == vid) {
-//           printf("<DEL>"); goto donotprint;
-//         }
-//         if (ATOM_CHAR_IS_VISIBLE(c)) {
-//           buf[chars_written++] = (wchar_t)vc;
-//           goto checkdel;
-//         }
-//       }
-//       buf[chars_written++] = (wchar_t)vc;
-//     donotprint: NOP;
-//     }
-//   }
-// 
-//   wts->ids = ids; wts->bodies = bodies; wts->remaining_atoms -= i;
-//   return chars_written;
-// }
-
+/* Scour a weave, partially. Takes a weave traversal state pointer, and a
+   pointer to a buffer of given length to which it should write the characters.
+   The buffer should hold wide chars. Returns the number of characters written.
+   This goes by the weave's visibility bitmap: runs of invisible atoms are
+   skipped a word at a time, and runs of visible ones are copied out in
+   blocks. */
 int scour(wchar_t *buf, int buflen, weave_traversal_state_t *wts) {
-  uint64_t *ids = wts->ids; uint32_t *bodies = wts->bodies;
-  int length = wts->remaining_atoms;
-  int i, chars_written = 0;
-
-  for (i = 0; i < length && chars_written < buflen;) {
-    uint64_t id, pred; uint32_t c;
-    READ_ATOM(id, pred, c, ids, bodies); i++;
-    if (ATOM_CHAR_IS_VISIBLE(c)) {
-      uint64_t vid = id; uint32_t vc = c;
-      READ_ATOM(id, pred, c, ids, bodies); i++;
-      if (!(c == ATOM_CHAR_DEL && pred == vid)) {
-        buf[chars_written++] = (wchar_t)vc;
-        ids--; bodies -= 3; i--;
-      }
-    }
+  uint32_t *chars = wts->chars; uint64_t *visible = wts->visible;
+  uint32_t i = wts->i, end = wts->i + wts->remaining_atoms;
+  int chars_written = 0;
+
+  while (i < end && chars_written < buflen) {
+    uint64_t word = visible[i / 64] >> (i % 64);
+    if (word == 0) { i = (i | 63) + 1; continue; } /* nothing visible here */
+
+    /* Skip to the next visible atom, and find how many follow it. */
+    i += __builtin_ctzll(word); word >>= __builtin_ctzll(word);
+    uint32_t run = ~word == 0 ? 64 : __builtin_ctzll(~word);
+    if (i >= end) break;
+    if (run > end - i) run = end - i;
+    if (run > buflen - chars_written) run = buflen - chars_written;
+
+    for (uint32_t j = 0; j < run; j++)
+      buf[chars_written + j] = (wchar_t)chars[i + j];
+    chars_written += run; i += run;
   }
 
-  wts->ids = ids; wts->bodies = bodies; wts->remaining_atoms -= i;
+  if (i > end) i = end;
+  wts->remaining_atoms -= i - wts->i; wts->i = i;
   return chars_written;
 }
 
@@ -1,29 +1,52 @@
 #ifndef __VECTOR_WEAVE_H
 #define __VECTOR_WEAVE_H
 
-/* A weave consists of a pair of arrays. This struct has pointers for both. */
+/* A weave consists of three parallel arrays. This struct has pointers for all
+   of them. */
 typedef struct {
   uint32_t capacity;       /* How many atoms could be in here */
   uint32_t length;         /* How many atoms actually are here */
   uint64_t *ids;           /* Array of ids */
-  uint32_t *bodies;        /* Array of (pred, char) pairs */
+  uint64_t *preds;         /* Array of predecessor ids */
+  uint32_t *chars;         /* Array of chars */
+  uint64_t *visible;       /* Visibility bitmap: bit i is set if atom i is a
+                              visible char that hasn't been deleted */
+  uint32_t *viscounts;     /* Fenwick tree of visible atoms per bitmap word */
   weft_t weft;             /* Weft covering all atoms in weave */
   memodict_t memodict;     /* Id-to-weft memoization dict */
-  waitset_t wset;          /* Waiting set: vectors of patches */
+  waitset_t wset;          /* Waiting set: patches by blocking id */
+  posindex_t posindex;     /* Where each atom is, or NULL if not kept */
+  textview_t textview;     /* The visible text, or NULL if not kept */
+  snapshot_t snapshot;     /* Snapshot the arrays are mapped from, or NULL */
+  version_t version;       /* Published version the arrays belong to, or
+                              NULL */
 } weave_t;
 
-/* The state of a weave traversal. */
+/* How many words a visibility bitmap needs for a given capacity. */
+#define VISIBLE_WORDS(capacity) (((capacity) + 63) / 64)
+
+/* The state of a weave traversal: the next atom to be read is atom i of the
+   weave. */
 typedef struct {
-  uint64_t *ids;
-  uint32_t *bodies;
+  uint32_t *chars;
+  uint64_t *visible;
+  uint32_t i;
   uint32_t remaining_atoms;
 } weave_traversal_state_t;
 
 weave_t new_weave(uint32_t capacity);
 void delete_weave(weave_t weave);
 void weave_print(weave_t weave);
+int weave_index_positions(weave_t *weave);
+int weave_view_text(weave_t *weave);
+uint32_t weave_visible_length(weave_t *weave);
+uint64_t weave_visible_id(weave_t *weave, uint32_t k);
+uint32_t weave_visible_index(weave_t *weave, uint64_t id);
 weave_t apply_insvec(weave_t weave, vector_t insvec, uint32_t atom_count);
+int apply_patches(weave_t *weave, patch_t *patches, int n);
+int apply_and_drain(weave_t *weave, patch_t *patches, int n);
 int apply_patch(weave_t *weave, patch_t patch);
+int weave_compact(weave_t *weave, weft_t stable);
 weave_traversal_state_t starting_traversal_state(weave_t weave);
 int scour(wchar_t *buf, int buflen, weave_traversal_state_t *wts);
 
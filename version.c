@@ -0,0 +1,243 @@
+/* Published versions: immutable copies of a vector weave that other threads
+   can read while one writer keeps applying patches.
+
+   A weave's arrays are changed in place, so nothing can read them while a
+   patch is going in. Publishing a weave makes a version that shares its
+   arrays and has a copy of its weft, and makes that the current version.
+   Readers take a reference to the current version, and can scour it, search
+   it or save it for as long as they like; it never changes. The arrays are
+   copied on write: once a weave has been published, the next change to it
+   builds new arrays, as apply_insvec_alloc() does anyway when a weave
+   outgrows its capacity, and leaves the published ones alone.
+
+   The writer does all the allocating and freeing. A version that's been
+   replaced is retired, and freed by a later weave_publish() or
+   versions_reclaim() once nobody has a reference to it. References are
+   counted, but that alone isn't enough: a reader could load the current
+   version just before it's replaced, and then take its reference just after
+   the writer saw there were none. So readers take references inside a short
+   epoch-protected section. There's a global epoch, which each publish bumps,
+   and a fixed set of reader slots. A reader announces the epoch it saw in a
+   slot, loads the current version, takes its reference and clears the slot.
+   A version retired at epoch e can only have been loaded by a reader that
+   announced e or earlier, so it's freed only when no slot holds e or earlier.
+
+   Only one thread may publish or reclaim, and it must be the one that
+   changes the weave. Versions don't have memodicts, waiting sets, position
+   indices or text views. */
+
+#include "sburb.h"
+
+/* How many readers can be taking references at the same moment. A reader is
+   only in a slot for a few instructions, so this doesn't limit how many
+   reader threads there are; any more than this just wait their turn. */
+#ifndef VERSIONS_READER_SLOTS
+#define VERSIONS_READER_SLOTS 64
+#endif
+
+struct version {
+  weave_t weave;                /* Arrays and weft; nothing else */
+  uint64_t number;              /* 1 for the first version published, etc. */
+  uint64_t refs;                /* References, counting the current one */
+  uint64_t retired_epoch;       /* Epoch when it was replaced */
+  struct version *next;         /* Next retired version */
+};
+
+struct versions {
+  version_t current;            /* Latest version, or NULL */
+  uint64_t epoch;               /* Bumped by every publish; never 0 */
+  uint64_t published;           /* Number of versions published */
+  version_t retired;            /* Replaced versions not yet freed */
+  uint64_t slots[VERSIONS_READER_SLOTS]; /* Epochs readers saw, or 0 */
+};
+
+/* Make a new place to publish versions of a weave. Returns NULL on malloc()
+   failure. */
+versions_t new_versions(void) {
+  versions_t versions = calloc(1, sizeof(struct versions));
+  if (versions == NULL) return NULL;
+  versions->epoch = 1;
+  return versions;
+}
+
+/* Free a version, and the arrays it owns. */
+static void free_version(version_t version) {
+  free(version->weave.ids); free(version->weave.preds);
+  free(version->weave.chars); free(version->weave.visible);
+  free(version->weave.viscounts);
+  delete_weft(version->weave.weft);
+  free(version);
+}
+
+/* Delete a place to publish versions, and every version in it. No reader may
+   be using any of them. The last published weave's arrays go with it, so
+   delete the weave first, or change it first so it has arrays of its own. */
+void delete_versions(versions_t versions) {
+  if (versions == NULL) return;
+  if (versions->current != NULL) free_version(versions->current);
+  while (versions->retired != NULL) {
+    version_t next = versions->retired->next;
+    free_version(versions->retired);
+    versions->retired = next;
+  }
+  free(versions);
+}
+
+/* Free the retired versions that nobody has a reference to, and that no
+   reader can be about to take one to. Writer only. Returns how many retired
+   versions are left. */
+int versions_reclaim(versions_t versions) {
+  uint64_t oldest = UINT64_MAX;
+  version_t *link = &versions->retired;
+  int left = 0;
+
+  for (int i = 0; i < VERSIONS_READER_SLOTS; i++) {
+    uint64_t epoch = __atomic_load_n(&versions->slots[i], __ATOMIC_SEQ_CST);
+    if (epoch != 0 && epoch < oldest) oldest = epoch;
+  }
+  while (*link != NULL) {
+    version_t version = *link;
+    if (version->retired_epoch < oldest &&
+        __atomic_load_n(&version->refs, __ATOMIC_ACQUIRE) == 0) {
+      *link = version->next;
+      free_version(version);
+    } else {
+      link = &version->next;
+      left++;
+    }
+  }
+  return left;
+}
+
+/* Publish a weave as the current version, for readers to acquire. Writer
+   only. The weave's arrays now belong to the version, and the next change to
+   the weave copies them instead of changing them. Publishing a weave that
+   hasn't changed since it was last published does nothing. Retired versions
+   are reclaimed while we're here. Returns 0 on success, -1 on malloc()
+   failure. */
+int weave_publish(versions_t versions, weave_t *weave) {
+  if (weave_thaw(weave) != 0) return -1;
+  if (weave->version != NULL) return 0;
+
+  version_t version = malloc(sizeof(struct version));
+  if (version == NULL) return -1;
+  weft_t weft = copy_weft(weave->weft);
+  if (weft == ERRWEFT) { free(version); return -1; }
+  version->weave = *weave;
+  version->weave.weft     = weft;
+  version->weave.memodict = (memodict_t)NULL;
+  version->weave.wset     = (waitset_t)NULL;
+  version->weave.posindex = (posindex_t)NULL;
+  version->weave.textview = (textview_t)NULL;
+  version->weave.version  = version;
+  version->number = ++versions->published;
+  version->refs = 1;
+  version->next = NULL;
+  weave->version = version;
+
+  /* Swap it in, then retire the old one under the epoch that readers who
+     might have loaded it could have announced, and start a new epoch. */
+  version_t old = __atomic_exchange_n(&versions->current, version,
+                                      __ATOMIC_SEQ_CST);
+  if (old != NULL) {
+    old->retired_epoch = __atomic_load_n(&versions->epoch, __ATOMIC_SEQ_CST);
+    old->next = versions->retired;
+    versions->retired = old;
+    __atomic_sub_fetch(&old->refs, 1, __ATOMIC_RELEASE);
+  }
+  __atomic_add_fetch(&versions->epoch, 1, __ATOMIC_SEQ_CST);
+  versions_reclaim(versions);
+  return 0;
+}
+
+/* Take a reference to the current version. Safe to call from any thread, at
+   the same time as the writer publishes. Returns NULL if nothing has been
+   published yet. The reference must be given up with version_release(). */
+version_t version_acquire(versions_t versions) {
+  uint64_t *slot;
+  version_t version;
+
+  /* Find a free slot and announce the epoch in it. */
+  for (int i = 0;; i = (i + 1) % VERSIONS_READER_SLOTS) {
+    uint64_t free_epoch = 0;
+    uint64_t epoch = __atomic_load_n(&versions->epoch, __ATOMIC_SEQ_CST);
+    slot = &versions->slots[i];
+    if (__atomic_compare_exchange_n(slot, &free_epoch, epoch, FALSE,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      break;
+    if (i == VERSIONS_READER_SLOTS - 1) sched_yield();
+  }
+
+  version = __atomic_load_n(&versions->current, __ATOMIC_SEQ_CST);
+  if (version != NULL) __atomic_add_fetch(&version->refs, 1, __ATOMIC_ACQUIRE);
+  __atomic_store_n(slot, 0, __ATOMIC_RELEASE);
+  return version;
+}
+
+/* Give up a reference to a version. Safe to call from any thread. The
+   version is freed later, by the writer. */
+void version_release(version_t version) {
+  if (version != NULL)
+    __atomic_sub_fetch(&version->refs, 1, __ATOMIC_RELEASE);
+}
+
+/* Get the weave in a version. It must not be changed, or used after the
+   reference to the version is given up. */
+const weave_t *version_weave(version_t version) {
+  return &version->weave;
+}
+
+/* Get a version's number: 1 for the first version published, and so on. */
+uint64_t version_number(version_t version) {
+  return version->number;
+}
+
+/* Give a published weave arrays of its own again, so that they can be
+   changed in place. Does nothing if the weave isn't published. Returns 0 on
+   success, -1 on malloc() failure, in which case the weave is untouched. */
+int weave_unshare(weave_t *weave) {
+  if (weave->version == NULL) return 0;
+  uint32_t capacity = weave->capacity, words = VISIBLE_WORDS(capacity);
+  uint64_t *ids = malloc(capacity * sizeof(uint64_t));
+  uint64_t *preds = malloc(capacity * sizeof(uint64_t));
+  uint32_t *chars = malloc(capacity * sizeof(uint32_t));
+  uint64_t *visible = malloc(words * sizeof(uint64_t));
+  uint32_t *viscounts = malloc((words + 1) * sizeof(uint32_t));
+  if (ids == NULL || preds == NULL || chars == NULL || visible == NULL ||
+      viscounts == NULL) {
+    free(ids); free(preds); free(chars); free(visible); free(viscounts);
+    return -1;
+  }
+  memcpy(ids, weave->ids, weave->length * sizeof(uint64_t));
+  memcpy(preds, weave->preds, weave->length * sizeof(uint64_t));
+  memcpy(chars, weave->chars, weave->length * sizeof(uint32_t));
+  memcpy(visible, weave->visible, words * sizeof(uint64_t));
+  memcpy(viscounts, weave->viscounts, (words + 1) * sizeof(uint32_t));
+  weave->ids = ids; weave->preds = preds; weave->chars = chars;
+  weave->visible = visible; weave->viscounts = viscounts;
+  weave->version = NULL;
+  return 0;
+}
+
+
+/********************************** Testing ***********************************/
+
+// int main(void) {
+//   weave_t weave = new_weave(0);
+//   versions_t versions = new_versions();
+//   wchar_t buf[64];
+//
+//   LIFTERR(weave_publish(versions, &weave));
+//   version_t version = version_acquire(versions);
+//   LIFTERR(apply_patch(&weave, make_patch1()));
+//   LIFTERR(weave_publish(versions, &weave));
+//   /* The old version still reads the same, until it's released. */
+//   weave_traversal_state_t wts = starting_traversal_state(*version_weave(version));
+//   printf("version %llu: %d chars\n", (long long)version_number(version),
+//          scour(buf, 64, &wts));
+//   version_release(version);
+//   printf("%d retired\n", versions_reclaim(versions));
+//   delete_weave(weave);
+//   delete_versions(versions);
+//   return 0;
+// }
@@ -1,8 +1,55 @@
-/* Waiting sets implemented as sparse arrays of patch pointers. Which in turn
-   are represented as JudyL arrays mapping from indices to patch pointers. */
+/* Waiting sets: patches that can't be applied yet, indexed by the id they're
+   blocking on. This is a JudyL array mapping yarns to JudyL arrays, which map
+   offsets to vectors of patches blocking on that (yarn, offset) id.
+
+   When the weft advances, the only patches worth looking at again are the ones
+   whose blocking id it now covers. Since a patch is only ever put in here when
+   its blocking id isn't covered, those are, for each yarn, just the ones at
+   the low end of its inner array. A patch that's woken up might still be
+   blocked on something else, in which case it goes back in under its new
+   blocking id.
+
+   The waiting set owns the patches in it. add_to_waitset() puts in a copy, so
+   the caller is free to do what it likes with its own patch; waitset_park()
+   hands over a patch the caller already owns, without copying it.
+
+   A waiting set can have limits on how many patches it keeps in memory, and
+   how many bytes they take. Past those, the oldest patches are written out to
+   an append-only spill file, and their entries in the vectors become offsets
+   into the file, to be read back in when they're woken up. Patches are never
+   dropped: a patch that depends on a dropped one would wait forever. If the
+   spill file can't be written, new patches are refused instead, and if a
+   spilled patch can't be read back, it stays where it is, to be tried again
+   the next time it's woken up. Each entry is a word: a pointer to a parked_t
+   for a patch in memory, or an offset shifted left one, with the low bit set,
+   for a patch in the spill file. */
 
 #include "sburb.h"
 
+/* A patch in memory, and what's needed to find it again when it's the
+   oldest. */
+typedef struct {
+  patch_t patch;
+  uint64_t blocking_id;
+  Word_t age;
+} parked_t;
+
+#define ENTRY_IS_SPILLED(entry) ((entry) & 1)
+#define ENTRY_SPILL_OFFSET(entry) ((entry) >> 1)
+#define SPILLED_ENTRY(offset) (((Word_t)(offset) << 1) | 1)
+
+struct waitset {
+  Pvoid_t blocked;              /* yarn -> offset -> vector of entries */
+  Pvoid_t ages;                 /* age -> parked_t *, for patches in memory */
+  Word_t next_age;
+  uint32_t max_patches;         /* Limits on patches in memory; 0 for none */
+  uint64_t max_bytes;
+  char *spill_path;             /* NULL if there are no limits */
+  FILE *spill;                  /* Opened on first spill */
+  uint64_t spill_end;           /* Where the next spilled patch goes */
+  waitset_stats_t stats;
+};
+
 /* Allocate and return a new, empty waiting set. Does not actually allocate
    anything, so unless you put something in the waiting set, you don't actually
    need to free this. */
@@ -10,72 +57,389 @@ waitset_t new_waitset(void) {
   return (waitset_t)NULL;
 }
 
-/* Free a waiting set, deleting everything. If delete_patches is true, then it
-   will also delete the patches themselves; otherwise it won't. */
-void delete_waitset(waitset_t waitset, int delete_patches) {
-  Word_t index; Word_t *pvalue; Word_t rc_word;
+/* Make sure there's a waiting set to put things in. Returns 0 on success, -1
+   on malloc() failure. */
+static int ensure_waitset(waitset_t *wset) {
+  if (*wset == NULL && (*wset = calloc(1, sizeof(struct waitset))) == NULL)
+    return -1;
+  return 0;
+}
+
+/* Free a waiting set, and all the patches in it. The spill file, if any, is
+   removed, since nothing else knows what's in it. */
+void delete_waitset(waitset_t wset) {
+  Word_t yarn, offset; Word_t *pvalue, *pinner; Word_t rc_word;
 
-  if (delete_patches) {
-    index = 0; JLF(pvalue, waitset, index);
+  if (wset == NULL) return;
+  yarn = 0; JLF(pinner, wset->blocked, yarn);
+  while (pinner != NULL) {
+    Pvoid_t inner = (Pvoid_t)*pinner;
+    offset = 0; JLF(pvalue, inner, offset);
     while (pvalue != NULL) {
-      free((void *)*pvalue);
-      JLN(pvalue, waitset, index);
+      vector_t entries = (vector_t)*pvalue;
+      for (Word_t i = 0; i < VECTOR_LEN(entries); i++) {
+        Word_t entry = VECTOR_GET(entries, i);
+        if (ENTRY_IS_SPILLED(entry)) continue;
+        free(((parked_t *)entry)->patch); free((parked_t *)entry);
+      }
+      free(entries);
+      JLN(pvalue, inner, offset);
     }
+    JLFA(rc_word, inner);
+    JLN(pinner, wset->blocked, yarn);
   }
-  JLFA(rc_word, waitset);
+  JLFA(rc_word, wset->blocked); JLFA(rc_word, wset->ages);
+  if (wset->spill != NULL) {
+    fclose(wset->spill);
+    remove(wset->spill_path);
+  }
+  free(wset->spill_path);
+  free(wset);
 }
 
-/* Add a patch to the waiting set. Takes a pointer to a waiting set, and
-   modifies it. Returns zero on success, nonzero on error. */
-int add_to_waitset(waitset_t *wset, patch_t patch) {
-  Word_t index; Word_t *pvalue; waitset_t temp = *wset;
+/* Set limits on how many patches a waiting set keeps in memory, and how many
+   bytes of patches. A limit of 0 means no limit. Past the limits, the oldest
+   patches are moved to a spill file at spill_path, which is created (or
+   truncated) when it's first needed, and which is required if there are any
+   limits. If patches have already been spilled, they stay in the current
+   file. Returns 0 on success, -1 if there are limits but no spill_path, or on
+   malloc() failure. */
+int waitset_set_limits(waitset_t *wset, uint32_t max_patches,
+                       uint64_t max_bytes, const char *spill_path) {
+  if ((max_patches > 0 || max_bytes > 0) && spill_path == NULL) return -1;
+  if (ensure_waitset(wset) != 0) return -1;
+  waitset_t ws = *wset;
+  char *path = NULL;
 
-  index = -1; JLL(pvalue, temp, index); index++;
-  JLI(pvalue, temp, index);
-  if (pvalue == PJERR) return -1; /* malloc() error */
-  *pvalue = (Word_t)patch;
-  *wset = temp;
+  if (spill_path != NULL && (path = strdup(spill_path)) == NULL) return -1;
+  if (ws->spill != NULL && ws->stats.spilled_patches == 0) {
+    fclose(ws->spill); remove(ws->spill_path);
+    ws->spill = NULL; ws->spill_end = 0;
+  }
+  if (ws->spill == NULL) { free(ws->spill_path); ws->spill_path = path; }
+  else free(path);
+  ws->max_patches = max_patches; ws->max_bytes = max_bytes;
+  return 0;
+}
+
+/* Get the statistics for a waiting set. */
+void waitset_stats(waitset_t wset, waitset_stats_t *stats) {
+  if (wset == NULL) memset(stats, 0, sizeof(waitset_stats_t));
+  else *stats = wset->stats;
+}
+
+/* Find the vector of entries for a blocking id, creating it if need be.
+   Returns a pointer to where the vector is stored, or NULL on malloc()
+   failure. */
+static Word_t *blocked_slot(waitset_t wset, uint64_t blocking_id) {
+  Word_t *pinner, *pvalue;
+
+  JLI(pinner, wset->blocked, (Word_t)YARN(blocking_id));
+  if (pinner == PJERR) return NULL; /* malloc() error */
+  Pvoid_t inner = (Pvoid_t)*pinner;
+  JLI(pvalue, inner, (Word_t)OFFSET(blocking_id));
+  if (pvalue == PJERR) return NULL; /* malloc() error */
+  *pinner = (Word_t)inner;
+  if (*pvalue == 0) *pvalue = (Word_t)new_vector();
+  return pvalue;
+}
+
+/* Remove an entry from the vector for a blocking id, removing the vector too if
+   that leaves it empty. The order of the other entries may change. */
+static void remove_entry(waitset_t wset, uint64_t blocking_id, Word_t entry) {
+  Word_t *pinner, *pvalue; int rc_int;
+
+  JLG(pinner, wset->blocked, (Word_t)YARN(blocking_id));
+  Pvoid_t inner = (Pvoid_t)*pinner;
+  JLG(pvalue, inner, (Word_t)OFFSET(blocking_id));
+  vector_t entries = (vector_t)*pvalue;
+  for (Word_t i = 0; i < VECTOR_LEN(entries); i++) {
+    if (VECTOR_GET(entries, i) != entry) continue;
+    VECTOR_GET(entries, i) = VECTOR_GET(entries, VECTOR_LEN(entries) - 1);
+    VECTOR_LEN(entries)--;
+    break;
+  }
+  if (VECTOR_LEN(entries) > 0) return;
+
+  free(entries);
+  JLD(rc_int, inner, (Word_t)OFFSET(blocking_id));
+  if (inner != NULL) *pinner = (Word_t)inner;
+  else JLD(rc_int, wset->blocked, (Word_t)YARN(blocking_id));
+}
+
+/* Write a patch to the end of the spill file. Returns the offset it was
+   written at, or -1 on error. */
+static int64_t spill_patch(waitset_t wset, patch_t patch) {
+  uint32_t length_bytes = patch_length_bytes(patch);
+
+  if (wset->spill == NULL &&
+      (wset->spill = fopen(wset->spill_path, "w+b")) == NULL)
+    return -1;
+  if (fseeko(wset->spill, wset->spill_end, SEEK_SET) != 0 ||
+      fwrite(patch, 1, length_bytes, wset->spill) != length_bytes)
+    return -1;
+  wset->spill_end += length_bytes;
+  return wset->spill_end - length_bytes;
+}
+
+/* Read a patch back in from the spill file. Returns the patch, which the
+   caller must free(), or NULL on error. */
+static patch_t unspill_patch(waitset_t wset, uint64_t offset) {
+  uint32_t length_bytes;
+  patch_t patch;
+
+  if (fflush(wset->spill) != 0 ||
+      fseeko(wset->spill, offset, SEEK_SET) != 0 ||
+      fread(&length_bytes, sizeof(uint32_t), 1, wset->spill) != 1 ||
+      length_bytes < 5 || (patch = malloc(length_bytes)) == NULL)
+    return NULL;
+  *(uint32_t *)patch = length_bytes;
+  if (fread((uint8_t *)patch + 4, 1, length_bytes - 4, wset->spill) !=
+      length_bytes - 4) {
+    free(patch);
+    return NULL;
+  }
+  return patch;
+}
+
+/* Replace an entry in the vector for a blocking id with another. */
+static void replace_entry(waitset_t wset, uint64_t blocking_id, Word_t entry,
+                          Word_t replacement) {
+  Word_t *pinner, *pvalue;
+
+  JLG(pinner, wset->blocked, (Word_t)YARN(blocking_id));
+  Pvoid_t inner = (Pvoid_t)*pinner;
+  JLG(pvalue, inner, (Word_t)OFFSET(blocking_id));
+  vector_t entries = (vector_t)*pvalue;
+  for (Word_t i = 0; i < VECTOR_LEN(entries); i++)
+    if (VECTOR_GET(entries, i) == entry) VECTOR_GET(entries, i) = replacement;
+}
+
+/* Move the oldest patches in memory out to the spill file until the waiting
+   set is within its limits. Returns 0 on success, or -1 if a patch couldn't
+   be spilled, in which case it's still in memory, and the waiting set is over
+   its limits. */
+static int enforce_limits(waitset_t wset) {
+  Word_t age; Word_t *pvalue; int rc_int;
+
+  while ((wset->max_patches > 0 && wset->stats.patches > wset->max_patches) ||
+         (wset->max_bytes > 0 && wset->stats.bytes > wset->max_bytes)) {
+    age = 0; JLF(pvalue, wset->ages, age);
+    if (pvalue == NULL) break;
+    parked_t *parked = (parked_t *)*pvalue;
+    uint32_t length_bytes = patch_length_bytes(parked->patch);
+    int64_t offset = spill_patch(wset, parked->patch);
+    if (offset < 0) return -1;
+
+    replace_entry(wset, parked->blocking_id, (Word_t)parked,
+                  SPILLED_ENTRY(offset));
+    wset->stats.spilled_patches++; wset->stats.spilled_bytes += length_bytes;
+    wset->stats.patches--; wset->stats.bytes -= length_bytes;
+    JLD(rc_int, wset->ages, age);
+    free(parked->patch); free(parked);
+  }
+  return 0;
+}
+
+/* Put a patch in the waiting set, blocking on a given id. The waiting set takes
+   ownership of the patch, which must have been allocated with malloc(). Takes
+   a pointer to a waiting set, and modifies it. Returns zero on success, or
+   nonzero on malloc() failure, or if the waiting set is full and can't spill,
+   in which case the patch still belongs to the caller. */
+int waitset_park(waitset_t *wset, uint64_t blocking_id, patch_t patch) {
+  Word_t *pslot, *pvalue; int rc_int;
+  if (ensure_waitset(wset) != 0) return -1;
+  waitset_t ws = *wset;
+
+  parked_t *parked = malloc(sizeof(parked_t));
+  if (parked == NULL) return -1;
+  parked->patch = patch; parked->blocking_id = blocking_id;
+  parked->age = ws->next_age++;
+  JLI(pvalue, ws->ages, parked->age);
+  if (pvalue == PJERR) { free(parked); return -1; } /* malloc() error */
+  *pvalue = (Word_t)parked;
+  if ((pslot = blocked_slot(ws, blocking_id)) == NULL) {
+    JLD(rc_int, ws->ages, parked->age);
+    free(parked);
+    return -1;
+  }
+  *pslot = (Word_t)vector_append((vector_t)*pslot, (Word_t)parked);
+
+  ws->stats.patches++; ws->stats.bytes += patch_length_bytes(patch);
+  if (enforce_limits(ws) == 0) return 0;
+
+  /* Couldn't make room. Take the patch back out, unless it was spilled
+     itself, in which case it's safe. */
+  JLG(pvalue, ws->ages, parked->age);
+  if (pvalue == NULL) return 0;
+  remove_entry(ws, blocking_id, (Word_t)parked);
+  ws->stats.patches--; ws->stats.bytes -= patch_length_bytes(patch);
+  JLD(rc_int, ws->ages, parked->age);
+  free(parked);
+  return -1;
+}
+
+/* Add a copy of a patch to the waiting set, blocking on a given id. Returns
+   zero on success, nonzero on error. */
+int add_to_waitset(waitset_t *wset, uint64_t blocking_id, patch_t patch) {
+  uint32_t length_bytes = patch_length_bytes(patch);
+  patch_t copy = malloc(length_bytes);
+  if (copy == NULL) return -1;
+  memcpy(copy, patch, length_bytes);
+  if (waitset_park(wset, blocking_id, copy) != 0) { free(copy); return -1; }
   return 0;
 }
 
 /* Is the waiting set empty? */
 int waitset_empty(waitset_t wset) {
-  Word_t rc_word;
-  JLC(rc_word, wset, 0, -1);
-  return rc_word == 0;
+  return wset == NULL || wset->blocked == NULL;
 }
 
-/* Remove item i from the waitset. */
-int remove_from_waitset(waitset_t *wset, int i) {
-  Word_t index; waitset_t temp = *wset; int rc_int;
+/* Compare two patches by the id of their first atom. */
+static int first_id_cmp(const void *a, const void *b) {
+  uint64_t id_a = *(uint64_t *)patch_atoms(*(patch_t *)a);
+  uint64_t id_b = *(uint64_t *)patch_atoms(*(patch_t *)b);
+  return (id_a > id_b) - (id_a < id_b);
+}
+
+/* Take every patch out of the waiting set whose blocking id is covered by a
+   weft, and return them in a vector, sorted by the ids of their first atoms:
+   by yarn, and then by offset, so that each yarn's patches come in the order
+   they have to be applied in. The caller owns the vector and the patches in
+   it, and must free() them. Returns NULL if there aren't any. Spilled patches
+   are read back in; any that can't be are left in the waiting set, to be
+   tried again next time.
+
+   This only looks at the first entry for each yarn that isn't covered, so it
+   takes time proportional to the number of yarns patches are blocking on,
+   plus the number of patches woken up. */
+vector_t waitset_take_covered(waitset_t *wset, weft_t weft) {
+  Word_t yarn, offset; Word_t *pvalue, *pinner; int rc_int;
+  waitset_t ws = *wset; vector_t woken = NULL;
 
-  index = (Word_t)i; JLD(rc_int, temp, index);
-  *wset = temp; return rc_int != 1;
+  if (ws == NULL) return NULL;
+  yarn = 0; JLF(pinner, ws->blocked, yarn);
+  while (pinner != NULL) {
+    Pvoid_t inner = (Pvoid_t)*pinner;
+    uint32_t top = weft_get(weft, yarn);
+
+    offset = 0; JLF(pvalue, inner, offset);
+    while (pvalue != NULL && offset <= top) {
+      vector_t entries = (vector_t)*pvalue;
+      Word_t kept = 0;
+      for (Word_t i = 0; i < VECTOR_LEN(entries); i++) {
+        Word_t entry = VECTOR_GET(entries, i);
+        patch_t patch;
+        if (ENTRY_IS_SPILLED(entry)) {
+          patch = unspill_patch(ws, ENTRY_SPILL_OFFSET(entry));
+          if (patch == NULL) { VECTOR_GET(entries, kept++) = entry; continue; }
+          ws->stats.spilled_patches--;
+          ws->stats.spilled_bytes -= patch_length_bytes(patch);
+        } else {
+          parked_t *parked = (parked_t *)entry;
+          patch = parked->patch;
+          ws->stats.patches--; ws->stats.bytes -= patch_length_bytes(patch);
+          JLD(rc_int, ws->ages, parked->age);
+          free(parked);
+        }
+        if (woken == NULL) woken = new_vector();
+        woken = vector_append(woken, (Word_t)patch);
+      }
+      if (kept > 0) {
+        VECTOR_LEN(entries) = kept;
+      } else {
+        free(entries);
+        JLD(rc_int, inner, offset);
+      }
+      JLN(pvalue, inner, offset);
+    }
+
+    /* Remove yarns with nothing left waiting on them. */
+    if (inner == NULL) {
+      JLD(rc_int, ws->blocked, yarn);
+      JLN(pinner, ws->blocked, yarn);
+    } else {
+      *pinner = (Word_t)inner;
+      JLN(pinner, ws->blocked, yarn);
+    }
+  }
+
+  /* Start the spill file over once nothing in it is needed. */
+  if (ws->spill != NULL && ws->stats.spilled_patches == 0 &&
+      ws->spill_end > 0) {
+    ws->stats.spilled_bytes = 0;
+    if (fflush(ws->spill) == 0 && ftruncate(fileno(ws->spill), 0) == 0)
+      ws->spill_end = 0;
+  }
+
+  if (woken != NULL)
+    qsort(&VECTOR_GET(woken, 0), VECTOR_LEN(woken), sizeof(Word_t),
+          first_id_cmp);
+  return woken;
 }
 
-/* Print a waiting set, in a quite verbose format for debugging. */
-void print_waitset(waitset_t wset) {
-  Word_t index; Word_t *pvalue;
+/* Call fn(blocking_id, patch, arg) for every patch in a waiting set, in order
+   of blocking id, without taking any of them out. Spilled patches are read
+   back in for the call, and freed after it. The patches belong to the waiting
+   set, and fn must not keep them or change the waiting set. Returns 0 on
+   success, -1 if a spilled patch can't be read, or the first nonzero value fn
+   returns, at which point it stops. */
+int waitset_foreach(waitset_t wset,
+                    int (*fn)(uint64_t blocking_id, patch_t patch, void *arg),
+                    void *arg) {
+  Word_t yarn, offset; Word_t *pvalue, *pinner;
+  int rc = 0;
 
-  index = 0; JLF(pvalue, wset, index);
-  while (pvalue != NULL) {
-    patch_t patch = (patch_t)*pvalue;
-    print_patch(patch);
-    JLN(pvalue, wset, index);
+  if (wset == NULL) return 0;
+  yarn = 0; JLF(pinner, wset->blocked, yarn);
+  while (pinner != NULL && rc == 0) {
+    Pvoid_t inner = (Pvoid_t)*pinner;
+    offset = 0; JLF(pvalue, inner, offset);
+    while (pvalue != NULL && rc == 0) {
+      vector_t entries = (vector_t)*pvalue;
+      uint64_t blocking_id = PACK_ID(yarn, offset);
+      for (Word_t i = 0; i < VECTOR_LEN(entries) && rc == 0; i++) {
+        Word_t entry = VECTOR_GET(entries, i);
+        if (ENTRY_IS_SPILLED(entry)) {
+          patch_t patch = unspill_patch(wset, ENTRY_SPILL_OFFSET(entry));
+          if (patch == NULL) return -1;
+          rc = fn(blocking_id, patch, arg);
+          free(patch);
+        } else {
+          rc = fn(blocking_id, ((parked_t *)entry)->patch, arg);
+        }
+      }
+      JLN(pvalue, inner, offset);
+    }
+    JLN(pinner, wset->blocked, yarn);
   }
+  return rc;
 }
 
-/* Pop the oldest patch from the waitset, removing it. Returns NULL if the
-   waitset is empty. */
-patch_t waitset_pop(waitset_t *wset) {
-  Word_t index; Word_t *pvalue; waitset_t temp = *wset; int rc_int;
+/* Print a waiting set, in a quite verbose format for debugging. */
+void print_waitset(waitset_t wset) {
+  Word_t yarn, offset; Word_t *pvalue, *pinner;
 
-  index = 0; JLF(pvalue, temp, index);
-  if (pvalue == NULL) return NULL; /* empty waitset */
-  patch_t patch = (patch_t)*pvalue;
-  JLD(rc_int, temp, index);
-  *wset = temp;
-  return patch;
+  if (wset == NULL) return;
+  yarn = 0; JLF(pinner, wset->blocked, yarn);
+  while (pinner != NULL) {
+    Pvoid_t inner = (Pvoid_t)*pinner;
+    offset = 0; JLF(pvalue, inner, offset);
+    while (pvalue != NULL) {
+      vector_t entries = (vector_t)*pvalue;
+      printf("Blocking on (%u,%u):\n", (uint32_t)yarn, (uint32_t)offset);
+      for (Word_t i = 0; i < VECTOR_LEN(entries); i++) {
+        Word_t entry = VECTOR_GET(entries, i);
+        if (ENTRY_IS_SPILLED(entry))
+          printf("== Patch spilled at offset %llu\n\n",
+                 (unsigned long long)ENTRY_SPILL_OFFSET(entry));
+        else
+          print_patch(((parked_t *)entry)->patch);
+      }
+      JLN(pvalue, inner, offset);
+    }
+    JLN(pinner, wset->blocked, yarn);
+  }
 }
 
 /********************************** Testing ***********************************/
@@ -85,28 +449,30 @@ patch_t waitset_pop(waitset_t *wset) {
 //   patch_t patch2 = make_patch2();
 //   patch_t patch3 = make_patch3();
 //   waitset_t wset = new_waitset();
-// 
+//   weft_t weft = new_weft();
+//   waitset_stats_t stats;
+//
 //   assert(waitset_empty(wset));
 //   print_waitset(wset);
-// 
-//   LIFTERR(add_to_waitset(&wset, patch1));
-//   LIFTERR(add_to_waitset(&wset, patch2));
-//   LIFTERR(add_to_waitset(&wset, patch3));
-// 
+//
+//   LIFTERR(waitset_set_limits(&wset, 1, 0, "/tmp/waitset-spill"));
+//   LIFTERR(add_to_waitset(&wset, PACK_ID(1,4), patch2));
+//   LIFTERR(add_to_waitset(&wset, PACK_ID(2,2), patch3));
 //   assert(!waitset_empty(wset));
-//   print_waitset(wset);
-// 
-//   LIFTERR(remove_from_waitset(&wset, 1));
-//   printf("----------------------\n"); print_waitset(wset);
-//   LIFTERR(add_to_waitset(&wset, patch2));
-// 
-//   printf("----------------------\n"); print_waitset(wset);
-//   patch_t p1 = waitset_pop(&wset);
-//   assert(p1 == patch1);
-//   printf("----------------------\n"); print_waitset(wset);
-//   LIFTERR(add_to_waitset(&wset, patch1));
+//   print_waitset(wset);          /* patch2 is spilled */
+//   waitset_stats(wset, &stats);
+//   assert(stats.patches == 1 && stats.spilled_patches == 1);
+//
+//   assert(waitset_take_covered(&wset, weft) == NULL);
+//   LIFTERR(weft_set(&weft, 1, 4));
+//   vector_t woken = waitset_take_covered(&wset, weft);
+//   assert(VECTOR_LEN(woken) == 1);
+//   print_patch((patch_t)VECTOR_GET(woken, 0));
+//   free((void *)VECTOR_GET(woken, 0)); free(woken);
 //   printf("----------------------\n"); print_waitset(wset);
-// 
-//   delete_waitset(wset, TRUE);
+//
+//   delete_waitset(wset);
+//   delete_weft(weft);
+//   free(patch1); free(patch2); free(patch3);
 //   return 0;
 // }
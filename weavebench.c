@@ -0,0 +1,254 @@
+/* Weavebench: reads in a data file of patches in the same format as
+   snarfstrip, applies them to a blank weave, and then measures how fast the
+   weave can be scanned. Two scans are timed: scouring the weave into a buffer,
+   and scanning it for an anchor id the way apply_patches() does without a
+   position index. Each is run on the weave's own column layout and on a copy in
+   the old layout, where preds and chars were interleaved as uint32 triples in
+   one body array. Scouring the columns is timed both with the visibility bitmap
+   and without it.
+
+   The weave is tiled out to at least 64 MB, so that the scans run out of memory
+   and not out of cache. The tiled weave isn't causally meaningful, but both
+   scans only look at neighboring atoms, so it doesn't matter. */
+
+#include "sburb.h"
+#include "benchmark.h"
+
+#define MIN_BENCH_BYTES (64 << 20)
+
+/* The old layout, and its read macro. */
+typedef struct {
+  uint64_t *ids;
+  uint32_t *bodies;
+} interleaved_t;
+
+#define READ_INTERLEAVED(id, pred, c, id_ptr, body_ptr) do { \
+    id = *id_ptr++;                                         \
+    pred = *((uint64_t *)body_ptr);                         \
+    body_ptr += 2;                                          \
+    c = *body_ptr++;                                        \
+  } while (0);
+
+/* Scour an interleaved weave, the way scour() used to. */
+static int interleaved_scour(wchar_t *buf, interleaved_t weave,
+                             uint32_t length) {
+  uint64_t *ids = weave.ids; uint32_t *bodies = weave.bodies;
+  uint64_t id, pred; uint32_t c;
+  int chars_written = 0;
+
+  for (uint32_t i = 0; i < length; i++) {
+    READ_INTERLEAVED(id, pred, c, ids, bodies);
+    if (ATOM_CHAR_IS_VISIBLE(c)) {
+      uint64_t vid = id; uint32_t vc = c;
+      if (i + 1 < length) {
+        READ_INTERLEAVED(id, pred, c, ids, bodies);
+        if (c == ATOM_CHAR_DEL && pred == vid) { i++; continue; }
+        ids--; bodies -= 3;
+      }
+      buf[chars_written++] = (wchar_t)vc;
+    }
+  }
+  return chars_written;
+}
+
+/* Scour a weave's columns without using the visibility bitmap. */
+static int column_scour(wchar_t *buf, uint64_t *ids, uint64_t *preds,
+                        uint32_t *chars, uint32_t length) {
+  int chars_written = 0;
+  for (uint32_t i = 0; i < length; i++) {
+    uint32_t c = chars[i];
+    if (ATOM_CHAR_IS_VISIBLE(c)) {
+      if (i + 1 < length && chars[i + 1] == ATOM_CHAR_DEL && preds[i + 1] == ids[i])
+        i++;
+      else
+        buf[chars_written++] = (wchar_t)c;
+    }
+  }
+  return chars_written;
+}
+
+/* Return the index of an id in a weave, or -1 if it isn't there. This is the
+   scan in apply_patches(), which now only reads ids. */
+static int64_t anchor_scan(uint64_t *ids, uint32_t length, uint64_t anchor) {
+  for (uint32_t i = 0; i < length; i++)
+    if (ids[i] == anchor) return i;
+  return -1;
+}
+
+/* Where interleaved_anchor_scan() leaves a checksum of what it read. */
+static volatile uint64_t scan_checksum;
+
+/* The same, the way apply_patches() used to do it, reading whole atoms. The
+   preds and chars it reads are summed into scan_checksum, so that the
+   compiler can't drop their loads. */
+static int64_t interleaved_anchor_scan(interleaved_t weave, uint32_t length,
+                                       uint64_t anchor) {
+  uint64_t *ids = weave.ids; uint32_t *bodies = weave.bodies;
+  uint64_t id, pred, sum = 0; uint32_t c;
+  int64_t found = -1;
+  for (uint32_t i = 0; i < length; i++) {
+    READ_INTERLEAVED(id, pred, c, ids, bodies);
+    sum += pred ^ c;
+    if (id == anchor) { found = i; break; }
+  }
+  scan_checksum = sum;
+  return found;
+}
+
+/* Read a patch from a file. Returns NULL at end of file. */
+static patch_t read_patch(FILE *file) {
+  unsigned int chain_count;
+  unsigned int chain_lengths[4096];
+  if (fscanf(file, "%u", &chain_count) != 1) return NULL;
+
+  /* Read chain lengths, calculate atom count */
+  uint32_t atom_count = 0;
+  for (int i = 0; i < chain_count; i++) {
+    int numsread = fscanf(file, "%u", &chain_lengths[i]);
+    assert(numsread == 1);
+    atom_count += chain_lengths[i];
+  }
+
+  /* Allocate everything and write header. */
+  void *patch, *patch_cursor;
+  uint32_t patch_len = patch_necessary_buffer_length(chain_count, atom_count);
+  patch = malloc(patch_len); patch_cursor = patch;
+  write_patch_header(&patch_cursor, patch_len, chain_count);
+
+  /* Write the chain descriptors. */
+  uint32_t offset = 0;
+  for (int i = 0; i < chain_count; i++) {
+    write_chain_descriptor(&patch_cursor, offset, chain_lengths[i]);
+    offset += chain_size_bytes(chain_lengths[i]);
+  }
+
+  /* Write the atoms themselves. */
+  uint32_t *p32 = patch_cursor;
+  for (int i = 0; i < atom_count; i++) {
+    uint32_t c, py, po, iy, io;
+    int numsread = fscanf(file, "%u %u %u %u %u", &c, &py, &po, &iy, &io);
+    assert(numsread == 5);
+    WRITE_ATOM_SEQ(PACK_ID(iy, io), PACK_ID(py, po), c, p32);
+  }
+  return patch;
+}
+
+/* Print the throughput of a timed scan over some number of atoms, both in atoms
+   and in bytes of weave. */
+static void report(const char *name, uint32_t atoms, int reps, int us) {
+  double seconds = (us == 0 ? 1 : us) / 1e6;
+  double atom_bytes = sizeof(uint64_t) * 2 + sizeof(uint32_t);
+  printf("%-26s %8.1f Matoms/s %8.1f MB/s\n", name,
+         (double)atoms * reps / seconds / 1e6,
+         (double)atoms * atom_bytes * reps / seconds / (1 << 20));
+}
+
+int main(int argc, char **argv) {
+  weave_t weave = new_weave(128);
+  int reps = 10;
+
+  /* Check for right number of args */
+  if (argc != 2 && argc != 3) {
+    printf("usage: %s file [reps]\n", argv[0]);
+    exit(1);
+  }
+  if (argc == 3) reps = atoi(argv[2]);
+
+  /* Open the input file, and apply the patches. */
+  FILE *file = fopen(argv[1], "r");
+  if (file == NULL) {
+    printf("%s: could not open file %s\n", argv[0], argv[1]);
+    exit(1);
+  }
+  patch_t patch;
+  while ((patch = read_patch(file)) != NULL) {
+    LIFTERR(apply_patch(&weave, patch));
+    free(patch);
+  }
+  fclose(file);
+
+  /* Tile the weave out in both layouts. The tiles are separated by the weave's
+     own START and END atoms, so every atom in them is still in a valid spot for
+     a scour. */
+  uint32_t atom_bytes = sizeof(uint64_t) * 2 + sizeof(uint32_t);
+  uint32_t tiles = MIN_BENCH_BYTES / (weave.length * atom_bytes) + 1;
+  uint32_t length = weave.length * tiles;
+  uint64_t *ids = malloc(length * sizeof(uint64_t));
+  uint64_t *preds = malloc(length * sizeof(uint64_t));
+  uint32_t *chars = malloc(length * sizeof(uint32_t));
+  uint64_t *visible = calloc((length + 63) / 64, sizeof(uint64_t));
+  interleaved_t old = { malloc(length * sizeof(uint64_t)),
+                        malloc(length * 3 * sizeof(uint32_t)) };
+  wchar_t *buf = malloc(length * sizeof(wchar_t));
+  wchar_t *oldbuf = malloc(length * sizeof(wchar_t));
+  if (!ids || !preds || !chars || !visible || !old.ids || !old.bodies ||
+      !buf || !oldbuf) {
+    printf("%s: out of memory\n", argv[0]);
+    exit(1);
+  }
+  for (uint32_t t = 0; t < tiles; t++) {
+    uint64_t *old_ids = old.ids + t * weave.length;
+    uint32_t *old_bodies = old.bodies + 3 * t * weave.length;
+    for (uint32_t i = 0; i < weave.length; i++) {
+      uint64_t id, pred; uint32_t c;
+      READ_ATOM_IDX(id, pred, c, weave.ids, weave.preds, weave.chars, i);
+      WRITE_ATOM_IDX(id, pred, c, ids, preds, chars, t * weave.length + i);
+      *old_ids++ = id;
+      *(uint64_t *)old_bodies = pred; old_bodies += 2;
+      *old_bodies++ = c;
+    }
+  }
+  for (uint32_t i = 0; i < length; i++)
+    if (ATOM_CHAR_IS_VISIBLE(chars[i]) &&
+        !(i + 1 < length && chars[i + 1] == ATOM_CHAR_DEL && preds[i + 1] == ids[i]))
+      visible[i / 64] |= (uint64_t)1 << (i % 64);
+  printf("%u atoms, %u tiles, %u atoms scanned per pass\n",
+         weave.length, tiles, length);
+
+  /* Scour. */
+  int new_chars = 0, column_chars = 0, old_chars = 0;
+  BENCHMARK_INIT();
+  for (int r = 0; r < reps; r++) {
+    weave_traversal_state_t wts = { chars, visible, 0, length };
+    TICK(); new_chars = scour(buf, length, &wts); TOCK();
+  }
+  report("scour (bitmap)", length, reps, benchmark_total_time);
+  BENCHMARK_INIT();
+  for (int r = 0; r < reps; r++) {
+    TICK(); column_chars = column_scour(oldbuf, ids, preds, chars, length); TOCK();
+  }
+  report("scour (columns)", length, reps, benchmark_total_time);
+  assert(new_chars == column_chars);
+  assert(memcmp(buf, oldbuf, new_chars * sizeof(wchar_t)) == 0);
+  BENCHMARK_INIT();
+  for (int r = 0; r < reps; r++) {
+    TICK(); old_chars = interleaved_scour(oldbuf, old, length); TOCK();
+  }
+  report("scour (interleaved)", length, reps, benchmark_total_time);
+  assert(new_chars == old_chars);
+  assert(memcmp(buf, oldbuf, new_chars * sizeof(wchar_t)) == 0);
+
+  /* Anchor scan, for an id that isn't there, so that the whole weave is
+     read. */
+  int64_t new_pos = 0, old_pos = 0;
+  BENCHMARK_INIT();
+  for (int r = 0; r < reps; r++) {
+    TICK(); new_pos = anchor_scan(ids, length, PACK_ID(0xFFFFFFFF, 1)); TOCK();
+  }
+  report("anchor scan (columns)", length, reps, benchmark_total_time);
+  BENCHMARK_INIT();
+  for (int r = 0; r < reps; r++) {
+    TICK();
+    old_pos = interleaved_anchor_scan(old, length, PACK_ID(0xFFFFFFFF, 1));
+    TOCK();
+  }
+  report("anchor scan (interleaved)", length, reps, benchmark_total_time);
+  assert(new_pos == -1 && old_pos == -1);
+
+  /* Clean up and exit. */
+  free(ids); free(preds); free(chars); free(visible);
+  free(old.ids); free(old.bodies);
+  free(buf); free(oldbuf);
+  delete_weave(weave);
+  return 0;
+}
@@ -140,6 +140,84 @@ int weft_gt(weft_t a, weft_t b) {
   if (a_len > b_len) return 1;
   else return 0;
 }
+
+/* Hash the contents of a weft. Equal wefts hash equally, regardless of how
+   they were built. */
+Word_t weft_hash(weft_t weft) {
+  Word_t index; Word_t *pvalue;
+  uint64_t hash = 14695981039346656037ULL; /* FNV-1a offset basis */
+
+  index = 0;
+  JLF(pvalue, weft, index);
+  while (pvalue != NULL) {
+    hash = (hash ^ PACK_ID(index, *pvalue)) * 1099511628211ULL;
+    JLN(pvalue, weft, index);
+  }
+  return (Word_t)hash;
+}
+
+/* Do two wefts have exactly the same mappings? */
+int weft_equal(weft_t a, weft_t b) {
+  Word_t index_a, index_b; Word_t *pvalue_a, *pvalue_b;
+
+  index_a = index_b = 0;
+  JLF(pvalue_a, a, index_a); JLF(pvalue_b, b, index_b);
+  while (pvalue_a != NULL && pvalue_b != NULL) {
+    if (index_a != index_b || *pvalue_a != *pvalue_b) return 0;
+    JLN(pvalue_a, a, index_a); JLN(pvalue_b, b, index_b);
+  }
+  return pvalue_a == NULL && pvalue_b == NULL;
+}
+
+/* Is a contained in b? That is, does b have a mapping for every yarn in a, at
+   least as high? If so, merging a into b would not change b. This looks at
+   the actual mappings, so the implicit (0, 2) does not count. */
+int weft_leq(weft_t a, weft_t b) {
+  Word_t index; Word_t *pvalue, *pvalue_b;
+
+  index = 0;
+  JLF(pvalue, a, index);
+  while (pvalue != NULL) {
+    JLG(pvalue_b, b, index);
+    if (pvalue_b == NULL || *pvalue_b < *pvalue) return 0;
+    JLN(pvalue, a, index);
+  }
+  return 1;
+}
+
+/* Return a new weft holding the mappings of a that b lacks, or has lower
+   offsets for. Merging the result into b gives the same weft as merging a into
+   b. Returns ERRWEFT on malloc() failure. */
+weft_t weft_diff(weft_t a, weft_t b) {
+  Word_t index; Word_t *pvalue, *pvalue_b;
+  weft_t diff = new_weft();
+
+  index = 0;
+  JLF(pvalue, a, index);
+  while (pvalue != NULL) {
+    JLG(pvalue_b, b, index);
+    if (pvalue_b == NULL || *pvalue_b < *pvalue) {
+      if (weft_set(&diff, index, *pvalue) != 0) {
+        delete_weft(diff);
+        return ERRWEFT;
+      }
+    }
+    JLN(pvalue, a, index);
+  }
+  return diff;
+}
+
+/* Find the first mapping in a weft whose yarn is at least *yarn. If there is
+   one, put its yarn and offset in *yarn and *offset, and return 1. Otherwise,
+   return 0. To go through a whole weft, start with yarn 0, and add 1 to the
+   yarn after each mapping. */
+int weft_next(weft_t weft, uint32_t *yarn, uint32_t *offset) {
+  Word_t index = *yarn; Word_t *pvalue;
+  JLF(pvalue, weft, index);
+  if (pvalue == NULL) return 0;
+  *yarn = index; *offset = *pvalue;
+  return 1;
+}
   
 
 /********************************* Debugging **********************************/
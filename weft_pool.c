@@ -0,0 +1,198 @@
+/* Interned wefts: a pool of immutable, reference-counted wefts, deduplicated
+   by content. Most atoms in a yarn have identical awareness wefts, so the
+   memodict and the wefts pulled during patch application can all share one
+   copy of each distinct weft instead of allocating their own.
+
+   The pool is two sets of JudyL arrays. The first maps content hashes to
+   chains of pool entries; the second maps weft pointers to their entries, so
+   that retaining and releasing a weft doesn't have to hash it. The empty weft
+   is NULL and is never pooled; retaining or releasing it does nothing.
+
+   A pooled weft must never be modified. To derive a new weft from one, copy
+   it, modify the copy, and intern the result.
+
+   The pool is shared by every weave in the process, and weaves can be changed
+   on different threads at once (see docmgr.c), so it's split into shards,
+   each with its own mutex, to keep those threads from queueing up on one
+   lock. An entry's hash chain is in the hash shard picked by its content
+   hash, and its pointer mapping and reference count are in the weft shard
+   picked by its pointer. Retaining and releasing only lock a weft shard,
+   unless the last reference goes. When both are locked, the hash shard is
+   locked first. */
+
+#include "sburb.h"
+
+/* How many shards of each kind. Must be a power of two. */
+#ifndef WEFT_POOL_SHARDS
+#define WEFT_POOL_SHARDS 64
+#endif
+
+typedef struct weft_entry {
+  weft_t weft;                  /* The shared weft itself */
+  Word_t hash;                  /* weft_hash() of the weft */
+  Word_t refs;                  /* Number of outstanding references */
+  struct weft_entry *next;      /* Next entry with the same hash */
+} weft_entry_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  Pvoid_t map;                  /* Hash -> chain, or weft -> entry */
+} pool_shard_t;
+
+static pool_shard_t hash_shards[WEFT_POOL_SHARDS] = {
+  [0 ... WEFT_POOL_SHARDS - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL }
+};
+static pool_shard_t weft_shards[WEFT_POOL_SHARDS] = {
+  [0 ... WEFT_POOL_SHARDS - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL }
+};
+
+/* The shards for a content hash and for a weft pointer. Pointers are mixed
+   first, since their low bits are mostly alignment. */
+static inline pool_shard_t *hash_shard(Word_t hash) {
+  return &hash_shards[hash & (WEFT_POOL_SHARDS - 1)];
+}
+static inline pool_shard_t *weft_shard(weft_t weft) {
+  Word_t x = (Word_t)weft * 0x9E3779B97F4A7C15ULL;
+  return &weft_shards[x >> (8 * sizeof(Word_t) - 16) & (WEFT_POOL_SHARDS - 1)];
+}
+
+/* Find the pool entry for an interned weft, in its weft shard, which must be
+   locked. Returns NULL if the weft is not in the pool. */
+static inline weft_entry_t *pool_entry(pool_shard_t *ws, weft_t weft) {
+  Word_t *pvalue;
+  JLG(pvalue, ws->map, (Word_t)weft);
+  return pvalue == NULL ? NULL : (weft_entry_t *)*pvalue;
+}
+
+/* Intern a weft. Takes ownership of weft, which must not be used afterward,
+   and returns a reference to the pooled weft with the same contents; if there
+   already was one, the argument is deleted. The reference must eventually be
+   given up with weft_release(). Returns ERRWEFT on malloc() failure, in which
+   case the argument is deleted too. */
+weft_t weft_intern(weft_t weft) {
+  Word_t *pvalue_hash, *pvalue_weft; int rc_int;
+  weft_entry_t *entry;
+  pool_shard_t *hs, *ws;
+
+  if (weft == NULL || weft == ERRWEFT) return weft;
+
+  Word_t hash = weft_hash(weft);
+  hs = hash_shard(hash);
+  pthread_mutex_lock(&hs->lock);
+  JLI(pvalue_hash, hs->map, hash);
+  if (pvalue_hash == PJERR) goto fail; /* malloc() error */
+  for (entry = (weft_entry_t *)*pvalue_hash; entry != NULL; entry = entry->next) {
+    if (weft_equal(entry->weft, weft)) {
+      ws = weft_shard(entry->weft);
+      pthread_mutex_lock(&ws->lock);
+      entry->refs++;
+      pthread_mutex_unlock(&ws->lock);
+      pthread_mutex_unlock(&hs->lock);
+      delete_weft(weft);
+      return entry->weft;
+    }
+  }
+
+  /* Not seen before. Put it at the front of its hash chain. */
+  entry = malloc(sizeof(weft_entry_t));
+  if (entry == NULL) goto fail;
+  ws = weft_shard(weft);
+  pthread_mutex_lock(&ws->lock);
+  JLI(pvalue_weft, ws->map, (Word_t)weft);
+  if (pvalue_weft == PJERR) {
+    pthread_mutex_unlock(&ws->lock);
+    free(entry);
+    goto fail;
+  }
+  entry->weft = weft; entry->hash = hash; entry->refs = 1;
+  *pvalue_weft = (Word_t)entry;
+  pthread_mutex_unlock(&ws->lock);
+  entry->next = (weft_entry_t *)*pvalue_hash;
+  *pvalue_hash = (Word_t)entry;
+  pthread_mutex_unlock(&hs->lock);
+  return weft;
+
+ fail:
+  if (pvalue_hash != PJERR && *pvalue_hash == 0) JLD(rc_int, hs->map, hash);
+  pthread_mutex_unlock(&hs->lock);
+  delete_weft(weft);
+  return ERRWEFT;
+}
+
+/* Take another reference to an interned weft. Returns the weft, for
+   convenience. */
+weft_t weft_retain(weft_t weft) {
+  if (weft == NULL || weft == ERRWEFT) return weft;
+  pool_shard_t *ws = weft_shard(weft);
+  pthread_mutex_lock(&ws->lock);
+  weft_entry_t *entry = pool_entry(ws, weft);
+  assert(entry != NULL);
+  entry->refs++;
+  pthread_mutex_unlock(&ws->lock);
+  return weft;
+}
+
+/* Give up a reference to an interned weft. When the last reference goes, the
+   weft is removed from the pool and deleted. */
+void weft_release(weft_t weft) {
+  Word_t *pvalue, hash; int rc_int;
+  weft_entry_t *entry, **link;
+  pool_shard_t *hs, *ws;
+
+  if (weft == NULL || weft == ERRWEFT) return;
+  ws = weft_shard(weft);
+  pthread_mutex_lock(&ws->lock);
+  entry = pool_entry(ws, weft);
+  assert(entry != NULL);
+  if (--entry->refs > 0) { pthread_mutex_unlock(&ws->lock); return; }
+  hash = entry->hash;
+  pthread_mutex_unlock(&ws->lock);
+
+  /* That was the last reference. Lock the hash shard too, in the right order,
+     and look again: while neither was locked, weft_intern() may have handed
+     out a new reference, or another release may already have deleted the
+     entry, and even interned a new weft at the same address. */
+  hs = hash_shard(hash);
+  pthread_mutex_lock(&hs->lock);
+  pthread_mutex_lock(&ws->lock);
+  entry = pool_entry(ws, weft);
+  if (entry == NULL || entry->refs > 0 || entry->hash != hash) {
+    pthread_mutex_unlock(&ws->lock);
+    pthread_mutex_unlock(&hs->lock);
+    return;
+  }
+  JLD(rc_int, ws->map, (Word_t)weft);
+  pthread_mutex_unlock(&ws->lock);
+
+  /* Unlink from the hash chain, dropping the chain if it's now empty. */
+  JLG(pvalue, hs->map, hash);
+  for (link = (weft_entry_t **)pvalue; *link != entry; link = &(*link)->next)
+    NOP;
+  *link = entry->next;
+  if (*pvalue == 0) JLD(rc_int, hs->map, hash);
+  pthread_mutex_unlock(&hs->lock);
+
+  delete_weft(weft);
+  free(entry);
+}
+
+/* Report how many distinct wefts are in the pool, and how many references to
+   them are outstanding. Either pointer may be NULL. The shards are counted
+   one at a time, so with other threads about, this is only a rough count. */
+void weft_pool_stats(Word_t *wefts, Word_t *refs) {
+  Word_t index, count = 0, total = 0; Word_t *pvalue;
+
+  for (int i = 0; i < WEFT_POOL_SHARDS; i++) {
+    pool_shard_t *ws = &weft_shards[i];
+    index = 0;
+    pthread_mutex_lock(&ws->lock);
+    JLF(pvalue, ws->map, index);
+    while (pvalue != NULL) {
+      count++; total += ((weft_entry_t *)*pvalue)->refs;
+      JLN(pvalue, ws->map, index);
+    }
+    pthread_mutex_unlock(&ws->lock);
+  }
+  if (wefts != NULL) *wefts = count;
+  if (refs != NULL) *refs = total;
+}
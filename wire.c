@@ -0,0 +1,256 @@
+/* Wire formats: patches as bytes to send over the network or keep in a log.
+
+   A wire patch starts with a format tag byte. PATCH_WIRE_RAW is followed by
+   the patch exactly as it is in memory. PATCH_WIRE_COMPACT takes advantage of
+   the patch rules (see patch.c) to leave out most of what's in an atom: every
+   id in a patch is in one yarn, and sequential, so they all follow from the
+   first one; every atom in an insertion chain but the head has the atom before
+   it as its predecessor; and chars other than the special ones are usually
+   small. The compact format is:
+
+   <tag><yarn><first offset><chain count>
+   <chain 1 length << 2 | type> <chain 2 length << 2 | type> ...
+   <chain 1 body> <chain 2 body> ...
+
+   where everything but the tag is a varint (seven bits per byte, low bits
+   first, high bit set on every byte but the last), and the chain type is one of
+   the PATCH_CHAIN_* values. An insertion chain's body is its head's
+   predecessor, followed by its chars in UTF-8, so only patches whose chars
+   are all 0x10FFFF or below can be written this way. Deletion and
+   save-awareness chains are just a predecessor for each atom.
+
+   A predecessor is a varint of 0 if it's in the patch's yarn, followed by how
+   far back it is from the atom, or else a varint of its yarn plus 1, followed
+   by the zigzag-encoded difference between its offset and the last such
+   offset in the patch. Deletions tend to be of runs of atoms, so that's
+   usually 1. */
+
+#include "sburb.h"
+
+/* The most bytes a 32-bit varint can take. */
+#define VARINT_MAX 5
+
+/* Write a varint, and advance the pointer past it. */
+static inline void put_varint(uint8_t **ptr, uint32_t x) {
+  uint8_t *p = *ptr;
+  while (x >= 0x80) { *p++ = (x & 0x7F) | 0x80; x >>= 7; }
+  *p++ = x;
+  *ptr = p;
+}
+
+/* Read a varint, and advance the pointer past it. Returns -1 if it runs past
+   end or overflows 32 bits, or 0 on success. */
+static inline int get_varint(const uint8_t **ptr, const uint8_t *end,
+                             uint32_t *x) {
+  const uint8_t *p = *ptr;
+  uint32_t result = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (p == end) return -1;
+    uint8_t byte = *p++;
+    if (shift == 28 && byte > 0x0F) return -1;
+    result |= (uint32_t)(byte & 0x7F) << shift;
+    if (byte < 0x80) { *ptr = p; *x = result; return 0; }
+  }
+  return -1;
+}
+
+/* Write a char as UTF-8, and advance the pointer past it. Returns -1 if it's
+   above 0x10FFFF, which UTF-8 can't hold, or 0 on success. */
+static inline int put_utf8(uint8_t **ptr, uint32_t c) {
+  uint8_t *p = *ptr;
+  if (c > 0x10FFFF) {
+    return -1;
+  } else if (c < 0x80) {
+    *p++ = c;
+  } else if (c < 0x800) {
+    *p++ = 0xC0 | (c >> 6); *p++ = 0x80 | (c & 0x3F);
+  } else if (c < 0x10000) {
+    *p++ = 0xE0 | (c >> 12); *p++ = 0x80 | ((c >> 6) & 0x3F);
+    *p++ = 0x80 | (c & 0x3F);
+  } else {
+    *p++ = 0xF0 | (c >> 18); *p++ = 0x80 | ((c >> 12) & 0x3F);
+    *p++ = 0x80 | ((c >> 6) & 0x3F); *p++ = 0x80 | (c & 0x3F);
+  }
+  *ptr = p;
+  return 0;
+}
+
+/* Read a UTF-8 char, and advance the pointer past it. Returns -1 if it's
+   malformed or runs past end, or 0 on success. Doesn't check for overlong
+   encodings; the only thing that matters here is getting back the chars that
+   were put in. */
+static inline int get_utf8(const uint8_t **ptr, const uint8_t *end,
+                           uint32_t *c) {
+  const uint8_t *p = *ptr;
+  uint32_t x = *p++;
+  int extra;
+
+  if (x < 0x80)                { *ptr = p; *c = x; return 0; }
+  else if ((x & 0xE0) == 0xC0) { x &= 0x1F; extra = 1; }
+  else if ((x & 0xF0) == 0xE0) { x &= 0x0F; extra = 2; }
+  else if ((x & 0xF8) == 0xF0) { x &= 0x07; extra = 3; }
+  else return -1;
+  if (end - p < extra) return -1;
+  for (; extra > 0; extra--) {
+    if ((*p & 0xC0) != 0x80) return -1;
+    x = (x << 6) | (*p++ & 0x3F);
+  }
+  *ptr = p; *c = x;
+  return 0;
+}
+
+/* Write a predecessor for the atom at offset in yarn. */
+static inline void put_pred(uint8_t **ptr, uint64_t pred, uint32_t yarn,
+                            uint32_t offset, uint32_t *last_offset) {
+  if (YARN(pred) == yarn) {
+    put_varint(ptr, 0);
+    put_varint(ptr, offset - OFFSET(pred));
+  } else {
+    int32_t delta = (int32_t)(OFFSET(pred) - *last_offset);
+    put_varint(ptr, YARN(pred) + 1);
+    put_varint(ptr, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+    *last_offset = OFFSET(pred);
+  }
+}
+
+/* Read a predecessor for the atom at offset in yarn. Returns -1 if it's
+   malformed, or 0 on success. */
+static inline int get_pred(const uint8_t **ptr, const uint8_t *end,
+                           uint64_t *pred, uint32_t yarn, uint32_t offset,
+                           uint32_t *last_offset) {
+  uint32_t pred_yarn, x;
+  if (get_varint(ptr, end, &pred_yarn) != 0) return -1;
+  if (get_varint(ptr, end, &x) != 0) return -1;
+  if (pred_yarn == 0) {
+    if (x == 0 || x > offset) return -1;
+    *pred = PACK_ID(yarn, offset - x);
+  } else {
+    *last_offset += (x >> 1) ^ -(x & 1);
+    *pred = PACK_ID(pred_yarn - 1, *last_offset);
+  }
+  return 0;
+}
+
+/* Return the most bytes a patch can take in a given wire format. */
+uint32_t patch_wire_bound(patch_t patch, int format) {
+  if (format == PATCH_WIRE_RAW) return 1 + patch_length_bytes(patch);
+  return 1 + 3 * VARINT_MAX + VARINT_MAX * patch_chain_count(patch) +
+    2 * VARINT_MAX * patch_length_atoms(patch);
+}
+
+/* Write a patch in a given wire format to a buffer, which must have at least
+   patch_wire_bound() bytes of room. Returns the number of bytes written, or 0
+   if the patch has a char the format can't hold. */
+uint32_t patch_to_wire(patch_t patch, int format, uint8_t *buf) {
+  uint8_t *p = buf;
+  *p++ = format;
+  if (format == PATCH_WIRE_RAW) {
+    memcpy(p, patch, patch_length_bytes(patch));
+    return 1 + patch_length_bytes(patch);
+  }
+
+  uint8_t chain_count = patch_chain_count(patch);
+  uint8_t *ptr = (uint8_t *)patch + 5;
+  uint16_t chain_lengths[256];
+  uint32_t *atom = patch_atoms(patch);
+  uint64_t id = *(uint64_t *)atom, pred; uint32_t c;
+  uint32_t yarn = YARN(id), offset = OFFSET(id), last_offset = 0;
+
+  put_varint(&p, yarn); put_varint(&p, offset); put_varint(&p, chain_count);
+  for (int chain = 0; chain < chain_count; chain++) {
+    uint32_t chain_offset;
+    READ_CHAIN_DESCRIPTOR(chain_offset, chain_lengths[chain], ptr);
+    c = atom[4 + 5 * (chain_offset / 20)];
+    int type = c == ATOM_CHAR_DEL ? PATCH_CHAIN_DELETE :
+      c == ATOM_CHAR_SAVE ? PATCH_CHAIN_SAVE : PATCH_CHAIN_INSERT;
+    put_varint(&p, (uint32_t)chain_lengths[chain] << 2 | type);
+  }
+
+  for (int chain = 0; chain < chain_count; chain++) {
+    for (uint16_t i = 0; i < chain_lengths[chain]; i++, offset++) {
+      READ_ATOM_SEQ(id, pred, c, atom);
+      if (!ATOM_CHAR_IS_VISIBLE(c) || i == 0)
+        put_pred(&p, pred, yarn, offset, &last_offset);
+      if (ATOM_CHAR_IS_VISIBLE(c) && put_utf8(&p, c) != 0)
+        return 0;
+    }
+  }
+  return p - buf;
+}
+
+/* Read a patch in any wire format. Returns a new patch, which the caller must
+   free(), or NULL on malloc() failure or if the bytes aren't a well-formed
+   wire patch. This only checks the wire format; the patch itself is no more
+   trustworthy than it was on the other end, so check it with
+   patch_validate(). */
+patch_t patch_from_wire(const uint8_t *buf, uint32_t len) {
+  const uint8_t *p = buf + 1, *end = buf + len;
+  patch_t patch;
+
+  if (len < 1) return NULL;
+  if (buf[0] == PATCH_WIRE_RAW) {
+    if (len < 6 || patch_length_bytes((patch_t)p) != len - 1) return NULL;
+    if ((patch = malloc(len - 1)) == NULL) return NULL;
+    memcpy(patch, p, len - 1);
+    return patch;
+  }
+  if (buf[0] != PATCH_WIRE_COMPACT) return NULL;
+
+  /* Read the header and chain lengths, and make sure the atoms could fit in
+     the rest of the bytes before allocating anything: every atom takes at least
+     one byte, or two if it has a predecessor. */
+  uint32_t yarn, offset, chain_count, atom_count = 0, min_bytes = 0;
+  uint32_t chain_words[255];
+  if (get_varint(&p, end, &yarn) != 0 || get_varint(&p, end, &offset) != 0 ||
+      get_varint(&p, end, &chain_count) != 0)
+    return NULL;
+  if (chain_count == 0 || chain_count > 255) return NULL;
+  for (uint32_t chain = 0; chain < chain_count; chain++) {
+    uint32_t w, n;
+    if (get_varint(&p, end, &w) != 0) return NULL;
+    n = w >> 2;
+    if (n == 0 || n > 0xFFFF || (w & 3) > PATCH_CHAIN_SAVE) return NULL;
+    chain_words[chain] = w;
+    atom_count += n;
+    min_bytes += (w & 3) == PATCH_CHAIN_INSERT ? n + 2 : 2 * n;
+  }
+  if ((uint64_t)offset + atom_count > 0xFFFFFFFF) return NULL;
+  if (min_bytes > (uint32_t)(end - p)) return NULL;
+
+  /* Then decode the atoms straight into the patch. */
+  uint32_t patch_len = patch_necessary_buffer_length(chain_count, atom_count);
+  void *cursor;
+  if ((patch = malloc(patch_len)) == NULL) return NULL;
+  cursor = patch;
+  write_patch_header(&cursor, patch_len, chain_count);
+  for (uint32_t chain = 0, chain_offset = 0; chain < chain_count; chain++) {
+    write_chain_descriptor(&cursor, chain_offset, chain_words[chain] >> 2);
+    chain_offset += chain_size_bytes(chain_words[chain] >> 2);
+  }
+
+  uint32_t *p32 = cursor, last_offset = 0;
+  uint64_t pred = 0;
+  for (uint32_t chain = 0; chain < chain_count; chain++) {
+    int type = chain_words[chain] & 3;
+    for (uint32_t i = 0; i < chain_words[chain] >> 2; i++, offset++) {
+      uint64_t id = PACK_ID(yarn, offset);
+      uint32_t c = type == PATCH_CHAIN_DELETE ? ATOM_CHAR_DEL : ATOM_CHAR_SAVE;
+      if (type != PATCH_CHAIN_INSERT || i == 0) {
+        if (get_pred(&p, end, &pred, yarn, offset, &last_offset) != 0)
+          goto fail;
+      }
+      if (type == PATCH_CHAIN_INSERT) {
+        if (p == end || get_utf8(&p, end, &c) != 0) goto fail;
+        if (!ATOM_CHAR_IS_VISIBLE(c)) goto fail;
+      }
+      WRITE_ATOM_SEQ(id, pred, c, p32);
+      if (type == PATCH_CHAIN_INSERT) pred = id;
+    }
+  }
+  if (p != end) goto fail;
+  return patch;
+
+ fail:
+  free(patch);
+  return NULL;
+}